@@ -16,7 +16,9 @@
 #define __KKM_H__
 
 #include <linux/refcount.h>
+#include <linux/llist.h>
 #include <linux/uaccess.h>
+#include <asm/msr-index.h>
 
 #ifndef static_assert
 #define static_assert(expr, ...) __static_assert(expr, ##__VA_ARGS__, #expr)
@@ -29,11 +31,24 @@
 #include "kkm_ioctl.h"
 #include "kkm_mmu.h"
 #include "kkm_platform.h"
+#include "kkm_tlb.h"
+#include "kkm_direct_io.h"
+#include "kkm_switchless.h"
+#include "kkm_perf.h"
+#include "kkm_bpf.h"
+#include "kkm_rseq.h"
+#include "kkm_fault.h"
 
 extern bool kkm_cpu_full_tlb_flush;
+extern bool kkm_cpu_fsgsbase;
 
-#define KKM_CONTEXT_MAP_PAGE_COUNT (3)
+#define KKM_CONTEXT_MAP_PAGE_COUNT (5)
 #define KKM_CONTEXT_MAP_SIZE (KKM_CONTEXT_MAP_PAGE_COUNT * 4096)
+/*
+ * kkm_run and private area pages are used by kkm,
+ * remaining map pages are allocated on first monitor access
+ */
+#define KKM_CONTEXT_MAP_EAGER_PAGE_COUNT (2)
 
 #define KKM_INVALID_ID (-1ULL)
 /*
@@ -41,16 +56,27 @@ extern bool kkm_cpu_full_tlb_flush;
  */
 #define KKM_MAX_REPEAT_TRAP (16)
 
-/*
- * maximum xsave area allocated
- * one for kernel and one for payload
- */
-#define KKM_FPU_XSAVE_ALLOC_PAGES (2)
-#define KKM_FPU_XSAVE_ALLOC_SIZE (PAGE_SIZE)
+#ifndef MSR_IA32_XFD
+#define MSR_IA32_XFD 0x000001c4
+#define MSR_IA32_XFD_ERR 0x000001c5
+#endif
 
 extern void (*kkm_fpu_save_xstate)(void *);
 extern void (*kkm_fpu_restore_xstate)(void *);
 
+/*
+ * xsave sizes computed at module load from XCR0 and IA32_XSS
+ * payload runs with host XCR0, kkm_xcr0_features.
+ * kernel area holds all enabled features.
+ * payload area starts without XFD features(AMX tile data)
+ * and grows to kkm_xsave_size on first use of one.
+ */
+extern uint64_t kkm_xcr0_features;
+extern uint64_t kkm_xsave_features;
+extern uint64_t kkm_xfd_features;
+extern uint32_t kkm_xsave_size;
+extern uint32_t kkm_xsave_base_size;
+
 extern struct kkm_platform_calls *kkm_platform;
 
 struct kkm_kontext_mmap_area {
@@ -59,6 +85,19 @@ struct kkm_kontext_mmap_area {
 	int offset;
 };
 
+/*
+ * per kontext counters, exposed in debugfs
+ */
+struct kkm_kontext_stats {
+	uint64_t exit_count;
+	uint64_t guest_time_ns;
+	uint64_t page_fault_count;
+	uint64_t hypercall_count;
+	uint64_t last_exit_reason; /* kkm_run exit_reason of last KKM_RUN */
+	uint64_t last_intr_no; /* vector of last guest exit */
+	uint64_t entry_time_ns; /* time of last timed guest entry, 0 if none */
+};
+
 /*
  * per vcpu context area
  * used to save some information
@@ -76,8 +115,11 @@ struct kkm_kontext {
 	 */
 	bool debug_registers_set;
 	int kontext_fd;
-	struct task_struct
-		*task; /* kernel task associated with this kontain kontext */
+	/*
+	 * host task owning kontext for duration of an ioctl, NULL when idle
+	 * any task in kontainer mm can run any idle kontext
+	 */
+	struct task_struct *task;
 	struct kkm *kkm; /* back pointer to kontainer */
 
 	struct kkm_kontext_mmap_area mmap_area[KKM_CONTEXT_MAP_PAGE_COUNT];
@@ -93,13 +135,20 @@ struct kkm_kontext {
 		guest_area_page1_pa; /* physical address of page 1 of guest private area */
 
 	/*
-	 * XSAVE page. First 2k for kernel and next 2k for payload
+	 * payload XSAVE area, payload_xsave_size bytes
+	 * kernel xstate is saved in a per cpu area during guest run
 	 */
-	struct kkm_mmu_page_info xsave;
-	void *kkm_kernel_xsave;
 	void *kkm_payload_xsave;
+	uint32_t payload_xsave_size;
 	bool valid_payload_xsave_area;
 
+	/*
+	 * XFD features payload has used, not armed during guest run
+	 */
+	uint64_t xfd_enabled;
+	uint64_t xfd_err; /* IA32_XFD_ERR captured on #NM exit */
+	uint64_t native_xfd; /* IA32_XFD during guest entry */
+
 	/*
 	 * saved during switch to guest kernel.
 	 * restore during switch back to native kernel
@@ -131,6 +180,13 @@ struct kkm_kontext {
 	 */
 	bool syscall_pending;
 	uint64_t ret_val_mva;
+	bool syscall_return; /* next entry returns from syscall hypercall */
+
+	/*
+	 * page of lazy slot last reported to km
+	 * fault on same page after that is processed normally
+	 */
+	uint64_t lazy_fault_gpa;
 
 	/*
 	 * need to save and restore rbx
@@ -154,6 +210,34 @@ struct kkm_kontext {
 	uint64_t prev_trap_addr;
 	uint64_t prev_error_code;
 	uint64_t trap_repeat_counter;
+
+	/*
+	 * guest TLB invalidations in current run
+	 */
+	struct kkm_tlb_run tlb_run;
+
+	/*
+	 * hypercalls serviced by polling monitor worker
+	 */
+	struct kkm_switchless_state switchless;
+
+	/*
+	 * payload hardware performance counters
+	 */
+	struct kkm_perf_state perf;
+
+	/*
+	 * payload restartable sequences
+	 */
+	struct kkm_rseq_state rseq;
+
+	/*
+	 * delivery of unresolvable payload page faults
+	 */
+	struct kkm_fault_state fault;
+
+	struct kkm_kontext_stats stats;
+	struct dentry *debugfs_dir;
 };
 
 struct kkm_mem_slot {
@@ -171,6 +255,18 @@ struct kkm {
 	int kontainer_fd;
 	refcount_t reference_count;
 
+	/*
+	 * prebuilt kontainer pool list
+	 */
+	struct list_head pool_list;
+
+	/*
+	 * deferred teardown list
+	 */
+	struct llist_node destroy_node;
+
+	struct dentry *debugfs_dir;
+
 	struct mm_struct *mm; /* kernel address space pointer */
 
 	/*
@@ -189,6 +285,17 @@ struct kkm {
 	uint32_t kontext_count;
 	struct kkm_kontext *kontext[KKM_MAX_CONTEXTS];
 
+	/*
+	 * guest fds serviced in kernel, KKM_SET_DIRECT_IO
+	 */
+	spinlock_t direct_io_lock;
+	struct kkm_direct_io_fd direct_io[KKM_DIRECT_IO_MAX_FDS];
+
+	/*
+	 * hypercalls and exceptions go to kkm_bpf_ops first
+	 */
+	bool bpf_ops;
+
 	/*
 	 * page fault lock
 	 * process only one page fault per mm
@@ -196,20 +303,18 @@ struct kkm {
 	struct mutex pf_lock;
 
 	/*
-	 * guest kernel pgd page
+	 * incremented every time kkm changes guest page tables
+	 * in a way that can leave stale TLB entries on other cpus.
+	 * compared with per cpu copy on guest entry.
 	 */
-	struct kkm_mmu_page_info gk_pgd;
+	atomic64_t tlb_gen;
 
 	/*
 	 * guest payload pgd page
+	 * kernel half copied from native kernel, guest kernel code runs on it
 	 */
 	struct kkm_mmu_page_info gp_pgd;
 
-	/*
-	 * guest kernel p4d page
-	 */
-	struct kkm_mmu_page_info gk_p4d;
-
 	/*
 	 * guest payload p4d page
 	 */
@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/bpf.h>
+#include <linux/bpf_verifier.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/filter.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+
+#include "kkm.h"
+#include "kkm_run.h"
+#include "kkm_kontext.h"
+#include "kkm_bpf.h"
+
+#if KKM_BPF_OPS_SUPPORTED
+
+/*
+ * handler context with kkm pointers hidden from programs
+ */
+struct kkm_bpf_kern {
+	struct kkm_bpf_ctx ctx;
+	struct kkm_kontext *kkm_kontext;
+	struct kkm_guest_area *ga;
+	struct kkm_run *kkm_run;
+};
+
+/*
+ * one kkm_bpf_ops can be registered at a time,
+ * used by kontainers that enabled it with KKM_SET_BPF_OPS
+ */
+static struct kkm_bpf_ops __rcu *kkm_bpf_active_ops;
+
+static void kkm_bpf_ctx_init(struct kkm_bpf_kern *kern,
+			     struct kkm_kontext *kkm_kontext,
+			     struct kkm_guest_area *ga, struct kkm_run *kkm_run)
+{
+	memset(kern, 0, sizeof(struct kkm_bpf_kern));
+	kern->kkm_kontext = kkm_kontext;
+	kern->ga = ga;
+	kern->kkm_run = kkm_run;
+	kern->ctx.kontainer_id = kkm_kontext->kkm->id;
+	kern->ctx.kontext_index = kkm_kontext->index;
+}
+
+__bpf_kfunc_start_defs();
+
+/*
+ * payload register by index in struct kkm_regs
+ */
+__bpf_kfunc uint64_t kkm_bpf_get_reg(struct kkm_bpf_ctx *ctx, uint32_t reg)
+{
+	struct kkm_bpf_kern *kern = container_of(ctx, struct kkm_bpf_kern, ctx);
+
+	if (reg >= sizeof(struct kkm_regs) / sizeof(uint64_t)) {
+		return 0;
+	}
+	return ((uint64_t *)&kern->ga->regs)[reg];
+}
+
+/*
+ * rflags is left to kkm, everything else can be changed
+ */
+__bpf_kfunc int kkm_bpf_set_reg(struct kkm_bpf_ctx *ctx, uint32_t reg,
+				uint64_t value)
+{
+	struct kkm_bpf_kern *kern = container_of(ctx, struct kkm_bpf_kern, ctx);
+
+	if (reg >= sizeof(struct kkm_regs) / sizeof(uint64_t) ||
+	    reg * sizeof(uint64_t) == offsetof(struct kkm_regs, rflags)) {
+		return -EINVAL;
+	}
+	((uint64_t *)&kern->ga->regs)[reg] = value;
+	return 0;
+}
+
+/*
+ * guest memory access never sleeps, not present pages fail
+ * and program can defer to monitor
+ */
+__bpf_kfunc int kkm_bpf_read_guest(struct kkm_bpf_ctx *ctx, uint64_t gva,
+				   void *buf, uint32_t buf__sz)
+{
+	struct kkm_bpf_kern *kern = container_of(ctx, struct kkm_bpf_kern, ctx);
+	uint64_t mva = 0;
+
+	if (kkm_guest_range_to_monitor_va(kern->kkm_kontext, gva, buf__sz,
+					  &mva) == false) {
+		return -EFAULT;
+	}
+	if (copy_from_user_nofault(buf, (void __user *)mva, buf__sz)) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+__bpf_kfunc int kkm_bpf_write_guest(struct kkm_bpf_ctx *ctx, uint64_t gva,
+				    const void *buf, uint32_t buf__sz)
+{
+	struct kkm_bpf_kern *kern = container_of(ctx, struct kkm_bpf_kern, ctx);
+	uint64_t mva = 0;
+
+	if (kkm_guest_range_to_monitor_va(kern->kkm_kontext, gva, buf__sz,
+					  &mva) == false) {
+		return -EFAULT;
+	}
+	if (copy_to_user_nofault((void __user *)mva, buf, buf__sz)) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * kkm_run page of kontext, read only
+ */
+__bpf_kfunc int kkm_bpf_read_run(struct kkm_bpf_ctx *ctx, uint32_t offset,
+				 void *buf, uint32_t buf__sz)
+{
+	struct kkm_bpf_kern *kern = container_of(ctx, struct kkm_bpf_kern, ctx);
+
+	if (offset >= PAGE_SIZE || buf__sz > PAGE_SIZE - offset) {
+		return -EINVAL;
+	}
+	memcpy(buf, (uint8_t *)kern->kkm_run + offset, buf__sz);
+	return 0;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(kkm_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, kkm_bpf_get_reg, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, kkm_bpf_set_reg, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, kkm_bpf_read_guest, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, kkm_bpf_write_guest, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, kkm_bpf_read_run, KF_TRUSTED_ARGS)
+BTF_KFUNCS_END(kkm_bpf_kfunc_ids)
+
+static const struct btf_kfunc_id_set kkm_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &kkm_bpf_kfunc_ids,
+};
+
+static int kkm_bpf_ops_init(struct btf *btf)
+{
+	return 0;
+}
+
+/*
+ * ctx is read only, programs change state through kfuncs
+ */
+static bool kkm_bpf_is_valid_access(int off, int size,
+				    enum bpf_access_type type,
+				    const struct bpf_prog *prog,
+				    struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+static const struct bpf_func_proto *
+kkm_bpf_get_func_proto(enum bpf_func_id func_id, const struct bpf_prog *prog)
+{
+	return bpf_base_func_proto(func_id, prog);
+}
+
+static const struct bpf_verifier_ops kkm_bpf_verifier_ops = {
+	.get_func_proto = kkm_bpf_get_func_proto,
+	.is_valid_access = kkm_bpf_is_valid_access,
+};
+
+static int kkm_bpf_ops_init_member(const struct btf_type *t,
+				   const struct btf_member *member, void *kdata,
+				   const void *udata)
+{
+	const struct kkm_bpf_ops *uops = udata;
+	struct kkm_bpf_ops *ops = kdata;
+	uint32_t moff = __btf_member_bit_offset(t, member) / 8;
+
+	if (moff == offsetof(struct kkm_bpf_ops, name)) {
+		if (strscpy(ops->name, uops->name, sizeof(ops->name)) <= 0) {
+			return -EINVAL;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int kkm_bpf_ops_reg(void *kdata, struct bpf_link *link)
+{
+	struct kkm_bpf_ops *ops = kdata;
+
+	if (cmpxchg((struct kkm_bpf_ops **)&kkm_bpf_active_ops, NULL, ops) !=
+	    NULL) {
+		return -EEXIST;
+	}
+	printk(KERN_NOTICE "kkm_bpf_ops_reg: %s registered\n", ops->name);
+	return 0;
+}
+
+static void kkm_bpf_ops_unreg(void *kdata, struct bpf_link *link)
+{
+	struct kkm_bpf_ops *ops = kdata;
+
+	RCU_INIT_POINTER(kkm_bpf_active_ops, NULL);
+	synchronize_rcu();
+	printk(KERN_NOTICE "kkm_bpf_ops_unreg: %s unregistered\n", ops->name);
+}
+
+/*
+ * cfi stubs, never called
+ */
+static int kkm_bpf_ops__hypercall(struct kkm_bpf_ctx *ctx)
+{
+	return KKM_BPF_DEFERRED;
+}
+
+static int kkm_bpf_ops__exception(struct kkm_bpf_ctx *ctx)
+{
+	return KKM_BPF_DEFERRED;
+}
+
+static struct kkm_bpf_ops __kkm_bpf_ops_stubs = {
+	.hypercall = kkm_bpf_ops__hypercall,
+	.exception = kkm_bpf_ops__exception,
+};
+
+static struct bpf_struct_ops kkm_bpf_struct_ops = {
+	.verifier_ops = &kkm_bpf_verifier_ops,
+	.init = kkm_bpf_ops_init,
+	.init_member = kkm_bpf_ops_init_member,
+	.reg = kkm_bpf_ops_reg,
+	.unreg = kkm_bpf_ops_unreg,
+	.cfi_stubs = &__kkm_bpf_ops_stubs,
+	.name = "kkm_bpf_ops",
+	.owner = THIS_MODULE,
+};
+
+/*
+ * registration failure leaves kkm working without programs
+ */
+int kkm_bpf_init(void)
+{
+	int ret_val = 0;
+
+	ret_val = register_btf_kfunc_id_set(BPF_PROG_TYPE_STRUCT_OPS,
+					    &kkm_bpf_kfunc_set);
+	if (ret_val != 0) {
+		printk(KERN_NOTICE
+		       "kkm_bpf_init: kfunc registration failed error(%d)\n",
+		       ret_val);
+		return ret_val;
+	}
+
+	ret_val = register_bpf_struct_ops(&kkm_bpf_struct_ops, kkm_bpf_ops);
+	if (ret_val != 0) {
+		printk(KERN_NOTICE
+		       "kkm_bpf_init: struct_ops registration failed error(%d)\n",
+		       ret_val);
+	}
+	return ret_val;
+}
+
+static int kkm_bpf_run(struct kkm_bpf_kern *kern, bool hypercall)
+{
+	int ret_val = KKM_BPF_DEFERRED;
+	struct kkm_bpf_ops *ops = NULL;
+
+	rcu_read_lock();
+	ops = rcu_dereference(kkm_bpf_active_ops);
+	if (ops != NULL) {
+		if (hypercall == true && ops->hypercall != NULL) {
+			ret_val = ops->hypercall(&kern->ctx);
+		} else if (hypercall == false && ops->exception != NULL) {
+			ret_val = ops->exception(&kern->ctx);
+		}
+	}
+	rcu_read_unlock();
+
+	return ret_val;
+}
+
+/*
+ * syscall or OUT hypercall before it is set up for monitor
+ */
+bool kkm_bpf_hypercall(struct kkm_kontext *kkm_kontext,
+		       struct kkm_guest_area *ga, struct kkm_run *kkm_run,
+		       uint64_t reason, uint64_t hypercall, uint64_t args)
+{
+	struct kkm_bpf_kern kern;
+
+	if (kkm_kontext->kkm->bpf_ops == false ||
+	    rcu_access_pointer(kkm_bpf_active_ops) == NULL) {
+		return false;
+	}
+
+	kkm_bpf_ctx_init(&kern, kkm_kontext, ga, kkm_run);
+	kern.ctx.reason = reason;
+	kern.ctx.hypercall = hypercall;
+	kern.ctx.args = args;
+
+	return kkm_bpf_run(&kern, true) == KKM_BPF_HANDLED;
+}
+
+/*
+ * exception about to be forwarded to monitor
+ */
+bool kkm_bpf_exception(struct kkm_kontext *kkm_kontext,
+		       struct kkm_guest_area *ga, struct kkm_run *kkm_run)
+{
+	struct kkm_bpf_kern kern;
+
+	if (kkm_kontext->kkm->bpf_ops == false ||
+	    rcu_access_pointer(kkm_bpf_active_ops) == NULL) {
+		return false;
+	}
+
+	kkm_bpf_ctx_init(&kern, kkm_kontext, ga, kkm_run);
+	kern.ctx.reason = KKM_BPF_REASON_EXCEPTION;
+	kern.ctx.intr_no = ga->intr_no;
+	kern.ctx.error_code = ga->trap_info.error;
+	kern.ctx.trap_addr = ga->sregs.cr2;
+
+	return kkm_bpf_run(&kern, false) == KKM_BPF_HANDLED;
+}
+
+#else
+
+int kkm_bpf_init(void)
+{
+	return 0;
+}
+
+bool kkm_bpf_hypercall(struct kkm_kontext *kkm_kontext,
+		       struct kkm_guest_area *ga, struct kkm_run *kkm_run,
+		       uint64_t reason, uint64_t hypercall, uint64_t args)
+{
+	return false;
+}
+
+bool kkm_bpf_exception(struct kkm_kontext *kkm_kontext,
+		       struct kkm_guest_area *ga, struct kkm_run *kkm_run)
+{
+	return false;
+}
+
+#endif
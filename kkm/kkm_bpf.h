@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_BPF_H__
+#define __KKM_BPF_H__
+
+#include <linux/version.h>
+
+/*
+ * struct_ops with kfuncs in modules need kernel 6.10 or later,
+ * older kernels get stubs and no KKM_CAP_BPF_OPS
+ */
+#if IS_ENABLED(CONFIG_BPF_JIT) && IS_ENABLED(CONFIG_BPF_SYSCALL) &&            \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0))
+#define KKM_BPF_OPS_SUPPORTED (1)
+#else
+#define KKM_BPF_OPS_SUPPORTED (0)
+#endif
+
+#define KKM_BPF_OPS_NAME_MAX (16)
+
+/*
+ * argument to kkm_bpf_ops handlers, read only for programs.
+ * registers, guest memory and kkm_run page are reached
+ * through kkm_bpf_* kfuncs
+ */
+struct kkm_bpf_ctx {
+	uint64_t kontainer_id;
+	uint64_t kontext_index;
+	uint64_t reason; /* KKM_BPF_REASON_* */
+	uint64_t hypercall; /* syscall number or hypercall port */
+	uint64_t args; /* guest address of hypercall args, KKM_BPF_REASON_HYPERCALL */
+	uint64_t intr_no; /* exception vector, KKM_BPF_REASON_EXCEPTION */
+	uint64_t error_code;
+	uint64_t trap_addr; /* cr2 for page fault */
+};
+
+/*
+ * struct_ops registered by bpf programs
+ * handlers return KKM_BPF_HANDLED to resume payload,
+ * KKM_BPF_DEFERRED to exit to monitor as without program
+ */
+struct kkm_bpf_ops {
+	int (*hypercall)(struct kkm_bpf_ctx *ctx);
+	int (*exception)(struct kkm_bpf_ctx *ctx);
+	char name[KKM_BPF_OPS_NAME_MAX];
+};
+
+struct kkm_kontext;
+struct kkm_guest_area;
+struct kkm_run;
+
+int kkm_bpf_init(void);
+bool kkm_bpf_hypercall(struct kkm_kontext *kkm_kontext,
+		       struct kkm_guest_area *ga, struct kkm_run *kkm_run,
+		       uint64_t reason, uint64_t hypercall, uint64_t args);
+bool kkm_bpf_exception(struct kkm_kontext *kkm_kontext,
+		       struct kkm_guest_area *ga, struct kkm_run *kkm_run);
+
+#endif /* __KKM_BPF_H__ */
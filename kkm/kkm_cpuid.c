@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <asm/processor.h>
+
+#include "kkm.h"
+#include "kkm_misc.h"
+#include "kkm_cpuid.h"
+
+/*
+ * CPUID.(EAX=0DH, ECX=1).EAX bit 3 XSAVES/XRSTORS supported
+ */
+#define KKM_XSAVE_CPUID_XSAVES (1U << 3)
+
+/*
+ * cpuid feature bits that need state components enabled in XCR0
+ * cleared when any of xcr0 components is missing
+ */
+struct kkm_cpuid_mask {
+	uint32_t function;
+	uint32_t index;
+	uint64_t xcr0;
+	uint32_t eax;
+	uint32_t ebx;
+	uint32_t ecx;
+	uint32_t edx;
+};
+
+static const struct kkm_cpuid_mask kkm_cpuid_masks[] = {
+	/* FMA, AVX, F16C */
+	{ 0x1, 0, KKM_XCR0_YMM, 0, 0, BIT(12) | BIT(28) | BIT(29), 0 },
+	/* AVX2, VAES, VPCLMULQDQ */
+	{ 0x7, 0, KKM_XCR0_YMM, 0, BIT(5), BIT(9) | BIT(10), 0 },
+	/*
+	 * AVX512 F, DQ, IFMA, PF, ER, CD, BW, VL
+	 * VBMI, VBMI2, VNNI, BITALG, VPOPCNTDQ
+	 * 4VNNIW, 4FMAPS, VP2INTERSECT, FP16
+	 */
+	{ 0x7, 0, KKM_XCR0_YMM | KKM_XCR0_AVX512, 0,
+	  BIT(16) | BIT(17) | BIT(21) | BIT(26) | BIT(27) | BIT(28) | BIT(30) |
+		  BIT(31),
+	  BIT(1) | BIT(6) | BIT(11) | BIT(12) | BIT(14),
+	  BIT(2) | BIT(3) | BIT(8) | BIT(23) },
+	/* OSPKE */
+	{ 0x7, 0, KKM_XCR0_PKRU, 0, 0, BIT(4), 0 },
+	/* AMX BF16, TILE, INT8 */
+	{ 0x7, 0, KKM_XCR0_XTILE, 0, 0, 0, BIT(22) | BIT(24) | BIT(25) },
+	/* AVX-VNNI, AVX-IFMA, AVX-VNNI-INT8, AVX-NE-CONVERT, AVX-VNNI-INT16 */
+	{ 0x7, 1, KKM_XCR0_YMM, BIT(4) | BIT(23), 0, 0,
+	  BIT(4) | BIT(5) | BIT(10) },
+	/* AVX512-BF16, AVX10 */
+	{ 0x7, 1, KKM_XCR0_YMM | KKM_XCR0_AVX512, BIT(5), 0, 0, BIT(19) },
+	/* AMX FP16, COMPLEX */
+	{ 0x7, 1, KKM_XCR0_XTILE, BIT(21), 0, 0, BIT(8) },
+};
+
+struct kkm_cpuid_table {
+	struct kkm_ec_entry *entries;
+	uint32_t count;
+};
+
+/*
+ * functions with subleaves
+ */
+static bool kkm_cpuid_has_subleaves(uint32_t function)
+{
+	switch (function) {
+	case 0x4:
+	case 0x7:
+	case 0xb:
+	case 0xd:
+	case 0x14:
+	case 0x17:
+	case 0x18:
+	case 0x1d:
+	case 0x1f:
+	case 0x20:
+	case 0x24:
+	case 0x8000001d:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * ec is past the last subleaf of its function
+ * max_index is subleaf 0 eax
+ */
+static bool kkm_cpuid_subleaf_end(struct kkm_ec_entry *ec, uint32_t max_index)
+{
+	if (ec->index == 0) {
+		return false;
+	}
+
+	switch (ec->function) {
+	case 0x4:
+	case 0x8000001d:
+		/* cache type null */
+		return (ec->eax & 0x1f) == 0;
+	case 0xb:
+	case 0x1f:
+		/* level type invalid */
+		return (ec->ecx & 0xff00) == 0;
+	case 0xd:
+		return false;
+	default:
+		/* subleaf 0 eax is max subleaf */
+		return ec->index > max_index;
+	}
+}
+
+/*
+ * leaf 0xD describes XCR0 payload runs with.
+ * supervisor components and XSAVES are not usable from payload.
+ */
+static void kkm_cpuid_xsave_leaf(struct kkm_ec_entry *ec, uint64_t xcr0)
+{
+	if (ec->index == 0) {
+		ec->eax = (uint32_t)xcr0;
+		ec->edx = (uint32_t)(xcr0 >> 32);
+		ec->ebx = kkm_xsave_area_size(xcr0, false);
+		ec->ecx = ec->ebx;
+	} else if (ec->index == 1) {
+		ec->eax &= ~KKM_XSAVE_CPUID_XSAVES;
+		ec->ebx = kkm_xsave_area_size(xcr0, true);
+		ec->ecx = 0;
+		ec->edx = 0;
+	}
+}
+
+static void kkm_cpuid_mask_entry(struct kkm_ec_entry *ec, uint64_t xcr0)
+{
+	const struct kkm_cpuid_mask *mask = NULL;
+	int i = 0;
+
+	if (ec->function == 0xd) {
+		kkm_cpuid_xsave_leaf(ec, xcr0);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kkm_cpuid_masks); i++) {
+		mask = &kkm_cpuid_masks[i];
+		if (mask->function != ec->function || mask->index != ec->index) {
+			continue;
+		}
+		if ((xcr0 & mask->xcr0) == mask->xcr0) {
+			continue;
+		}
+		ec->eax &= ~mask->eax;
+		ec->ebx &= ~mask->ebx;
+		ec->ecx &= ~mask->ecx;
+		ec->edx &= ~mask->edx;
+	}
+}
+
+static int kkm_cpuid_append(struct kkm_cpuid_table *table,
+			    struct kkm_ec_entry *ec)
+{
+	if (table->count >= KKM_CPUID_MAX_ENTRIES) {
+		printk(KERN_NOTICE
+		       "kkm_cpuid_append: table full, function %x index %x dropped\n",
+		       ec->function, ec->index);
+		return -E2BIG;
+	}
+	table->entries[table->count] = *ec;
+	table->count++;
+	return 0;
+}
+
+static int kkm_cpuid_add_function(struct kkm_cpuid_table *table,
+				  uint32_t function, uint64_t xcr0)
+{
+	struct kkm_ec_entry ec;
+	bool subleaves = kkm_cpuid_has_subleaves(function);
+	uint32_t max_index = 0;
+	uint32_t index = 0;
+	int ret_val = 0;
+
+	for (index = 0; index < KKM_CPUID_MAX_SUBLEAF; index++) {
+		memset(&ec, 0, sizeof(struct kkm_ec_entry));
+		ec.function = function;
+		ec.index = index;
+		cpuid_count(function, index, &ec.eax, &ec.ebx, &ec.ecx,
+			    &ec.edx);
+		if (index == 0) {
+			max_index = ec.eax;
+		}
+		if (subleaves == false) {
+			kkm_cpuid_mask_entry(&ec, xcr0);
+			return kkm_cpuid_append(table, &ec);
+		}
+		if (kkm_cpuid_subleaf_end(&ec, max_index) == true) {
+			break;
+		}
+		/* xsave components not in XCR0 */
+		if (function == 0xd && index >= KKM_XSAVE_FIRST_EXTENDED &&
+		    (xcr0 & BIT_ULL(index)) == 0) {
+			continue;
+		}
+		ec.flags = KKM_CPUID_FLAG_SIGNIFICANT_INDEX;
+		kkm_cpuid_mask_entry(&ec, xcr0);
+		ret_val = kkm_cpuid_append(table, &ec);
+		if (ret_val != 0) {
+			break;
+		}
+	}
+	return ret_val;
+}
+
+/*
+ * enumerate basic leaves 0..max and extended leaves 0x80000000..max
+ */
+static void kkm_cpuid_fill(struct kkm_cpuid_table *table, uint64_t xcr0)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	uint32_t max_function = 0;
+	uint32_t function = 0;
+
+	cpuid(0, &eax, &ebx, &ecx, &edx);
+	max_function = min_t(uint32_t, eax, KKM_CPUID_MAX_BASIC);
+	for (function = 0; function <= max_function; function++) {
+		if (kkm_cpuid_add_function(table, function, xcr0) != 0) {
+			return;
+		}
+	}
+
+	cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	max_function = min_t(uint32_t, eax, KKM_CPUID_MAX_EXTENDED);
+	for (function = 0x80000000; function <= max_function; function++) {
+		if (kkm_cpuid_add_function(table, function, xcr0) != 0) {
+			return;
+		}
+	}
+}
+
+/*
+ * KKM_GET_SUPPORTED_CPUID
+ * cpuid as seen by payload, masked to xsave state KKM switches
+ */
+int kkm_cpuid_get_supported(unsigned long arg)
+{
+	struct kkm_cpuid kcpuid;
+	struct kkm_cpuid_table table = { 0 };
+	int ret_val = 0;
+
+	if (copy_from_user(&kcpuid, (void *)arg, sizeof(struct kkm_cpuid))) {
+		ret_val = -EFAULT;
+		goto error;
+	}
+
+	table.entries = kcalloc(KKM_CPUID_MAX_ENTRIES,
+				sizeof(struct kkm_ec_entry), GFP_KERNEL);
+	if (table.entries == NULL) {
+		ret_val = -ENOMEM;
+		goto error;
+	}
+
+	kkm_cpuid_fill(&table, kkm_xcr0_features);
+
+	if (kcpuid.entry_count < table.count) {
+		ret_val = -E2BIG;
+	} else if (copy_to_user(&(((struct kkm_cpuid *)arg)->entries[0]),
+				table.entries,
+				sizeof(struct kkm_ec_entry) * table.count)) {
+		ret_val = -EFAULT;
+		goto error;
+	}
+
+	kcpuid.entry_count = table.count;
+	kcpuid.reserved = 0;
+	if (copy_to_user((void *)arg, &kcpuid, sizeof(struct kkm_cpuid))) {
+		ret_val = -EFAULT;
+	}
+
+error:
+	kfree(table.entries);
+	return ret_val;
+}
+
+/*
+ * XCR0 payload runs with
+ */
+void kkm_cpuid_get_xcrs(struct kkm_xcrs *xcrs)
+{
+	memset(xcrs, 0, sizeof(struct kkm_xcrs));
+	xcrs->nr_xcrs = 1;
+	xcrs->xcrs[0].xcr = KKM_XCR0;
+	xcrs->xcrs[0].value = kkm_xcr0_features;
+}
+
+/*
+ * XCR0 is not switched on guest entry, payload always runs with
+ * kkm_xcr0_features. any other value, subset included, can't be
+ * honoured and is rejected.
+ */
+int kkm_cpuid_set_xcrs(struct kkm_xcrs *xcrs)
+{
+	int i = 0;
+
+	if (xcrs->nr_xcrs > KKM_MAX_XCRS) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < xcrs->nr_xcrs; i++) {
+		if (xcrs->xcrs[i].xcr != KKM_XCR0 ||
+		    xcrs->xcrs[i].value != kkm_xcr0_features) {
+			printk(KERN_NOTICE
+			       "kkm_cpuid_set_xcrs: xcr %x value %llx not supported, host XCR0 %llx\n",
+			       xcrs->xcrs[i].xcr, xcrs->xcrs[i].value,
+			       kkm_xcr0_features);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
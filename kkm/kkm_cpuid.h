@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_CPUID_H__
+#define __KKM_CPUID_H__
+
+/*
+ * XCR0 state components cpuid features depend on
+ */
+#define KKM_XCR0_X87 (1ULL << 0)
+#define KKM_XCR0_SSE (1ULL << 1)
+#define KKM_XCR0_YMM (1ULL << 2)
+#define KKM_XCR0_OPMASK (1ULL << 5)
+#define KKM_XCR0_ZMM_HI256 (1ULL << 6)
+#define KKM_XCR0_HI16_ZMM (1ULL << 7)
+#define KKM_XCR0_PKRU (1ULL << 9)
+#define KKM_XCR0_XTILE_CFG (1ULL << 17)
+#define KKM_XCR0_XTILE_DATA (1ULL << 18)
+
+#define KKM_XCR0_AVX512                                                        \
+	(KKM_XCR0_OPMASK | KKM_XCR0_ZMM_HI256 | KKM_XCR0_HI16_ZMM)
+#define KKM_XCR0_XTILE (KKM_XCR0_XTILE_CFG | KKM_XCR0_XTILE_DATA)
+
+/*
+ * limits on functions and subleaves enumerated
+ */
+#define KKM_CPUID_MAX_SUBLEAF (64)
+#define KKM_CPUID_MAX_BASIC (0x40)
+#define KKM_CPUID_MAX_EXTENDED (0x80000040)
+
+struct kkm_xcrs;
+
+int kkm_cpuid_get_supported(unsigned long arg);
+void kkm_cpuid_get_xcrs(struct kkm_xcrs *xcrs);
+int kkm_cpuid_set_xcrs(struct kkm_xcrs *xcrs);
+
+#endif /* __KKM_CPUID_H__ */
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_debugfs.h"
+
+/*
+ * debugfs layout
+ *     kkm/<kontainer id>/slots
+ *     kkm/<kontainer id>/kontext_count
+ *     kkm/<kontainer id>/<kontext index>/state
+ */
+static struct dentry *kkm_debugfs_root = NULL;
+
+static int kkm_debugfs_slots_show(struct seq_file *m, void *unused)
+{
+	struct kkm *kkm = m->private;
+	struct kkm_mem_slot *mem_slot = NULL;
+	int i = 0;
+
+	seq_printf(m, "slot\tflags\tguest_phys_addr\tmemory_size\tuserspace_addr\n");
+
+	mutex_lock(&kkm->mem_lock);
+	for (i = 0; i < KKM_MAX_MEMORY_SLOTS; i++) {
+		mem_slot = &kkm->mem_slot[i];
+		if (mem_slot->used == false) {
+			continue;
+		}
+		seq_printf(m, "%d\t%x\t%llx\t%llx\t%llx\n", i,
+			   mem_slot->mr.flags, mem_slot->mr.guest_phys_addr,
+			   mem_slot->mr.memory_size,
+			   mem_slot->mr.userspace_addr);
+	}
+	mutex_unlock(&kkm->mem_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kkm_debugfs_slots);
+
+static int kkm_debugfs_kontext_state_show(struct seq_file *m, void *unused)
+{
+	struct kkm_kontext *kkm_kontext = m->private;
+	struct kkm_guest_area *ga =
+		(struct kkm_guest_area *)kkm_kontext->guest_area;
+	struct kkm_kontext_stats *stats = &kkm_kontext->stats;
+
+	seq_printf(m,
+		   "id\t: %llu\n"
+		   "cpu\t: %lld\n"
+		   "last exit reason\t: %llu\n"
+		   "last vector\t: %lld\n"
+		   "exits\t: %llu\n"
+		   "guest time ns\t: %llu\n"
+		   "page faults\t: %llu\n"
+		   "hypercalls\t: %llu\n"
+		   "syscall pending\t: %d\n"
+		   "syscall ret_val mva\t: %llx\n",
+		   kkm_kontext->id, (int64_t)ga->cpu,
+		   READ_ONCE(stats->last_exit_reason),
+		   (int64_t)READ_ONCE(stats->last_intr_no),
+		   READ_ONCE(stats->exit_count),
+		   READ_ONCE(stats->guest_time_ns),
+		   READ_ONCE(stats->page_fault_count),
+		   READ_ONCE(stats->hypercall_count),
+		   kkm_kontext->syscall_pending, kkm_kontext->ret_val_mva);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kkm_debugfs_kontext_state);
+
+void kkm_debugfs_init(void)
+{
+	kkm_debugfs_root = debugfs_create_dir("kkm", NULL);
+}
+
+void kkm_debugfs_cleanup(void)
+{
+	debugfs_remove_recursive(kkm_debugfs_root);
+	kkm_debugfs_root = NULL;
+}
+
+void kkm_debugfs_kontainer_add(struct kkm *kkm)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%llu", kkm->id);
+	kkm->debugfs_dir = debugfs_create_dir(name, kkm_debugfs_root);
+	debugfs_create_file("slots", S_IRUGO, kkm->debugfs_dir, kkm,
+			    &kkm_debugfs_slots_fops);
+	debugfs_create_u32("kontext_count", S_IRUGO, kkm->debugfs_dir,
+			   &kkm->kontext_count);
+}
+
+void kkm_debugfs_kontainer_remove(struct kkm *kkm)
+{
+	debugfs_remove_recursive(kkm->debugfs_dir);
+	kkm->debugfs_dir = NULL;
+}
+
+void kkm_debugfs_kontext_add(struct kkm_kontext *kkm_kontext)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%llu", kkm_kontext->index);
+	kkm_kontext->debugfs_dir =
+		debugfs_create_dir(name, kkm_kontext->kkm->debugfs_dir);
+	debugfs_create_file("state", S_IRUGO, kkm_kontext->debugfs_dir,
+			    kkm_kontext, &kkm_debugfs_kontext_state_fops);
+}
+
+void kkm_debugfs_kontext_remove(struct kkm_kontext *kkm_kontext)
+{
+	debugfs_remove_recursive(kkm_kontext->debugfs_dir);
+	kkm_kontext->debugfs_dir = NULL;
+}
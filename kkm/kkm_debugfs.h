@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_DEBUGFS_H__
+#define __KKM_DEBUGFS_H__
+
+void kkm_debugfs_init(void);
+void kkm_debugfs_cleanup(void);
+
+void kkm_debugfs_kontainer_add(struct kkm *kkm);
+void kkm_debugfs_kontainer_remove(struct kkm *kkm);
+
+void kkm_debugfs_kontext_add(struct kkm_kontext *kkm_kontext);
+void kkm_debugfs_kontext_remove(struct kkm_kontext *kkm_kontext);
+
+#endif /* __KKM_DEBUGFS_H__ */
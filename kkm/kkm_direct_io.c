@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/moduleparam.h>
+#include <asm/unistd.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_kontainer.h"
+#include "kkm_direct_io.h"
+#include "kkm_statistics.h"
+
+/*
+ * I/O hypercalls on fds registered with KKM_SET_DIRECT_IO
+ * are serviced in KKM_RUN without exit to km
+ */
+static bool __read_mostly direct_io = true;
+module_param(direct_io, bool, S_IRUGO | S_IWUSR);
+
+/*
+ * one direct I/O request decoded from hypercall registers
+ */
+struct kkm_direct_io_req {
+	int32_t guest_fd;
+	uint64_t buf;
+	uint64_t len;
+	bool write;
+	bool positional;
+	loff_t pos;
+};
+
+void kkm_direct_io_init(struct kkm *kkm)
+{
+	int i = 0;
+
+	spin_lock_init(&kkm->direct_io_lock);
+	for (i = 0; i < KKM_DIRECT_IO_MAX_FDS; i++) {
+		kkm->direct_io[i].guest_fd = -1;
+		kkm->direct_io[i].host_fd = -1;
+		kkm->direct_io[i].ops = 0;
+	}
+}
+
+/*
+ * forked child inherits monitor fd table, keep registrations
+ */
+void kkm_direct_io_clone(struct kkm *kkm, struct kkm *parent)
+{
+	spin_lock(&parent->direct_io_lock);
+	/* both kontainers use same lock class, child is not visible yet */
+	spin_lock_nested(&kkm->direct_io_lock, SINGLE_DEPTH_NESTING);
+	memcpy(kkm->direct_io, parent->direct_io, sizeof(kkm->direct_io));
+	spin_unlock(&kkm->direct_io_lock);
+	spin_unlock(&parent->direct_io_lock);
+}
+
+/*
+ * add, change or remove(ops == 0) guest fd registration
+ * km removes registration before closing or reusing host fd
+ */
+int kkm_direct_io_set(struct kkm *kkm, struct kkm_direct_io *dio)
+{
+	int ret_val = 0;
+	int i = 0;
+	int free_index = -1;
+
+	if (dio->guest_fd < 0 || (dio->ops & ~KKM_DIRECT_IO_OPS) != 0 ||
+	    (dio->ops != 0 && dio->host_fd < 0)) {
+		return -EINVAL;
+	}
+
+	spin_lock(&kkm->direct_io_lock);
+	for (i = 0; i < KKM_DIRECT_IO_MAX_FDS; i++) {
+		if (kkm->direct_io[i].guest_fd == dio->guest_fd) {
+			break;
+		}
+		if (free_index == -1 && kkm->direct_io[i].guest_fd == -1) {
+			free_index = i;
+		}
+	}
+	if (i == KKM_DIRECT_IO_MAX_FDS) {
+		if (dio->ops == 0) {
+			goto error;
+		}
+		if (free_index == -1) {
+			ret_val = -ENOSPC;
+			goto error;
+		}
+		i = free_index;
+	}
+
+	if (dio->ops == 0) {
+		kkm->direct_io[i].guest_fd = -1;
+		kkm->direct_io[i].host_fd = -1;
+		kkm->direct_io[i].ops = 0;
+	} else {
+		kkm->direct_io[i].guest_fd = dio->guest_fd;
+		kkm->direct_io[i].host_fd = dio->host_fd;
+		kkm->direct_io[i].ops = dio->ops;
+	}
+
+error:
+	spin_unlock(&kkm->direct_io_lock);
+	return ret_val;
+}
+
+/*
+ * decode read/write style hypercall
+ * send/recv are same as write/read without flags and address
+ */
+static bool kkm_direct_io_decode(struct kkm_guest_area *ga,
+				 struct kkm_direct_io_req *req)
+{
+	req->guest_fd = (int32_t)ga->regs.rdi;
+	req->buf = ga->regs.rsi;
+	req->len = ga->regs.rdx;
+	req->positional = false;
+	req->pos = 0;
+
+	switch (ga->regs.rax) {
+	case __NR_read:
+		req->write = false;
+		break;
+	case __NR_write:
+		req->write = true;
+		break;
+	case __NR_pread64:
+		req->write = false;
+		req->positional = true;
+		req->pos = ga->regs.r10;
+		break;
+	case __NR_pwrite64:
+		req->write = true;
+		req->positional = true;
+		req->pos = ga->regs.r10;
+		break;
+	case __NR_recvfrom:
+	case __NR_sendto:
+		if (ga->regs.r10 != 0 || ga->regs.r8 != 0) {
+			return false;
+		}
+		req->write = (ga->regs.rax == __NR_sendto);
+		break;
+	default:
+		return false;
+	}
+
+	if (req->len == 0 || req->len > MAX_RW_COUNT || req->pos < 0) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * host fd registered for guest fd and operation, -1 if none
+ */
+static int kkm_direct_io_host_fd(struct kkm *kkm, int32_t guest_fd,
+				 bool write)
+{
+	int i = 0;
+	int host_fd = -1;
+	uint32_t op = write ? KKM_DIRECT_IO_WRITE : KKM_DIRECT_IO_READ;
+
+	spin_lock(&kkm->direct_io_lock);
+	for (i = 0; i < KKM_DIRECT_IO_MAX_FDS; i++) {
+		if (kkm->direct_io[i].guest_fd == guest_fd) {
+			if ((kkm->direct_io[i].ops & op) != 0) {
+				host_fd = kkm->direct_io[i].host_fd;
+			}
+			break;
+		}
+	}
+	spin_unlock(&kkm->direct_io_lock);
+	return host_fd;
+}
+
+/*
+ * guest buffer has to be one linear range of monitor memory
+ */
+static bool kkm_direct_io_buffer(struct kkm_kontext *kkm_kontext,
+				 struct kkm_direct_io_req *req,
+				 uint64_t *monitor_va)
+{
+	uint64_t end_mva = 0;
+	bool priv_area = false;
+
+	if (kkm_guest_va_to_monitor_va(kkm_kontext, req->buf, monitor_va,
+				       &priv_area) == false ||
+	    priv_area == true) {
+		return false;
+	}
+	if (kkm_guest_va_to_monitor_va(kkm_kontext, req->buf + req->len - 1,
+				       &end_mva, &priv_area) == false ||
+	    priv_area == true) {
+		return false;
+	}
+	if (end_mva - *monitor_va != req->len - 1) {
+		return false;
+	}
+	/*
+	 * km populates lazy slot pages on memory fault exit,
+	 * copy here would fault in zero pages behind its back
+	 */
+	if (kkm_kontainer_lazy_slot_range(kkm_kontext->kkm,
+					  *monitor_va - KKM_KM_USER_MEM_BASE,
+					  req->len) >= 0) {
+		return false;
+	}
+	return access_ok((void __user *)*monitor_va, req->len);
+}
+
+/*
+ * files that can be used without km
+ *     positional I/O on files that allow it
+ *     stream I/O on sockets and pipes, writes only when fd is non blocking,
+ *     a blocking write can't be left partially done
+ */
+static bool kkm_direct_io_file_ok(struct file *file,
+				  struct kkm_direct_io_req *req)
+{
+	umode_t mode = file_inode(file)->i_mode;
+
+	if (req->positional == true) {
+		if (req->write == true) {
+			return (file->f_mode & FMODE_PWRITE) != 0;
+		}
+		return (file->f_mode & FMODE_PREAD) != 0;
+	}
+	if (!S_ISSOCK(mode) && !S_ISFIFO(mode)) {
+		return false;
+	}
+	if (req->write == true && (file->f_flags & O_NONBLOCK) == 0) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * service I/O hypercall directly between guest memory and monitor file
+ * never blocks, returns false to let km handle the hypercall
+ */
+bool kkm_direct_io_hypercall(struct kkm_kontext *kkm_kontext,
+			     struct kkm_guest_area *ga)
+{
+	struct kkm_direct_io_req req;
+	struct file *file = NULL;
+	struct iovec iov;
+	struct iov_iter iter;
+	uint64_t monitor_va = 0;
+	loff_t *ppos = NULL;
+	ssize_t count = 0;
+	int host_fd = -1;
+	bool ret_val = false;
+
+	if (direct_io == false) {
+		return false;
+	}
+	if (kkm_direct_io_decode(ga, &req) == false) {
+		return false;
+	}
+	host_fd = kkm_direct_io_host_fd(kkm_kontext->kkm, req.guest_fd,
+					req.write);
+	if (host_fd < 0) {
+		return false;
+	}
+
+	if (kkm_direct_io_buffer(kkm_kontext, &req, &monitor_va) == false) {
+		goto fallback;
+	}
+
+	file = fget(host_fd);
+	if (file == NULL) {
+		goto fallback;
+	}
+	if (kkm_direct_io_file_ok(file, &req) == false) {
+		goto fallback;
+	}
+
+	if (req.positional == true) {
+		ppos = &req.pos;
+	}
+	iov.iov_base = (void __user *)monitor_va;
+	iov.iov_len = req.len;
+	iov_iter_init(&iter, req.write ? WRITE : READ, &iov, 1, req.len);
+
+	if (req.write == true) {
+		count = vfs_iter_write(file, &iter, ppos, RWF_NOWAIT);
+	} else {
+		count = vfs_iter_read(file, &iter, ppos, RWF_NOWAIT);
+	}
+
+	/*
+	 * would block on a blocking fd, file doesn't support RWF_NOWAIT
+	 * or interrupted, km redoes the call
+	 */
+	if ((count == -EAGAIN && (file->f_flags & O_NONBLOCK) == 0) ||
+	    count == -EOPNOTSUPP || count == -EINTR || count == -ERESTARTSYS ||
+	    count == -ERESTARTNOINTR || count == -ERESTARTNOHAND) {
+		goto fallback;
+	}
+
+	/*
+	 * RWF_NOWAIT positional read stops at first page not in page cache,
+	 * short count is not end of file, km does the blocking read
+	 */
+	if (req.positional == true && req.write == false && count >= 0 &&
+	    count < req.len) {
+		goto fallback;
+	}
+
+	ga->regs.rax = count;
+	kkm_kontext->syscall_return = true;
+	ret_val = true;
+
+	/* statistics */
+	kkm_statistics_direct_io_count_inc();
+	goto end;
+
+fallback:
+	/* statistics */
+	kkm_statistics_direct_io_fallback_count_inc();
+
+end:
+	if (file != NULL) {
+		fput(file);
+	}
+	return ret_val;
+}
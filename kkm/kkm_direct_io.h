@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_DIRECT_IO_H__
+#define __KKM_DIRECT_IO_H__
+
+/*
+ * guest fds km can register for direct I/O per kontainer
+ */
+#define KKM_DIRECT_IO_MAX_FDS (32)
+
+/*
+ * direct I/O fd table entry, guest_fd is -1 when unused
+ */
+struct kkm_direct_io_fd {
+	int32_t guest_fd;
+	int32_t host_fd;
+	uint32_t ops;
+};
+
+struct kkm;
+struct kkm_kontext;
+struct kkm_guest_area;
+struct kkm_direct_io;
+
+void kkm_direct_io_init(struct kkm *kkm);
+void kkm_direct_io_clone(struct kkm *kkm, struct kkm *parent);
+int kkm_direct_io_set(struct kkm *kkm, struct kkm_direct_io *dio);
+bool kkm_direct_io_hypercall(struct kkm_kontext *kkm_kontext,
+			     struct kkm_guest_area *ga);
+
+#endif /* __KKM_DIRECT_IO_H__ */
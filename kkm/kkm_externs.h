@@ -31,11 +31,21 @@
 #define KKM_KM_RSRV_VDSOSLOT (41)
 #define KKM_KM_RSRV_KMGUESTMEM_SLOT (42)
 
+/*
+ * guest physical memory spans kkm_guest_pml4_count pml4 entries
+ * (guest_pml4_entries module parameter), 512GB each
+ */
+#define KKM_GUEST_PML4_ENTRY_SIZE (512 * KKM_GIB)
+#define KKM_GUEST_PML4_ENTRIES_MAX (64)
+extern uint32_t kkm_guest_pml4_count;
+
 /*
  * bottom portion of guest address space
  */
 #define KKM_GUEST_MEM_START_VA (2 * KKM_MIB)
-#define KKM_GUEST_MAX_PHYS_MEM (512 * KKM_GIB)
+#define KKM_GUEST_MEM_BOTTOM_END_VA (KKM_GUEST_PML4_ENTRY_SIZE)
+#define KKM_GUEST_MAX_PHYS_MEM                                                 \
+	((uint64_t)kkm_guest_pml4_count * KKM_GUEST_PML4_ENTRY_SIZE)
 
 /*
  * top portion of guest address space
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/uaccess.h>
+#include <asm/traps.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_statistics.h"
+#include "kkm_fault.h"
+
+void kkm_fault_init(struct kkm_kontext *kkm_kontext)
+{
+	struct kkm_fault_state *fs = &kkm_kontext->fault;
+
+	fs->flags = 0;
+	fs->handler = 0;
+	fs->stack = 0;
+	fs->stack_size = 0;
+}
+
+int kkm_fault_set(struct kkm_kontext *kkm_kontext,
+		  struct kkm_fault_handler *fh)
+{
+	struct kkm_fault_state *fs = &kkm_kontext->fault;
+
+	if ((fh->flags & ~(KKM_FAULT_FLAG_EXIT | KKM_FAULT_FLAG_REFLECT)) !=
+		    0 ||
+	    fh->padding != 0) {
+		return -EINVAL;
+	}
+	if ((fh->flags & KKM_FAULT_FLAG_REFLECT) && fh->handler == 0) {
+		return -EINVAL;
+	}
+	if (fh->stack + fh->stack_size < fh->stack) {
+		return -EINVAL;
+	}
+
+	fs->flags = fh->flags;
+	fs->handler = fh->handler;
+	fs->stack = fh->stack;
+	fs->stack_size = fh->stack_size;
+	return 0;
+}
+
+/*
+ * build kkm_fault_frame on payload stack and continue at handler
+ * frame sits where a call would have left it, frame + 8 is 16 byte
+ * aligned as on function entry.
+ */
+static bool kkm_fault_reflect(struct kkm_kontext *kkm_kontext,
+			      struct kkm_guest_area *ga, uint64_t cr2,
+			      uint64_t error_code)
+{
+	struct kkm_fault_state *fs = &kkm_kontext->fault;
+	struct kkm_fault_frame frame;
+	uint64_t sp = ga->regs.rsp - KKM_ABI_REDZONE;
+	uint64_t frame_gva = 0;
+	uint64_t mva = 0;
+
+	/*
+	 * faults on alternate stack itself stay on it,
+	 * either way frame has to fit in alternate stack without wrapping
+	 */
+	if (fs->stack_size != 0 &&
+	    (ga->regs.rsp - fs->stack >= fs->stack_size)) {
+		sp = fs->stack + fs->stack_size;
+	}
+
+	frame_gva = ((sp - sizeof(struct kkm_fault_frame)) & ~0xfULL) - 8;
+	if (fs->stack_size != 0 && (frame_gva < fs->stack || frame_gva > sp)) {
+		return false;
+	}
+
+	frame.return_address = 0;
+	frame.rip = ga->regs.rip;
+	frame.rsp = ga->regs.rsp;
+	frame.rflags = ga->regs.rflags;
+	frame.cr2 = cr2;
+	frame.error_code = error_code;
+	frame.rdi = ga->regs.rdi;
+	frame.rsi = ga->regs.rsi;
+	frame.rdx = ga->regs.rdx;
+
+	if (kkm_guest_range_to_monitor_va(kkm_kontext, frame_gva,
+					  sizeof(struct kkm_fault_frame),
+					  &mva) == false) {
+		return false;
+	}
+	if (copy_to_user((void __user *)mva, &frame,
+			 sizeof(struct kkm_fault_frame))) {
+		return false;
+	}
+
+	ga->regs.rsp = frame_gva;
+	ga->regs.rdi = frame_gva;
+	ga->regs.rsi = cr2;
+	ga->regs.rdx = error_code;
+	ga->regs.rip = fs->handler;
+	ga->regs.rflags &= ~X86_EFLAGS_DF;
+	return true;
+}
+
+/*
+ * payload page fault at cr2 can't be resolved from monitor memory
+ * returns -EFAULT when monitor didn't ask for delivery,
+ * KKM_KONTEXT_FAULT_PROCESS_DONE when payload continues at its handler,
+ * 0 with KKM_EXIT_EXCEPTION set up in kkm_run otherwise.
+ */
+int kkm_fault_unresolved(struct kkm_kontext *kkm_kontext,
+			 struct kkm_guest_area *ga, struct kkm_run *kkm_run,
+			 uint64_t cr2, uint64_t error_code)
+{
+	struct kkm_fault_state *fs = &kkm_kontext->fault;
+
+	if (fs->flags == 0) {
+		return -EFAULT;
+	}
+
+	/*
+	 * same fault is not counted as a repeat once delivered
+	 */
+	kkm_kontext->prev_trap_no = -1;
+	kkm_kontext->trap_repeat_counter = -1;
+
+	if ((fs->flags & KKM_FAULT_FLAG_REFLECT) &&
+	    kkm_fault_reflect(kkm_kontext, ga, cr2, error_code) == true) {
+		ga->sregs.cr2 = 0;
+		kkm_statistics_reflected_page_fault_count_inc();
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+
+	ga->sregs.cr2 = cr2;
+	kkm_run->exit_reason = KKM_EXIT_EXCEPTION;
+	kkm_run->ex.exception = X86_TRAP_PF;
+	kkm_run->ex.error_code = error_code;
+	kkm_statistics_exception_page_fault_count_inc();
+	return 0;
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_FAULT_H__
+#define __KKM_FAULT_H__
+
+struct kkm_kontext;
+struct kkm_guest_area;
+struct kkm_run;
+struct kkm_fault_handler;
+
+/*
+ * unresolvable page fault delivery of a kontext,
+ * KKM_KONTEXT_SET_FAULT_HANDLER
+ */
+struct kkm_fault_state {
+	uint32_t flags; /* 0 fails KKM_RUN with EFAULT */
+	uint64_t handler; /* guest address of handler */
+	uint64_t stack; /* alternate stack, stack_size 0 when none */
+	uint64_t stack_size;
+};
+
+void kkm_fault_init(struct kkm_kontext *kkm_kontext);
+int kkm_fault_set(struct kkm_kontext *kkm_kontext,
+		  struct kkm_fault_handler *fh);
+int kkm_fault_unresolved(struct kkm_kontext *kkm_kontext,
+			 struct kkm_guest_area *ga, struct kkm_run *kkm_run,
+			 uint64_t cr2, uint64_t error_code);
+
+#endif /* __KKM_FAULT_H__ */
@@ -177,6 +177,13 @@ int kkm_idt_descr_init(void)
 		gs[i].offset_low = intr_entry_addr & 0xFFFF;
 		gs[i].segment = __KERNEL_CS;
 		gs[i].bits.ist = 0;
+		/* ist entries are 1 based in gate */
+		if (i == X86_TRAP_NMI) {
+			gs[i].bits.ist = KKM_IST_INDEX_NMI + 1;
+		}
+		if (i == X86_TRAP_MC) {
+			gs[i].bits.ist = KKM_IST_INDEX_MCE + 1;
+		}
 		gs[i].bits.zero = 0;
 		gs[i].bits.type = GATE_INTERRUPT;
 		gs[i].bits.dpl = 0;
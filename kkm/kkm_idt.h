@@ -15,6 +15,13 @@
 #ifndef __KKM_IDT_H__
 #define __KKM_IDT_H__
 
+/*
+ * tss ist slots linux leaves unused(IST6 and IST7)
+ * kkm idt gates use them, host idt never points to kkm stacks
+ */
+#define KKM_IST_INDEX_MCE (5)
+#define KKM_IST_INDEX_NMI (6)
+
 int kkm_idt_init(void);
 void kkm_idt_cleanup(void);
 int kkm_idt_get_desc(struct desc_ptr *native_desc, struct desc_ptr *guest_desc);
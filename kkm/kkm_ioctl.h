@@ -32,11 +32,25 @@
 #define KKM_CHECK_EXTENSION _IO(KKM_IO, 3)
 #define KKM_GET_CONTEXT_MAP_SIZE _IO(KKM_IO, 4)
 #define KKM_GET_SUPPORTED_CONTEXT_INFO _IOWR(KKM_IO, 5, struct kkm_cpuid)
+#define KKM_GET_SUPPORTED_CPUID _IOWR(KKM_IO, 6, struct kkm_cpuid)
 
 #define KKM_ADD_EXECUTION_CONTEXT _IO(KKM_IO, 0x41)
 #define KKM_MEMORY _IOW(KKM_IO, 0x46, struct kkm_memory_region)
 #define KKM_SET_ID_MAP_ADDR _IOW(KKM_IO, 0x48, uint64_t)
+#define KKM_CLONE_KONTAINER _IOWR(KKM_IO, 0x49, struct kkm_clone_kontainer)
+#define KKM_SET_DIRECT_IO _IOW(KKM_IO, 0x4a, struct kkm_direct_io)
+#define KKM_RUN_KONTEXT _IO(KKM_IO, 0x4b)
+#define KKM_SET_BPF_OPS _IO(KKM_IO, 0x4c)
 
+/*
+ * kontext ioctls
+ * any task in kontainer mm can issue them on an idle kontext.
+ * KKM_RUN, KKM_RUN_KONTEXT and ioctls changing kontext state are owned
+ * by one task at a time, they fail with EBUSY while another task owns it.
+ * KKM_GET_REGS, KKM_GET_SREGS, KKM_GET_XCRS, KKM_KONTEXT_GET_SAVE_INFO and
+ * KKM_GET_EVENTS don't take ownership and return a snapshot
+ * when kontext is running.
+ */
 #define KKM_RUN _IO(KKM_IO, 0x80)
 #define KKM_GET_REGS _IOR(KKM_IO, 0x81, struct kkm_regs)
 #define KKM_SET_REGS _IOW(KKM_IO, 0x82, struct kkm_regs)
@@ -59,17 +73,40 @@
 #define KKM_GET_XCRS _IOR(KKM_IO, 0xa6, struct kkm_xcrs)
 #define KKM_SET_XCRS _IOW(KKM_IO, 0xa7, struct kkm_xcrs)
 
+#define KKM_KONTEXT_SET_FAULT_HANDLER _IOW(KKM_IO, 0xf3, struct kkm_fault_handler)
+#define KKM_KONTEXT_SET_RSEQ _IOW(KKM_IO, 0xf4, struct kkm_rseq)
 #define KKM_KONTEXT_REUSE _IO(KKM_IO, 0xf5)
 #define KKM_KONTEXT_GET_SAVE_INFO _IOR(KKM_IO, 0xf6, struct kkm_save_info)
 #define KKM_KONTEXT_SET_SAVE_INFO _IOW(KKM_IO, 0xf7, struct kkm_save_info)
 #define KKM_KONTEXT_GET_XSTATE _IOR(KKM_IO, 0xf8, struct kkm_xstate)
 #define KKM_KONTEXT_SET_XSTATE _IOW(KKM_IO, 0xf9, struct kkm_xstate)
+#define KKM_KONTEXT_GET_XSTATE2 _IOWR(KKM_IO, 0xfa, struct kkm_xstate2)
+#define KKM_KONTEXT_SET_XSTATE2 _IOW(KKM_IO, 0xfb, struct kkm_xstate2)
+#define KKM_KONTEXT_SET_SWITCHLESS _IOW(KKM_IO, 0xfc, struct kkm_switchless)
+#define KKM_KONTEXT_SET_PERF _IOW(KKM_IO, 0xfd, struct kkm_perf)
 
 #define KKM_CPU_SUPPORTED _IO(KKM_IO, 0xfe)
 #define KKM_GET_IDENTITY _IO(KKM_IO, 0xff)
 
 // capability check. values for KKM_CHECK_EXTENSION
 #define KKM_CAP_SYNC_REGS (74)
+#define KKM_CAP_CLONE_KONTAINER (1001)
+#define KKM_CAP_LAZY_MEMORY (1002)
+#define KKM_CAP_XSTATE2 (1003)
+#define KKM_CAP_GUEST_PML4_ENTRIES (1004)
+#define KKM_CAP_DIRECT_IO (1005)
+#define KKM_CAP_SWITCHLESS (1006)
+#define KKM_CAP_RUN_ANY_THREAD (1007)
+#define KKM_CAP_PERF (1008)
+#define KKM_CAP_BPF_OPS (1009)
+#define KKM_CAP_SUPPORTED_CPUID (1010)
+/*
+ * payload can use WRFSBASE/WRGSBASE, live fs/gs base
+ * is returned in KKM_GET_SREGS after every exit
+ */
+#define KKM_CAP_FSGSBASE (1011)
+#define KKM_CAP_RSEQ (1012)
+#define KKM_CAP_FAULT_HANDLER (1013)
 
 // capabilites for KKM_CAP_SYNC_REGS
 #define KKM_SYNC_X86_REGS (1ULL)
@@ -95,6 +132,21 @@ struct kkm_cpuid {
 	struct kkm_ec_entry entries[0];
 };
 
+/*
+ * KKM_GET_SUPPORTED_CPUID
+ * all basic and extended leaves of the host cpu, with subleaves.
+ * features whose xsave state is not enabled in XCR0 are masked,
+ * leaf 0xD reports the XCR0 features and sizes payload runs with.
+ * entry_count too small fails with E2BIG and entry_count set
+ * to the number of entries needed.
+ * KKM_CHECK_EXTENSION(KKM_CAP_SUPPORTED_CPUID) returns
+ * KKM_CPUID_MAX_ENTRIES
+ */
+#define KKM_CPUID_MAX_ENTRIES (256)
+
+/* kkm_ec_entry flags, index is significant for this function */
+#define KKM_CPUID_FLAG_SIGNIFICANT_INDEX (1U << 0)
+
 // KKM_GET_REGS & KKM_SET_REGS
 struct kkm_regs {
 	uint64_t rax;
@@ -262,6 +314,197 @@ struct kkm_memory_region {
 #define KKM_MAX_CONTEXTS (288)
 #define KKM_MAX_MEMORY_SLOTS (64)
 
+/*
+ * kkm_memory_region flags
+ * pages of lazy slot are populated by km on first guest touch,
+ * reported with KKM_EXIT_MEMORY_FAULT
+ */
+#define KKM_MEM_LAZY_POPULATE (1U << 2)
+
+/*
+ * KKM_CLONE_KONTAINER
+ * issued by forked child on inherited parent kontainer fd
+ * returns child kontainer fd, EBUSY while parent kontext is running.
+ * rseq and fault handler registrations are inherited.
+ */
+struct kkm_clone_kontainer {
+	uint32_t kontext_index; /* parent kontext to duplicate */
+	int32_t kontext_fd; /* child kontext fd, returned */
+};
+static_assert(sizeof(struct kkm_clone_kontainer) == 8,
+	      "kkm_clone_kontainer is known to monitor, size is fixed at 8 bytes");
+
+/*
+ * KKM_SET_DIRECT_IO
+ * read/write style hypercalls on guest_fd are done by kkm on host_fd
+ * without exit to monitor when they complete without blocking.
+ * ops 0 removes guest_fd, monitor removes guest_fd before closing host_fd
+ */
+#define KKM_DIRECT_IO_READ (1U << 0)
+#define KKM_DIRECT_IO_WRITE (1U << 1)
+#define KKM_DIRECT_IO_OPS (KKM_DIRECT_IO_READ | KKM_DIRECT_IO_WRITE)
+
+struct kkm_direct_io {
+	int32_t guest_fd;
+	int32_t host_fd; /* monitor fd backing guest_fd */
+	uint32_t ops;
+	uint32_t padding;
+};
+static_assert(sizeof(struct kkm_direct_io) == 16,
+	      "kkm_direct_io is known to monitor, size is fixed at 16 bytes");
+
+/*
+ * KKM_KONTEXT_SET_SWITCHLESS
+ * hypercalls with bit set in hypercalls are posted to switchless slot
+ * at start of kontext map page KKM_CONTEXT_MAP_SWITCHLESS_PAGE and
+ * kontext polls up to spin_ns for monitor worker to complete them
+ * before exiting to monitor. spin_ns 0 disables.
+ */
+#define KKM_SWITCHLESS_HYPERCALL_MAX (1024)
+#define KKM_SWITCHLESS_HYPERCALL_WORDS (KKM_SWITCHLESS_HYPERCALL_MAX / 64)
+
+struct kkm_switchless {
+	uint64_t hypercalls[KKM_SWITCHLESS_HYPERCALL_WORDS];
+	uint32_t spin_ns;
+	uint32_t flags;
+};
+static_assert(sizeof(struct kkm_switchless) == 136,
+	      "kkm_switchless is known to monitor, size is fixed at 136 bytes");
+
+#define KKM_CONTEXT_MAP_SWITCHLESS_PAGE (3)
+
+/*
+ * kkm_switchless_slot state
+ * IDLE -> POSTED(kkm) -> BUSY(worker) -> DONE(worker) -> IDLE(kkm)
+ * kkm takes back POSTED hypercall on timeout and exits.
+ * exit with state BUSY or DONE, monitor waits for DONE, sets IDLE
+ * and uses ret_val from worker.
+ */
+#define KKM_SWITCHLESS_IDLE (0)
+#define KKM_SWITCHLESS_POSTED (1)
+#define KKM_SWITCHLESS_BUSY (2)
+#define KKM_SWITCHLESS_DONE (3)
+
+struct kkm_switchless_slot {
+	uint32_t state;
+	uint32_t worker_active; /* non zero while monitor worker polls */
+	uint64_t hypercall; /* hypercall number */
+	uint64_t args; /* guest address of kkm_hc_args */
+	uint64_t reserved[5];
+};
+static_assert(sizeof(struct kkm_switchless_slot) == 64,
+	      "kkm_switchless_slot is known to monitor, size is fixed at 64 bytes");
+
+/*
+ * KKM_KONTEXT_SET_PERF
+ * perf_event counters counting payload execution of a kontext,
+ * type and config as in perf_event_attr. count 0 detaches.
+ * type is PERF_TYPE_HARDWARE or PERF_TYPE_HW_CACHE, PERF_TYPE_RAW
+ * needs perfmon capability. kernel and hypervisor are excluded
+ * unless caller is perfmon capable.
+ * accumulated values are in kkm_perf_values at start of
+ * kontext map page KKM_CONTEXT_MAP_PERF_PAGE
+ */
+#define KKM_PERF_MAX_COUNTERS (8)
+
+struct kkm_perf_counter {
+	uint32_t type;
+	uint32_t padding;
+	uint64_t config;
+};
+
+struct kkm_perf {
+	uint32_t count;
+	uint32_t flags;
+	struct kkm_perf_counter counters[KKM_PERF_MAX_COUNTERS];
+};
+static_assert(sizeof(struct kkm_perf) == 136,
+	      "kkm_perf is known to monitor, size is fixed at 136 bytes");
+
+#define KKM_CONTEXT_MAP_PERF_PAGE (4)
+
+struct kkm_perf_values {
+	uint64_t count; /* counters in use */
+	uint64_t runs; /* KKM_RUN calls counted */
+	uint64_t value[KKM_PERF_MAX_COUNTERS];
+};
+static_assert(sizeof(struct kkm_perf_values) == 80,
+	      "kkm_perf_values is known to monitor, size is fixed at 80 bytes");
+
+/*
+ * KKM_KONTEXT_SET_RSEQ
+ * register payload thread struct rseq(linux/rseq.h) at guest address rseq.
+ * before every guest entry cpu_id_start and cpu_id are set to the cpu
+ * payload runs on, and a critical section payload was interrupted in
+ * is aborted to its abort_ip. KKM_RSEQ_FLAG_UNREGISTER removes it.
+ */
+#define KKM_RSEQ_FLAG_UNREGISTER (1U << 0)
+
+struct kkm_rseq {
+	uint64_t rseq;
+	uint32_t len;
+	uint32_t sig;
+	uint32_t flags;
+	uint32_t padding;
+	uint64_t reserved;
+};
+static_assert(sizeof(struct kkm_rseq) == 32,
+	      "kkm_rseq is known to monitor, size is fixed at 32 bytes");
+
+/*
+ * KKM_KONTEXT_SET_FAULT_HANDLER
+ * payload page faults kkm can't resolve from monitor memory
+ * fail KKM_RUN with EFAULT unless flags are set.
+ * KKM_FAULT_FLAG_EXIT
+ *	KKM_RUN returns KKM_EXIT_EXCEPTION, exception X86_TRAP_PF,
+ *	error code in ex.error_code, fault address in sregs.cr2
+ * KKM_FAULT_FLAG_REFLECT
+ *	payload continues at handler with kkm_fault_frame built on
+ *	its stack, or on [stack, stack + stack_size) when set and not
+ *	already on it. handler is entered as a function called with
+ *	(frame, cr2, error_code), frame has state to resume from.
+ *	falls back to KKM_FAULT_FLAG_EXIT when frame can't be written
+ */
+#define KKM_FAULT_FLAG_EXIT (1U << 0)
+#define KKM_FAULT_FLAG_REFLECT (1U << 1)
+
+struct kkm_fault_handler {
+	uint64_t handler;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint32_t flags;
+	uint32_t padding;
+};
+static_assert(sizeof(struct kkm_fault_handler) == 32,
+	      "kkm_fault_handler is known to monitor, size is fixed at 32 bytes");
+
+struct kkm_fault_frame {
+	uint64_t return_address; /* 0 */
+	uint64_t rip;
+	uint64_t rsp;
+	uint64_t rflags;
+	uint64_t cr2;
+	uint64_t error_code;
+	uint64_t rdi;
+	uint64_t rsi;
+	uint64_t rdx;
+};
+static_assert(sizeof(struct kkm_fault_frame) == 72,
+	      "kkm_fault_frame is known to monitor, size is fixed at 72 bytes");
+
+/*
+ * KKM_SET_BPF_OPS
+ * argument 1 lets registered kkm_bpf_ops handle hypercalls and
+ * exceptions of kontainer before they exit to monitor, 0 stops it.
+ * EOPNOTSUPP when KKM_CAP_BPF_OPS is 0
+ */
+#define KKM_BPF_DEFERRED (0)
+#define KKM_BPF_HANDLED (1)
+
+#define KKM_BPF_REASON_SYSCALL (1)
+#define KKM_BPF_REASON_HYPERCALL (2)
+#define KKM_BPF_REASON_EXCEPTION (3)
+
 enum fault_reason {
 	FAULT_UNKNOWN = 0,
 	FAULT_HYPER_CALL = 1,
@@ -288,6 +531,10 @@ static_assert(sizeof(struct kkm_xsave) == 4096,
 /*
  * XCR get and set
  * KKM_GET_XCRS and KKM_SET_XCRS
+ * KKM_GET_XCRS returns XCR0 payload runs with.
+ * payload runs with host XCR0, KKM_SET_XCRS only accepts
+ * XCR0 equal to value returned by KKM_GET_XCRS, EINVAL otherwise.
+ * before kkm version 13 subsets were accepted and silently ignored.
  */
 #define KKM_MAX_XCRS (16)
 
@@ -360,6 +607,26 @@ struct kkm_xstate {
 static_assert(sizeof(struct kkm_xstate) == 4096,
 	      "kkm_xstate is known to monitor, size is fixed at 4096 bytes");
 
+/*
+ * variable size xstate
+ * KKM_KONTEXT_GET_XSTATE2 and KKM_KONTEXT_SET_XSTATE2
+ * KKM_CHECK_EXTENSION(KKM_CAP_XSTATE2) returns largest size
+ * GET fails with E2BIG and updates size when buffer is too small
+ */
+struct kkm_xstate2 {
+	uint64_t data; /* monitor address of xsave data */
+	uint32_t size; /* size of data buffer, set to bytes of xsave data */
+	union {
+		bool valid;
+		uint32_t padding;
+	};
+	kkm_xstate_format_t format;
+	uint32_t crc32; /* crc of size bytes of data */
+	uint64_t xfd_features; /* XFD features in use by payload (AMX) */
+};
+static_assert(sizeof(struct kkm_xstate2) == 32,
+	      "kkm_xstate2 is known to monitor, size is fixed at 32 bytes");
+
 /*
  * KKM_CPU_SUPPORTED
  */
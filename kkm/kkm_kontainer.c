@@ -14,6 +14,9 @@
 
 #include <linux/mm.h>
 #include <linux/interrupt.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/llist.h>
 #include <asm/traps.h>
 #include <asm/desc.h>
 
@@ -23,71 +26,83 @@
 #include "kkm_kontainer.h"
 #include "kkm_mm.h"
 #include "kkm_guest_entry.h"
+#include "kkm_statistics.h"
 
-/*
- * PTI_USER_PGTABLE_MASK not visible to modules
- * make up our own mask
- */
-#define KKM_USER_PGTABLE_BIT (PAGE_SHIFT)
-#define KKM_USER_PGTABLE_MASK (1 << KKM_USER_PGTABLE_BIT)
-
-#define KKM_KONTAINER_LVL_PAGE_COUNT (2)
+#define KKM_KONTAINER_LVL_PAGE_COUNT (1)
 #define KKM_KONTAINER_LOW_PAGE_COUNT (1)
 
-int kkm_kontainer_allocate_lvl_pages(struct kkm_mmu_page_info *k_page,
-				     struct kkm_mmu_page_info *p_page);
+int kkm_kontainer_allocate_lvl_pages(struct kkm_mmu_page_info *p_page);
 int kkm_kontainer_allocate_pgd_pages(struct kkm *kkm);
 int kkm_kontainer_allocate_p4d_pages(struct kkm *kkm);
-void kkm_kontainer_cleanup_lvl_pages(struct kkm_mmu_page_info *k_page,
-				     struct kkm_mmu_page_info *p_page);
+void kkm_kontainer_cleanup_lvl_pages(struct kkm_mmu_page_info *p_page);
 void kkm_kontainer_cleanup_pgd_pages(struct kkm *kkm);
 void kkm_kontainer_cleanup_p4d_pages(struct kkm *kkm);
 
-int kkm_kontainer_allocate_lvl_pages(struct kkm_mmu_page_info *k_page,
-				     struct kkm_mmu_page_info *p_page)
+/*
+ * kontainers with page table pages allocated and initialized
+ * kernel half of pgd is copied from creating process mm when claimed
+ */
+static uint __read_mostly kontainer_pool_size = KKM_KONTAINER_POOL_SIZE;
+module_param(kontainer_pool_size, uint, S_IRUGO | S_IWUSR);
+
+static LIST_HEAD(kkm_kontainer_pool);
+static DEFINE_SPINLOCK(kkm_kontainer_pool_lock);
+static uint32_t kkm_kontainer_pool_count = 0;
+static bool kkm_kontainer_pool_active = false;
+
+static void kkm_kontainer_pool_fill(struct work_struct *work);
+static DECLARE_WORK(kkm_kontainer_pool_work, kkm_kontainer_pool_fill);
+
+/*
+ * kontainers waiting to be freed
+ * released from exit path, freed in batches from workqueue
+ */
+static LLIST_HEAD(kkm_kontainer_destroy_list);
+
+static void kkm_kontainer_destroy_work_fn(struct work_struct *work);
+static DECLARE_WORK(kkm_kontainer_destroy_work, kkm_kontainer_destroy_work_fn);
+
+/*
+ * guest kernel code runs on payload page tables,
+ * one page per level. no dependency on PTI kernel/user pgd pair,
+ * works the same with and without pti.
+ */
+int kkm_kontainer_allocate_lvl_pages(struct kkm_mmu_page_info *p_page)
 {
 	int ret_val = 0;
 
-	/*
-	 * allocate 2 pages
-	 */
-	ret_val = kkm_mm_allocate_pages(&k_page->page, &k_page->va, &k_page->pa,
+	ret_val = kkm_mm_allocate_pages(&p_page->page, &p_page->va, &p_page->pa,
 					KKM_KONTAINER_LVL_PAGE_COUNT);
 	if (ret_val != 0) {
 		printk(KERN_NOTICE
-		       "kkm_kontainer_allocate_lvl_pages: Failed to allocate memory for guest kernel page table error(%d)\n",
+		       "kkm_kontainer_allocate_lvl_pages: Failed to allocate memory for guest page table error(%d)\n",
 		       ret_val);
-		return ret_val;
 	}
-
-	if (((uint64_t)k_page->va & KKM_USER_PGTABLE_MASK) ==
-	    KKM_USER_PGTABLE_MASK) {
-		printk(KERN_ERR
-		       "kkm_kontainer_allocate_lvl_pages: unexpected odd start page address\n");
-		ret_val = -EINVAL;
-		return ret_val;
-	}
-
-	/*
-	 * allocate 2 pages,
-	 *     kernel mode
-	 *     guest mode
-	 * kernel code depends on kernel page table at even page and user page table at next(odd) page
-	 */
-	p_page->va = k_page->va + PAGE_SIZE;
-	p_page->pa = k_page->pa + PAGE_SIZE;
-
 	return ret_val;
 }
 
 int kkm_kontainer_allocate_pgd_pages(struct kkm *kkm)
 {
-	return kkm_kontainer_allocate_lvl_pages(&kkm->gk_pgd, &kkm->gp_pgd);
+	return kkm_kontainer_allocate_lvl_pages(&kkm->gp_pgd);
 }
 
 int kkm_kontainer_allocate_p4d_pages(struct kkm *kkm)
 {
-	return kkm_kontainer_allocate_lvl_pages(&kkm->gk_p4d, &kkm->gp_p4d);
+	return kkm_kontainer_allocate_lvl_pages(&kkm->gp_p4d);
+}
+
+/*
+ * locks and state of new or recycled kontainer
+ */
+static void kkm_kontainer_init_state(struct kkm *kkm)
+{
+	mutex_init(&kkm->pf_lock);
+	mutex_init(&kkm->mem_lock);
+	mutex_init(&kkm->kontext_lock);
+	kkm_direct_io_init(kkm);
+	kkm->bpf_ops = false;
+
+	atomic64_set(&kkm->tlb_gen, 0);
 }
 
 int kkm_kontainer_init(struct kkm *kkm)
@@ -135,9 +150,7 @@ int kkm_kontainer_init(struct kkm *kkm)
 		goto error;
 	}
 
-	mutex_init(&kkm->pf_lock);
-	mutex_init(&kkm->mem_lock);
-	mutex_init(&kkm->kontext_lock);
+	kkm_kontainer_init_state(kkm);
 
 error:
 	if (ret_val != 0) {
@@ -146,15 +159,11 @@ error:
 	return ret_val;
 }
 
-void kkm_kontainer_cleanup_lvl_pages(struct kkm_mmu_page_info *k_page,
-				     struct kkm_mmu_page_info *p_page)
+void kkm_kontainer_cleanup_lvl_pages(struct kkm_mmu_page_info *p_page)
 {
-	if (k_page->page != NULL) {
-		kkm_mm_free_pages(k_page->va, KKM_KONTAINER_LVL_PAGE_COUNT);
-		k_page->page = NULL;
-
-		k_page->va = 0;
-		k_page->pa = 0;
+	if (p_page->page != NULL) {
+		kkm_mm_free_pages(p_page->va, KKM_KONTAINER_LVL_PAGE_COUNT);
+		p_page->page = NULL;
 
 		p_page->va = 0;
 		p_page->pa = 0;
@@ -163,12 +172,12 @@ void kkm_kontainer_cleanup_lvl_pages(struct kkm_mmu_page_info *k_page,
 
 void kkm_kontainer_cleanup_pgd_pages(struct kkm *kkm)
 {
-	kkm_kontainer_cleanup_lvl_pages(&kkm->gk_pgd, &kkm->gp_pgd);
+	kkm_kontainer_cleanup_lvl_pages(&kkm->gp_pgd);
 }
 
 void kkm_kontainer_cleanup_p4d_pages(struct kkm *kkm)
 {
-	kkm_kontainer_cleanup_lvl_pages(&kkm->gk_p4d, &kkm->gp_p4d);
+	kkm_kontainer_cleanup_lvl_pages(&kkm->gp_p4d);
 }
 
 /*
@@ -187,3 +196,351 @@ void kkm_kontainer_cleanup(struct kkm *kkm)
 	kkm_kontainer_cleanup_pgd_pages(kkm);
 	kkm_kontainer_cleanup_p4d_pages(kkm);
 }
+
+/*
+ * translate guest private area(vdso, vvar and km guest mem) address
+ * to monitor address
+ */
+bool kkm_kontainer_priv_va_to_monitor_va(struct kkm *kkm, uint64_t guest_va,
+					 uint64_t *monitor_va)
+{
+	struct kkm_mem_slot *mem_slot = NULL;
+
+	/*
+	 * vdso + vvar
+	 */
+	mem_slot = &kkm->mem_slot[KKM_KM_RSRV_VDSOSLOT];
+	if (mem_slot->used == true && guest_va >= KKM_GUEST_VVAR_VDSO_BASE_VA &&
+	    guest_va <
+		    (KKM_GUEST_VVAR_VDSO_BASE_VA + mem_slot->mr.memory_size)) {
+		*monitor_va = guest_va - KKM_GUEST_VVAR_VDSO_BASE_VA +
+			      mem_slot->mr.userspace_addr;
+		return true;
+	}
+
+	/*
+	 * guest mem
+	 */
+	mem_slot = &kkm->mem_slot[KKM_KM_RSRV_KMGUESTMEM_SLOT];
+	if (mem_slot->used == true &&
+	    guest_va >= KKM_GUEST_KMGUESTMEM_BASE_VA &&
+	    guest_va <
+		    (KKM_GUEST_KMGUESTMEM_BASE_VA + mem_slot->mr.memory_size)) {
+		*monitor_va = guest_va - KKM_GUEST_KMGUESTMEM_BASE_VA +
+			      mem_slot->mr.userspace_addr;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * monitor populates pml4 entries for guest memory as it is touched,
+ * pick up new entries in guest page tables
+ * called from page fault path
+ */
+void kkm_kontainer_sync_payload(struct kkm *kkm)
+{
+	int changed = 0;
+
+	mutex_lock(&kkm->mem_lock);
+	changed = kkm_mmu_sync((uint64_t)kkm->mm->pgd, kkm->gp_pgd.va,
+			       &kkm->kkm_guest_pml4e, kkm->low_p4d.va,
+			       kkm->low_p4d.pa);
+	mutex_unlock(&kkm->mem_lock);
+
+	if (changed != 0) {
+		/* guest pml4 entries changed, invalidate guest TLB */
+		atomic64_inc(&kkm->tlb_gen);
+	}
+}
+
+/*
+ * return lazily populated slot overlapping guest physical range
+ * [gpa, gpa + size), -1 if range is not in a lazy slot
+ */
+int kkm_kontainer_lazy_slot_range(struct kkm *kkm, uint64_t gpa,
+				  uint64_t size)
+{
+	int i = 0;
+	struct kkm_mem_slot *mem_slot = NULL;
+
+	for (i = 0; i < KKM_MAX_MEMORY_SLOTS; i++) {
+		mem_slot = &kkm->mem_slot[i];
+		if (mem_slot->used == false ||
+		    (mem_slot->mr.flags & KKM_MEM_LAZY_POPULATE) == 0) {
+			continue;
+		}
+		if (gpa < (mem_slot->mr.guest_phys_addr +
+			   mem_slot->mr.memory_size) &&
+		    mem_slot->mr.guest_phys_addr < (gpa + size)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * return lazily populated slot containing guest physical address
+ * -1 if gpa is not in a lazy slot
+ */
+int kkm_kontainer_lazy_slot(struct kkm *kkm, uint64_t gpa)
+{
+	return kkm_kontainer_lazy_slot_range(kkm, gpa, 1);
+}
+
+/*
+ * duplicate parent memory slots and guest page tables
+ * in kontainer for current mm(forked child)
+ * private area entries are rebuilt from current mm,
+ * parent entries point to parent pages
+ */
+int kkm_kontainer_clone_memory(struct kkm *kkm, struct kkm *parent)
+{
+	int i = 0;
+	uint64_t guest_va = 0;
+	uint64_t monitor_va = 0;
+	uint8_t data = 0;
+
+	/*
+	 * child mem_lock is held across sync as for every other
+	 * kkm_mmu_sync caller, same lock class as parent's
+	 */
+	mutex_lock(&parent->mem_lock);
+	mutex_lock_nested(&kkm->mem_lock, SINGLE_DEPTH_NESTING);
+	memcpy(kkm->mem_slot, parent->mem_slot, sizeof(kkm->mem_slot));
+	kkm->mem_slot_count = parent->mem_slot_count;
+	kkm->id_map_addr = parent->id_map_addr;
+	mutex_unlock(&parent->mem_lock);
+
+	kkm_mmu_sync((uint64_t)kkm->mm->pgd, kkm->gp_pgd.va,
+		     &kkm->kkm_guest_pml4e, kkm->low_p4d.va, kkm->low_p4d.pa);
+	mutex_unlock(&kkm->mem_lock);
+
+	mutex_lock(&parent->pf_lock);
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if ((((uint64_t *)parent->kkm_guest_pml4e.pt.va)[i] &
+		     _PAGE_PRESENT) == 0) {
+			continue;
+		}
+
+		guest_va = KKM_KM_GUEST_PRIVATE_MEM_START_VA + i * PAGE_SIZE;
+		if (kkm_kontainer_priv_va_to_monitor_va(kkm, guest_va,
+							&monitor_va) == false) {
+			continue;
+		}
+
+		/*
+		 * make sure page is present in current mm,
+		 * shared mappings are not copied by fork.
+		 * write access faults again and breaks cow.
+		 */
+		if (copy_from_user(&data, (void *)monitor_va,
+				   sizeof(uint8_t))) {
+			continue;
+		}
+
+		kkm_mmu_update_priv_area(guest_va, monitor_va,
+					 (uint64_t)kkm->mm->pgd,
+					 &kkm->kkm_guest_pml4e);
+	}
+	mutex_unlock(&parent->pf_lock);
+
+	return 0;
+}
+
+/*
+ * allocate and initialize kontainer page tables
+ */
+static struct kkm *kkm_kontainer_create(void)
+{
+	struct kkm *kkm = NULL;
+
+	kkm = kzalloc(sizeof(struct kkm), GFP_KERNEL);
+	if (kkm == NULL) {
+		return NULL;
+	}
+
+	if (kkm_kontainer_init(kkm) != 0) {
+		kfree(kkm);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&kkm->pool_list);
+	return kkm;
+}
+
+/*
+ * top up kontainer pool to kontainer_pool_size
+ * runs from system workqueue
+ */
+static void kkm_kontainer_pool_fill(struct work_struct *work)
+{
+	struct kkm *kkm = NULL;
+
+	while (READ_ONCE(kkm_kontainer_pool_active) == true &&
+	       READ_ONCE(kkm_kontainer_pool_count) <
+		       READ_ONCE(kontainer_pool_size)) {
+		kkm = kkm_kontainer_create();
+		if (kkm == NULL) {
+			printk(KERN_NOTICE
+			       "kkm_kontainer_pool_fill: kontainer allocation failed\n");
+			break;
+		}
+
+		spin_lock(&kkm_kontainer_pool_lock);
+		list_add_tail(&kkm->pool_list, &kkm_kontainer_pool);
+		kkm_kontainer_pool_count++;
+		spin_unlock(&kkm_kontainer_pool_lock);
+	}
+}
+
+/*
+ * get initialized kontainer
+ * use prebuilt one from pool when available
+ */
+struct kkm *kkm_kontainer_alloc(void)
+{
+	struct kkm *kkm = NULL;
+
+	spin_lock(&kkm_kontainer_pool_lock);
+	kkm = list_first_entry_or_null(&kkm_kontainer_pool, struct kkm,
+				       pool_list);
+	if (kkm != NULL) {
+		list_del_init(&kkm->pool_list);
+		kkm_kontainer_pool_count--;
+	}
+	spin_unlock(&kkm_kontainer_pool_lock);
+
+	if (kkm != NULL) {
+		/* statistics */
+		kkm_statistics_kontainer_pool_hit_count_inc();
+	} else {
+		kkm = kkm_kontainer_create();
+
+		/* statistics */
+		kkm_statistics_kontainer_pool_miss_count_inc();
+	}
+
+	if (READ_ONCE(kkm_kontainer_pool_active) == true) {
+		schedule_work(&kkm_kontainer_pool_work);
+	}
+
+	return kkm;
+}
+
+/*
+ * page tables of dead kontainer are put back in their just created state
+ * and kontainer goes back to pool, when pool has room
+ */
+static bool kkm_kontainer_recycle(struct kkm *kkm)
+{
+	struct kkm_mmu_page_info gp_pgd = kkm->gp_pgd;
+	struct kkm_mmu_page_info gp_p4d = kkm->gp_p4d;
+	struct kkm_mmu_page_info low_p4d = kkm->low_p4d;
+	struct kkm_mmu_pml4e guest_pml4e = kkm->kkm_guest_pml4e;
+
+	if (READ_ONCE(kkm_kontainer_pool_active) == false ||
+	    READ_ONCE(kkm_kontainer_pool_count) >=
+		    READ_ONCE(kontainer_pool_size)) {
+		return false;
+	}
+
+	memset(gp_pgd.va, 0, KKM_KONTAINER_LVL_PAGE_COUNT * PAGE_SIZE);
+	if (gp_p4d.page != NULL) {
+		memset(gp_p4d.va, 0, KKM_KONTAINER_LVL_PAGE_COUNT * PAGE_SIZE);
+	}
+	if (low_p4d.page != NULL) {
+		memset(low_p4d.va, 0, KKM_KONTAINER_LOW_PAGE_COUNT * PAGE_SIZE);
+	}
+	kkm_reset_pml4(&guest_pml4e, KKM_KM_GUEST_PRIVATE_MEM_START_VA);
+
+	memset(kkm, 0, sizeof(struct kkm));
+	kkm->gp_pgd = gp_pgd;
+	kkm->gp_p4d = gp_p4d;
+	kkm->low_p4d = low_p4d;
+	kkm->kkm_guest_pml4e = guest_pml4e;
+	kkm_kontainer_init_state(kkm);
+	INIT_LIST_HEAD(&kkm->pool_list);
+
+	spin_lock(&kkm_kontainer_pool_lock);
+	list_add_tail(&kkm->pool_list, &kkm_kontainer_pool);
+	kkm_kontainer_pool_count++;
+	spin_unlock(&kkm_kontainer_pool_lock);
+
+	return true;
+}
+
+/*
+ * free all kontainers released since last run
+ */
+static void kkm_kontainer_destroy_work_fn(struct work_struct *work)
+{
+	struct llist_node *list = NULL;
+	struct kkm *kkm = NULL;
+	struct kkm *next = NULL;
+	int i = 0;
+
+	list = llist_del_all(&kkm_kontainer_destroy_list);
+	llist_for_each_entry_safe (kkm, next, list, destroy_node) {
+		for (i = 0; i < KKM_MAX_CONTEXTS; i++) {
+			if (kkm->kontext[i] != NULL) {
+				kkm_kontext_cleanup(kkm->kontext[i]);
+				kkm_kontext_free(kkm->kontext[i]);
+				kkm->kontext[i] = NULL;
+			}
+		}
+
+		/* statistics */
+		kkm_statistics_kontainer_destroy_count_inc();
+
+		if (kkm_kontainer_recycle(kkm) == true) {
+			/* statistics */
+			kkm_statistics_kontainer_recycle_count_inc();
+			continue;
+		}
+		kkm_kontainer_cleanup(kkm);
+		kfree(kkm);
+	}
+}
+
+/*
+ * last reference to kontainer is gone
+ * keep monitor exit path short, free memory from workqueue
+ */
+void kkm_kontainer_destroy(struct kkm *kkm)
+{
+	if (llist_add(&kkm->destroy_node, &kkm_kontainer_destroy_list)) {
+		schedule_work(&kkm_kontainer_destroy_work);
+	}
+}
+
+/*
+ * module unload, free everything still queued
+ */
+void kkm_kontainer_destroy_flush(void)
+{
+	flush_work(&kkm_kontainer_destroy_work);
+}
+
+void kkm_kontainer_pool_init(void)
+{
+	WRITE_ONCE(kkm_kontainer_pool_active, true);
+	schedule_work(&kkm_kontainer_pool_work);
+}
+
+void kkm_kontainer_pool_cleanup(void)
+{
+	struct kkm *kkm = NULL;
+	struct kkm *next = NULL;
+
+	WRITE_ONCE(kkm_kontainer_pool_active, false);
+	cancel_work_sync(&kkm_kontainer_pool_work);
+
+	list_for_each_entry_safe (kkm, next, &kkm_kontainer_pool, pool_list) {
+		list_del(&kkm->pool_list);
+		kkm_kontainer_cleanup(kkm);
+		kfree(kkm);
+	}
+	kkm_kontainer_pool_count = 0;
+}
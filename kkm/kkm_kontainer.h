@@ -15,7 +15,26 @@
 #ifndef __KKM_KONTAINER_H__
 #define __KKM_KONTAINER_H__
 
+/*
+ * default for kontainer_pool_size module parameter
+ */
+#define KKM_KONTAINER_POOL_SIZE (8)
+
 int kkm_kontainer_init(struct kkm *kkm);
 void kkm_kontainer_cleanup(struct kkm *kkm);
 
+bool kkm_kontainer_priv_va_to_monitor_va(struct kkm *kkm, uint64_t guest_va,
+					 uint64_t *monitor_va);
+int kkm_kontainer_clone_memory(struct kkm *kkm, struct kkm *parent);
+int kkm_kontainer_lazy_slot_range(struct kkm *kkm, uint64_t gpa,
+				  uint64_t size);
+int kkm_kontainer_lazy_slot(struct kkm *kkm, uint64_t gpa);
+void kkm_kontainer_sync_payload(struct kkm *kkm);
+
+struct kkm *kkm_kontainer_alloc(void);
+void kkm_kontainer_pool_init(void);
+void kkm_kontainer_pool_cleanup(void);
+void kkm_kontainer_destroy(struct kkm *kkm);
+void kkm_kontainer_destroy_flush(void);
+
 #endif /* __KKM_KONTAINER_H__ */
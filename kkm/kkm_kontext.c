@@ -14,6 +14,8 @@
 
 #include <linux/mm.h>
 #include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/wait_bit.h>
 #include <asm/desc.h>
 #include <asm/tlbflush.h>
 #include <asm/debugreg.h>
@@ -34,12 +36,22 @@
 #include "kkm_intr.h"
 #include "kkm_intr_table.h"
 #include "kkm_statistics.h"
+#include "kkm_tlb.h"
+#include "kkm_kontainer.h"
+#include "kkm_direct_io.h"
+#include "kkm_switchless.h"
+#include "kkm_perf.h"
+#include "kkm_bpf.h"
+#include "kkm_rseq.h"
 
 int kkm_kontext_handle_syscall_response(struct kkm_kontext *kontext,
 					struct kkm_guest_area *ga);
 
-static bool __read_mostly lazy_flush_tlb = true;
-module_param(lazy_flush_tlb, bool, S_IRUGO | S_IWUSR);
+static bool __read_mostly sysret_fast_path = true;
+module_param(sysret_fast_path, bool, S_IRUGO | S_IWUSR);
+
+static bool __read_mostly async_page_fault = true;
+module_param(async_page_fault, bool, S_IRUGO | S_IWUSR);
 
 static bool __read_mostly log_failed_guest_va_translations = false;
 module_param(log_failed_guest_va_translations, bool, S_IRUGO | S_IWUSR);
@@ -47,6 +59,13 @@ module_param(log_failed_guest_va_translations, bool, S_IRUGO | S_IWUSR);
 static bool __read_mostly log_failed_page_faults = false;
 module_param(log_failed_page_faults, bool, S_IRUGO | S_IWUSR);
 
+/*
+ * time every guest run for debugfs guest time ns,
+ * off by default to keep clock reads out of entry and exit
+ */
+static bool __read_mostly kontext_guest_time = false;
+module_param(kontext_guest_time, bool, S_IRUGO | S_IWUSR);
+
 DEFINE_PER_CPU(struct kkm_kontext *, current_kontext);
 
 /*
@@ -55,6 +74,109 @@ DEFINE_PER_CPU(struct kkm_kontext *, current_kontext);
 void (*kkm_switch_to_gp_asm_func_ptr)(struct kkm_guest_area *ga) =
 	(void (*)(struct kkm_guest_area *ga))KKM_KX_ENTRY_CODE_START_ADDR;
 
+/*
+ * dedicated caches for per thread allocations
+ * kontexts and payload xsave areas(64 byte aligned)
+ * full xsave cache is used when payload first uses XFD features
+ */
+static struct kmem_cache *kkm_kontext_cache = NULL;
+static struct kmem_cache *kkm_xsave_cache = NULL;
+static struct kmem_cache *kkm_xsave_full_cache = NULL;
+
+/*
+ * kernel xstate is saved and restored with interrupts disabled
+ * on the same cpu, one area per cpu is enough
+ */
+static DEFINE_PER_CPU(void *, kkm_kernel_xsave);
+
+int kkm_kontext_cache_init(void)
+{
+	int ret_val = 0;
+	int cpu = -1;
+
+	kkm_kontext_cache = kmem_cache_create(
+		"kkm_kontext", sizeof(struct kkm_kontext), 0, 0, NULL);
+	kkm_xsave_cache = kmem_cache_create("kkm_xsave", kkm_xsave_base_size,
+					    64, 0, NULL);
+	kkm_xsave_full_cache = kkm_xsave_cache;
+	if (kkm_xsave_size != kkm_xsave_base_size) {
+		kkm_xsave_full_cache = kmem_cache_create(
+			"kkm_xsave_full", kkm_xsave_size, 64, 0, NULL);
+	}
+	if (kkm_kontext_cache == NULL || kkm_xsave_cache == NULL ||
+	    kkm_xsave_full_cache == NULL) {
+		ret_val = -ENOMEM;
+		goto error;
+	}
+
+	for_each_possible_cpu (cpu) {
+		per_cpu(kkm_kernel_xsave, cpu) = kmem_cache_alloc_node(
+			kkm_xsave_full_cache, GFP_KERNEL | __GFP_ZERO,
+			cpu_to_node(cpu));
+		if (per_cpu(kkm_kernel_xsave, cpu) == NULL) {
+			ret_val = -ENOMEM;
+			goto error;
+		}
+	}
+
+error:
+	if (ret_val != 0) {
+		kkm_kontext_cache_cleanup();
+	}
+	return ret_val;
+}
+
+void kkm_kontext_cache_cleanup(void)
+{
+	int cpu = -1;
+
+	for_each_possible_cpu (cpu) {
+		if (per_cpu(kkm_kernel_xsave, cpu) != NULL) {
+			kmem_cache_free(kkm_xsave_full_cache,
+					per_cpu(kkm_kernel_xsave, cpu));
+			per_cpu(kkm_kernel_xsave, cpu) = NULL;
+		}
+	}
+	if (kkm_xsave_full_cache != kkm_xsave_cache) {
+		kmem_cache_destroy(kkm_xsave_full_cache);
+	}
+	kkm_xsave_full_cache = NULL;
+	kmem_cache_destroy(kkm_xsave_cache);
+	kkm_xsave_cache = NULL;
+	kmem_cache_destroy(kkm_kontext_cache);
+	kkm_kontext_cache = NULL;
+}
+
+struct kkm_kontext *kkm_kontext_alloc(void)
+{
+	return kmem_cache_zalloc(kkm_kontext_cache, GFP_KERNEL);
+}
+
+void kkm_kontext_free(struct kkm_kontext *kkm_kontext)
+{
+	kmem_cache_free(kkm_kontext_cache, kkm_kontext);
+}
+
+/*
+ * xsave area of size bytes, either base or full size
+ */
+static void *kkm_xsave_alloc(uint32_t size)
+{
+	if (size == kkm_xsave_base_size) {
+		return kmem_cache_zalloc(kkm_xsave_cache, GFP_KERNEL);
+	}
+	return kmem_cache_zalloc(kkm_xsave_full_cache, GFP_KERNEL);
+}
+
+static void kkm_xsave_free(void *xsave, uint32_t size)
+{
+	if (size == kkm_xsave_base_size) {
+		kmem_cache_free(kkm_xsave_cache, xsave);
+	} else {
+		kmem_cache_free(kkm_xsave_full_cache, xsave);
+	}
+}
+
 /*
  * initialize context to execute payload
  */
@@ -66,10 +188,16 @@ int kkm_kontext_init(struct kkm_kontext *kkm_kontext)
 
 	/*
 	 * allocate guest private area
+	 * slot of released kontext still has one
 	 */
-	ret_val = kkm_mm_allocate_pages(&kkm_kontext->guest_area_page,
-					&kkm_kontext->guest_area, NULL,
-					KKM_GUEST_AREA_PAGES);
+	if (kkm_kontext->guest_area_page != NULL) {
+		memset(kkm_kontext->guest_area, 0,
+		       KKM_GUEST_AREA_PAGES * PAGE_SIZE);
+	} else {
+		ret_val = kkm_mm_allocate_pages(&kkm_kontext->guest_area_page,
+						&kkm_kontext->guest_area, NULL,
+						KKM_GUEST_AREA_PAGES);
+	}
 	if (ret_val != 0) {
 		printk(KERN_NOTICE
 		       "kkm_kontext_init: Thread %llx failed to allocate "
@@ -97,44 +225,63 @@ int kkm_kontext_init(struct kkm_kontext *kkm_kontext)
 	ga->kkm_kontext = kkm_kontext;
 	ga->guest_area_beg = (uint64_t)ga;
 
-	ga->guest_kernel_cr3 = kkm->gk_pgd.pa & ~PCID_MASK;
 	ga->guest_payload_cr3 = kkm->gp_pgd.pa & ~PCID_MASK;
 	if (kkm_cpu_full_tlb_flush == false) {
-		ga->guest_kernel_cr3 |= GUEST_KERNEL_PCID;
 		ga->guest_payload_cr3 |= GUEST_PAYLOAD_PCID;
 	}
+	ga->guest_kernel_cr3 = ga->guest_payload_cr3;
 
 	ga->cpu = KKM_INVALID_CPU_ID;
 
 	/*
-	 * alocate space for xsave area
+	 * alocate space for payload xsave area
+	 * it doesn't include XFD features until first use
 	 */
-	ret_val = kkm_mm_allocate_pages(&kkm_kontext->xsave.page,
-					&kkm_kontext->xsave.va,
-					&kkm_kontext->xsave.pa,
-					KKM_FPU_XSAVE_ALLOC_PAGES);
-	if (ret_val != 0) {
+	if (kkm_kontext->kkm_payload_xsave != NULL &&
+	    kkm_kontext->payload_xsave_size != kkm_xsave_base_size) {
+		kkm_xsave_free(kkm_kontext->kkm_payload_xsave,
+			       kkm_kontext->payload_xsave_size);
+		kkm_kontext->kkm_payload_xsave = NULL;
+	}
+	if (kkm_kontext->kkm_payload_xsave != NULL) {
+		memset(kkm_kontext->kkm_payload_xsave, 0, kkm_xsave_base_size);
+	} else {
+		kkm_kontext->kkm_payload_xsave =
+			kkm_xsave_alloc(kkm_xsave_base_size);
+	}
+	if (kkm_kontext->kkm_payload_xsave == NULL) {
+		ret_val = -ENOMEM;
 		printk(KERN_NOTICE
 		       "kkm_kontext_init: Thread %llx failed to allocate "
 		       "memory for xsave area error(%d)\n",
 		       kkm_kontext->id, ret_val);
 		goto error;
 	}
-	kkm_kontext->kkm_kernel_xsave = kkm_kontext->xsave.va;
-	kkm_kontext->kkm_payload_xsave =
-		kkm_kontext->kkm_kernel_xsave + KKM_FPU_XSAVE_ALLOC_SIZE;
+	kkm_kontext->payload_xsave_size = kkm_xsave_base_size;
 	kkm_kontext->valid_payload_xsave_area = false;
+	kkm_kontext->xfd_enabled = 0;
+	kkm_kontext->xfd_err = 0;
 
 	kkm_kontext->new_thread = true;
 	kkm_kontext->debug_registers_set = false;
 
 	kkm_kontext->syscall_pending = false;
 	kkm_kontext->ret_val_mva = -1;
+	kkm_kontext->syscall_return = false;
+	kkm_kontext->lazy_fault_gpa = -1;
 
 	kkm_kontext->exception_posted = false;
 	kkm_kontext->exception_saved_rax = -1;
 	kkm_kontext->exception_saved_rbx = -1;
 
+	/* slot or reused kontext keeps counters of previous thread */
+	memset(&kkm_kontext->stats, 0, sizeof(kkm_kontext->stats));
+
+	kkm_switchless_init(kkm_kontext);
+	kkm_perf_init(kkm_kontext);
+	kkm_rseq_init(kkm_kontext);
+	kkm_fault_init(kkm_kontext);
+
 error:
 	if (ret_val != 0) {
 		kkm_kontext_cleanup(kkm_kontext);
@@ -142,13 +289,33 @@ error:
 	return ret_val;
 }
 
+/*
+ * kontext fd is closed, drop what ties kontext to monitor threads
+ * memory is kept for reuse of the slot
+ */
+void kkm_kontext_release_resources(struct kkm_kontext *kkm_kontext)
+{
+	kkm_perf_cleanup(kkm_kontext);
+}
+
 void kkm_kontext_cleanup(struct kkm_kontext *kkm_kontext)
 {
-	if (kkm_kontext->xsave.page != NULL) {
-		kkm_mm_free_pages(kkm_kontext->xsave.va,
-				  KKM_FPU_XSAVE_ALLOC_PAGES);
-		kkm_kontext->xsave.page = NULL;
-		kkm_kontext->xsave.va = NULL;
+	int i = 0;
+	struct kkm_kontext_mmap_area *kkma = NULL;
+
+	kkm_perf_cleanup(kkm_kontext);
+	for (i = 0; i < KKM_CONTEXT_MAP_PAGE_COUNT; i++) {
+		kkma = &kkm_kontext->mmap_area[i];
+		if (kkma->kvaddr != 0) {
+			free_page(kkma->kvaddr);
+			kkma->kvaddr = 0;
+			kkma->page = NULL;
+		}
+	}
+	if (kkm_kontext->kkm_payload_xsave != NULL) {
+		kkm_xsave_free(kkm_kontext->kkm_payload_xsave,
+			       kkm_kontext->payload_xsave_size);
+		kkm_kontext->kkm_payload_xsave = NULL;
 	}
 	if (kkm_kontext->guest_area_page != NULL) {
 		kkm_mm_free_pages(kkm_kontext->guest_area,
@@ -167,11 +334,119 @@ int kkm_kontext_reinit(struct kkm_kontext *kkm_kontext)
 
 	kkm_kontext->syscall_pending = false;
 	kkm_kontext->ret_val_mva = -1;
+	kkm_kontext->syscall_return = false;
+	kkm_kontext->lazy_fault_gpa = -1;
 
 	kkm_kontext->exception_posted = false;
 	kkm_kontext->exception_saved_rax = -1;
 	kkm_kontext->exception_saved_rbx = -1;
 
+	/* slot or reused kontext keeps counters of previous thread */
+	memset(&kkm_kontext->stats, 0, sizeof(kkm_kontext->stats));
+
+	kkm_switchless_init(kkm_kontext);
+	kkm_perf_cleanup(kkm_kontext);
+	kkm_rseq_init(kkm_kontext);
+	kkm_fault_init(kkm_kontext);
+
+	return ret_val;
+}
+
+/*
+ * payload used XFD armed features(AMX tile data)
+ * move payload xsave area to one sized for all enabled features
+ * and stop arming them in IA32_XFD during guest run
+ */
+int kkm_kontext_xfd_enable(struct kkm_kontext *kkm_kontext, uint64_t features)
+{
+	int ret_val = 0;
+	void *xsave = NULL;
+
+	if ((features & ~kkm_xfd_features) != 0) {
+		ret_val = -EINVAL;
+		goto error;
+	}
+
+	if (kkm_kontext->payload_xsave_size < kkm_xsave_size) {
+		xsave = kkm_xsave_alloc(kkm_xsave_size);
+		if (xsave == NULL) {
+			ret_val = -ENOMEM;
+			printk(KERN_NOTICE
+			       "kkm_kontext_xfd_enable: Thread %llx failed to allocate "
+			       "memory for xsave area error(%d)\n",
+			       kkm_kontext->id, ret_val);
+			goto error;
+		}
+		memcpy(xsave, kkm_kontext->kkm_payload_xsave,
+		       kkm_kontext->payload_xsave_size);
+		kkm_xsave_free(kkm_kontext->kkm_payload_xsave,
+			       kkm_kontext->payload_xsave_size);
+
+		kkm_kontext->kkm_payload_xsave = xsave;
+		kkm_kontext->payload_xsave_size = kkm_xsave_size;
+	}
+	kkm_kontext->xfd_enabled |= features;
+
+error:
+	return ret_val;
+}
+
+/*
+ * duplicate payload visible state of src kontext in dst
+ * used for forked child, caller owns src so it is not running
+ */
+int kkm_kontext_clone(struct kkm_kontext *dst, struct kkm_kontext *src)
+{
+	int ret_val = 0;
+	struct kkm_guest_area *dst_ga =
+		(struct kkm_guest_area *)dst->guest_area;
+	struct kkm_guest_area *src_ga =
+		(struct kkm_guest_area *)src->guest_area;
+
+	if (src->xfd_enabled != 0) {
+		ret_val = kkm_kontext_xfd_enable(dst, src->xfd_enabled);
+		if (ret_val != 0) {
+			goto error;
+		}
+	}
+
+	memcpy(&dst_ga->regs, &src_ga->regs, sizeof(struct kkm_regs));
+	memcpy(&dst_ga->sregs, &src_ga->sregs, sizeof(struct kkm_sregs));
+	memcpy(&dst_ga->debug, &src_ga->debug, sizeof(struct kkm_debug));
+	memcpy(&dst_ga->fpu, &src_ga->fpu, sizeof(struct kkm_fpu));
+	dst->debug_registers_set = src->debug_registers_set;
+
+	memcpy(dst->kkm_payload_xsave, src->kkm_payload_xsave,
+	       src->payload_xsave_size);
+	dst->valid_payload_xsave_area = src->valid_payload_xsave_area;
+
+	/*
+	 * monitor addresses are same in forked child
+	 */
+	dst->syscall_pending = src->syscall_pending;
+	dst->ret_val_mva = src->ret_val_mva;
+	dst->exception_posted = src->exception_posted;
+	dst->exception_saved_rax = src->exception_saved_rax;
+	dst->exception_saved_rbx = src->exception_saved_rbx;
+
+	memcpy((void *)dst->mmap_area[1].kvaddr,
+	       (void *)src->mmap_area[1].kvaddr,
+	       sizeof(struct kkm_private_area));
+
+	/*
+	 * fork keeps rseq and fault handler registrations,
+	 * child cpu_id is published on its first entry
+	 */
+	dst->rseq = src->rseq;
+	dst->rseq.cpu = -1;
+	dst->fault = src->fault;
+
+	/*
+	 * child continues from where parent stopped, not a new clone thread
+	 */
+	dst->new_thread = false;
+
+error:
 	return ret_val;
 }
 
@@ -219,6 +494,56 @@ void kkm_kontext_set_save_info(struct kkm_kontext *kkm_kontext,
 	kkm_kontext->new_thread = si->new_thread;
 }
 
+/*
+ * take ownership of idle kontext for current task
+ * kontext state is only changed by its owner
+ */
+bool kkm_kontext_acquire(struct kkm_kontext *kkm_kontext)
+{
+	return cmpxchg(&kkm_kontext->task, NULL, current) == NULL;
+}
+
+/*
+ * hand kontext back, next acquire can come from any task
+ */
+void kkm_kontext_release(struct kkm_kontext *kkm_kontext)
+{
+	smp_store_release(&kkm_kontext->task, NULL);
+	wake_up_var(&kkm_kontext->task);
+}
+
+/*
+ * kontext fd is closed, wait for task running kontext
+ * by index to finish. kontext stays owned until it is reused.
+ */
+void kkm_kontext_wait_idle(struct kkm_kontext *kkm_kontext)
+{
+	wait_var_event(&kkm_kontext->task,
+		       kkm_kontext_acquire(kkm_kontext) == true);
+}
+
+/*
+ * kernel address of kontext map page
+ * pages not used by kkm are allocated on first access
+ */
+unsigned long kkm_kontext_map_page(struct kkm_kontext *kkm_kontext,
+				   uint32_t index)
+{
+	struct kkm_kontext_mmap_area *kkma = &kkm_kontext->mmap_area[index];
+	unsigned long kvaddr = 0;
+
+	if (READ_ONCE(kkma->kvaddr) == 0) {
+		kvaddr = get_zeroed_page(GFP_KERNEL);
+		if (kvaddr == 0) {
+			return 0;
+		}
+		if (cmpxchg(&kkma->kvaddr, 0, kvaddr) != 0) {
+			free_page(kvaddr);
+		}
+	}
+	return READ_ONCE(kkma->kvaddr);
+}
+
 /*
  * copy system call result back to payload
  */
@@ -243,6 +568,7 @@ int kkm_kontext_handle_syscall_response(struct kkm_kontext *kontext,
 		ga->regs.rax = syscall_ret_value;
 		kontext->syscall_pending = false;
 		kontext->ret_val_mva = -1;
+		kontext->syscall_return = true;
 		ga->regs.rsp += sizeof(struct kkm_hc_args);
 		ga->regs.rsp += KKM_ABI_REDZONE;
 	}
@@ -251,6 +577,49 @@ error:
 	return ret_val;
 }
 
+/*
+ * arm XFD features payload has not used yet,
+ * their state doesn't fit in payload xsave area.
+ * called with interrupts disabled, after kernel xstate is saved
+ */
+static inline void kkm_kontext_xfd_guest_entry(struct kkm_kontext *kkm_kontext)
+{
+	uint64_t guest_xfd = 0;
+
+	if (kkm_xfd_features == 0) {
+		return;
+	}
+	rdmsrl(MSR_IA32_XFD, kkm_kontext->native_xfd);
+	guest_xfd = kkm_xfd_features & ~kkm_kontext->xfd_enabled;
+	if (guest_xfd != kkm_kontext->native_xfd) {
+		wrmsrl(MSR_IA32_XFD, guest_xfd);
+	}
+}
+
+/*
+ * capture XFD_ERR of a payload #NM before host can see it,
+ * restore native XFD before kernel xstate is restored
+ */
+static inline void kkm_kontext_xfd_guest_exit(struct kkm_kontext *kkm_kontext,
+					      struct kkm_guest_area *ga)
+{
+	uint64_t guest_xfd = 0;
+
+	if (kkm_xfd_features == 0) {
+		return;
+	}
+	if (ga->intr_no == X86_TRAP_NM) {
+		rdmsrl(MSR_IA32_XFD_ERR, kkm_kontext->xfd_err);
+		if (kkm_kontext->xfd_err != 0) {
+			wrmsrl(MSR_IA32_XFD_ERR, 0);
+		}
+	}
+	guest_xfd = kkm_xfd_features & ~kkm_kontext->xfd_enabled;
+	if (guest_xfd != kkm_kontext->native_xfd) {
+		wrmsrl(MSR_IA32_XFD, kkm_kontext->native_xfd);
+	}
+}
+
 /*
  * running in native kernel address space
  */
@@ -306,6 +675,13 @@ int kkm_kontext_switch_kernel(struct kkm_kontext *kkm_kontext)
 	kkm_kontext->prev_error_code = -1;
 	kkm_kontext->trap_repeat_counter = -1;
 
+	/*
+	 * payload performance counters count from here
+	 */
+	if ((ret_val = kkm_perf_run_begin(kkm_kontext)) != 0) {
+		goto error;
+	}
+
 begin:
 	if (signal_pending(current) != 0) {
 		kkm_run->exit_reason = KKM_EXIT_INTR;
@@ -314,6 +690,13 @@ begin:
 	}
 	ret_val = 0;
 
+	/*
+	 * abort payload rseq critical section, publish cpu_id
+	 */
+	if ((ret_val = kkm_rseq_guest_entry(kkm_kontext, ga)) != 0) {
+		goto error;
+	}
+
 	/*
 	 * disable interrupts
 	 */
@@ -321,6 +704,15 @@ begin:
 
 	cpu = get_cpu();
 
+	/*
+	 * migrated after cpu_id was published
+	 */
+	if (kkm_rseq_cpu_valid(kkm_kontext, cpu) == false) {
+		local_irq_enable();
+		put_cpu();
+		goto begin;
+	}
+
 	/*
 	 * setup physical cpu kontain area to this kontext guest area
 	 */
@@ -336,15 +728,11 @@ begin:
 
 	per_cpu(current_kontext, cpu) = kkm_kontext;
 
-	if (kkm_cpu_full_tlb_flush == false) {
-		if ((lazy_flush_tlb == false) || (cpu != ga->cpu) ||
-		    (kkm->id != kkm_idt_get_id(cpu))) {
-			/*
-			 * invalidate older TLB entries
-			 */
-			kkm_mmu_flush_tlb();
-		}
-	}
+	/*
+	 * guest TLB handling for this entry
+	 */
+	kkm_tlb_guest_entry(kkm_kontext, cpu);
+
 	ga->cpu = cpu;
 	kkm_idt_set_id(cpu, kkm->id);
 
@@ -363,9 +751,14 @@ begin:
 	savesegment(es, kkm_kontext->native_kernel_es);
 
 	savesegment(fs, kkm_kontext->native_kernel_fs);
-	rdmsrl(MSR_FS_BASE, kkm_kontext->native_kernel_fs_base);
 	savesegment(gs, kkm_kontext->native_kernel_gs);
-	rdmsrl(MSR_GS_BASE, kkm_kontext->native_kernel_gs_base);
+	if (kkm_cpu_fsgsbase == true) {
+		kkm_kontext->native_kernel_fs_base = kkm_rdfsbase();
+		kkm_kontext->native_kernel_gs_base = kkm_rdgsbase();
+	} else {
+		rdmsrl(MSR_FS_BASE, kkm_kontext->native_kernel_fs_base);
+		rdmsrl(MSR_GS_BASE, kkm_kontext->native_kernel_gs_base);
+	}
 	rdmsrl(MSR_KERNEL_GS_BASE, kkm_kontext->native_kernel_gs_kern_base);
 
 	savesegment(ss, kkm_kontext->native_kernel_ss);
@@ -374,7 +767,8 @@ begin:
 	 * save kernel xstate
 	 * restore payload xstate
 	 */
-	(*kkm_fpu_save_xstate)(kkm_kontext->kkm_kernel_xsave);
+	(*kkm_fpu_save_xstate)(per_cpu(kkm_kernel_xsave, cpu));
+	kkm_kontext_xfd_guest_entry(kkm_kontext);
 	if (kkm_kontext->valid_payload_xsave_area == true) {
 		(*kkm_fpu_restore_xstate)(kkm_kontext->kkm_payload_xsave);
 	}
@@ -391,6 +785,10 @@ begin:
 
 	ga->intr_no = -1;
 
+	if (kontext_guest_time == true) {
+		kkm_kontext->stats.entry_time_ns = ktime_get_ns();
+	}
+
 	/*
 	 * switch to guest kernel
 	 * this code will switch stacks
@@ -408,7 +806,8 @@ begin:
 	 * restore kernel xstate
 	 */
 	(*kkm_fpu_save_xstate)(kkm_kontext->kkm_payload_xsave);
-	(*kkm_fpu_restore_xstate)(kkm_kontext->kkm_kernel_xsave);
+	kkm_kontext_xfd_guest_exit(kkm_kontext, ga);
+	(*kkm_fpu_restore_xstate)(per_cpu(kkm_kernel_xsave, cpu));
 	kkm_kontext->valid_payload_xsave_area = true;
 
 	/*
@@ -418,6 +817,15 @@ begin:
 
 	put_cpu();
 
+	if (kontext_guest_time == true &&
+	    kkm_kontext->stats.entry_time_ns != 0) {
+		kkm_kontext->stats.guest_time_ns +=
+			ktime_get_ns() - kkm_kontext->stats.entry_time_ns;
+		kkm_kontext->stats.entry_time_ns = 0;
+	}
+	kkm_kontext->stats.exit_count++;
+	kkm_kontext->stats.last_intr_no = ga->intr_no;
+
 	ret_val = kkm_process_intr(kkm_kontext);
 	if (ret_val == KKM_KONTEXT_FAULT_PROCESS_DONE) {
 		if (ga->intr_no == LOCAL_TIMER_VECTOR) {
@@ -449,7 +857,13 @@ begin:
 				       "error code %llx\n",
 				       kkm_kontext->id, kkm_kontext->trap_addr,
 				       kkm_kontext->error_code);
-				ret_val = -EFAULT;
+				ret_val = kkm_fault_unresolved(
+					kkm_kontext, ga, kkm_run,
+					kkm_kontext->trap_addr,
+					kkm_kontext->error_code);
+				if (ret_val == KKM_KONTEXT_FAULT_PROCESS_DONE) {
+					goto begin;
+				}
 				goto error;
 			}
 			goto begin;
@@ -462,11 +876,41 @@ begin:
 	}
 
 error:
+	kkm_perf_run_end(kkm_kontext);
+	kkm_kontext->stats.last_exit_reason = kkm_run->exit_reason;
 	return ret_val;
 }
 
 /*
- * running in guest kernel address space
+ * sysret loads rip from rcx and rflags from r11,
+ * use it only when payload state matches what SYSCALL left behind
+ */
+static bool kkm_kontext_sysret_allowed(struct kkm_kontext *kkm_kontext,
+				       struct kkm_guest_area *ga)
+{
+	if (kkm_kontext->debug_registers_set == true) {
+		return false;
+	}
+	if ((ga->regs.rflags & X86_EFLAGS_TF) != 0) {
+		return false;
+	}
+	if (ga->regs.rcx != ga->regs.rip) {
+		return false;
+	}
+	if (ga->regs.rip >= KKM_SYSRET_RIP_LIMIT) {
+		return false;
+	}
+	/*
+	 * resume flag only matters with debug registers
+	 */
+	if (((ga->regs.rflags ^ ga->regs.r11) & ~X86_EFLAGS_RF) != 0) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * running in native kernel address space
  * running on guest private area stack
  */
 void kkm_guest_kernel_start_payload(struct kkm_guest_area *ga)
@@ -487,7 +931,11 @@ void kkm_guest_kernel_start_payload(struct kkm_guest_area *ga)
 	loadsegment(es, 0);
 
 	loadsegment(fs, 0);
-	wrmsrl(MSR_FS_BASE, ga->sregs.fs.base);
+	if (kkm_cpu_fsgsbase == true) {
+		kkm_wrfsbase(ga->sregs.fs.base);
+	} else {
+		wrmsrl(MSR_FS_BASE, ga->sregs.fs.base);
+	}
 
 	wrmsrl(MSR_KERNEL_GS_BASE, ga->sregs.gs.base);
 
@@ -533,6 +981,18 @@ void kkm_guest_kernel_start_payload(struct kkm_guest_area *ga)
 		kkm_hw_debug_registers_restore(ga->debug.registers);
 	}
 
+	/*
+	 * returning from SYSCALL hypercall, try sysret fast path
+	 */
+	ga->guest_sysret = false;
+	if ((sysret_fast_path == true) &&
+	    (kkm_kontext->syscall_return == true) &&
+	    (kkm_kontext_sysret_allowed(kkm_kontext, ga) == true)) {
+		ga->guest_sysret = true;
+		kkm_statistics_sysret_entry_count_inc();
+	}
+	kkm_kontext->syscall_return = false;
+
 	/*
 	 * verify stack redzone
 	 */
@@ -544,6 +1004,8 @@ void kkm_guest_kernel_start_payload(struct kkm_guest_area *ga)
 	ga->native_save_tss_sp0 = cea->tss.x86_tss.sp0;
 	ga->native_save_tss_sp1 = cea->tss.x86_tss.sp1;
 	ga->native_save_tss_sp2 = cea->tss.x86_tss.sp2;
+	ga->native_save_tss_ist_nmi = cea->tss.x86_tss.ist[KKM_IST_INDEX_NMI];
+	ga->native_save_tss_ist_mce = cea->tss.x86_tss.ist[KKM_IST_INDEX_MCE];
 
 	/*
 	 * ga is pointing to kx area
@@ -553,6 +1015,20 @@ void kkm_guest_kernel_start_payload(struct kkm_guest_area *ga)
 	estack_start = (uint64_t)(&ga->redzone_bottom);
 	load_sp0(estack_start);
 
+	/*
+	 * nmi and machine check can arrive in ring 0 on this stack
+	 * or on payload stack(sysret window), maskable interrupts are off
+	 * and sysret is not used when payload can trigger #DB.
+	 * give them separate stacks in guest area, slots are not used
+	 * by host idt.
+	 */
+	this_cpu_write(cpu_tss_rw.x86_tss.ist[KKM_IST_INDEX_NMI],
+		       (uint64_t)&ga->nmi_stack[KKM_GUEST_IST_STACK_SIZE] &
+			       ~0xfULL);
+	this_cpu_write(cpu_tss_rw.x86_tss.ist[KKM_IST_INDEX_MCE],
+		       (uint64_t)&ga->mce_stack[KKM_GUEST_IST_STACK_SIZE] &
+			       ~0xfULL);
+
 	/*
 	 * interrupts are disbled at the begining of switch_kernel
 	 * set new idt
@@ -571,12 +1047,13 @@ void kkm_guest_kernel_start_payload(struct kkm_guest_area *ga)
 
 /*
  * should be called from trap code, with zero context
- * enters with guest kernel cr3
+ * enters with guest payload cr3, kernel half of it is native kernel
  * running on guest stack
  */
 void kkm_switch_to_host_kernel(struct kkm_guest_area *ga)
 {
 	struct kkm_kontext *kkm_kontext = NULL;
+	uint64_t native_cr3 = 0;
 
 	kkm_kontext = ga->kkm_kontext;
 
@@ -590,12 +1067,26 @@ void kkm_switch_to_host_kernel(struct kkm_guest_area *ga)
 		kkm_hw_debug_registers_save(ga->debug.registers);
 	}
 
+	/*
+	 * payload can change fs/gs base with WRFSBASE/WRGSBASE,
+	 * capture live values before native ones are restored.
+	 * payload gs base is inactive after swapgs on trap entry.
+	 */
+	if (kkm_cpu_fsgsbase == true) {
+		ga->sregs.fs.base = kkm_rdfsbase();
+		rdmsrl(MSR_KERNEL_GS_BASE, ga->sregs.gs.base);
+	}
+
 	/*
 	 * restore native kernel tss sp0 (intr stack)
 	 */
 	load_sp0(ga->native_save_tss_sp0);
 	this_cpu_write(cpu_tss_rw.x86_tss.sp1, ga->native_save_tss_sp1);
 	this_cpu_write(cpu_tss_rw.x86_tss.sp2, ga->native_save_tss_sp2);
+	this_cpu_write(cpu_tss_rw.x86_tss.ist[KKM_IST_INDEX_NMI],
+		       ga->native_save_tss_ist_nmi);
+	this_cpu_write(cpu_tss_rw.x86_tss.ist[KKM_IST_INDEX_MCE],
+		       ga->native_save_tss_ist_mce);
 
 	/*
 	 * restore native kernel idt
@@ -614,19 +1105,33 @@ void kkm_switch_to_host_kernel(struct kkm_guest_area *ga)
 	loadsegment(es, kkm_kontext->native_kernel_es);
 
 	loadsegment(fs, kkm_kontext->native_kernel_fs);
-	wrmsrl(MSR_FS_BASE, kkm_kontext->native_kernel_fs_base);
-
 	load_gs_index(kkm_kontext->native_kernel_gs);
-	wrmsrl(MSR_GS_BASE, kkm_kontext->native_kernel_gs_base);
+	if (kkm_cpu_fsgsbase == true) {
+		kkm_wrfsbase(kkm_kontext->native_kernel_fs_base);
+		kkm_wrgsbase(kkm_kontext->native_kernel_gs_base);
+	} else {
+		wrmsrl(MSR_FS_BASE, kkm_kontext->native_kernel_fs_base);
+		wrmsrl(MSR_GS_BASE, kkm_kontext->native_kernel_gs_base);
+	}
 	wrmsrl(MSR_KERNEL_GS_BASE, kkm_kontext->native_kernel_gs_kern_base);
 
 	loadsegment(ss, __KERNEL_DS);
 
+	/*
+	 * native kernel TLB entries are not touched while in guest,
+	 * host flush requests arriving meanwhile are forwarded after return
+	 */
+	native_cr3 = kkm_kontext->native_kernel_cr3;
+	if ((kkm_cpu_full_tlb_flush == false) &&
+	    ((native_cr3 & PCID_MASK) != 0)) {
+		native_cr3 |= KKM_CR3_NOFLUSH;
+	}
+
 	/*
 	 * restore native kernel address space
 	 * restore rest of the registers and switch stacks
 	 */
-	kkm_switch_to_hk_asm(kkm_kontext->native_kernel_cr3,
+	kkm_switch_to_hk_asm(native_cr3,
 			     ((struct kkm_guest_area *)kkm_kontext->guest_area)
 				     ->native_kernel_stack);
 }
@@ -711,10 +1216,13 @@ int kkm_process_intr(struct kkm_kontext *kkm_kontext)
 		case X86_TRAP_OF:
 		case X86_TRAP_BR:
 		case X86_TRAP_UD:
-		case X86_TRAP_NM:
 			ret_val = kkm_process_common_without_error(kkm_kontext,
 								   ga, kkm_run);
 			break;
+		case X86_TRAP_NM:
+			ret_val = kkm_process_device_not_available(kkm_kontext,
+								   ga, kkm_run);
+			break;
 		case X86_TRAP_DF:
 			ret_val = kkm_process_common_with_error(kkm_kontext, ga,
 								kkm_run);
@@ -788,6 +1296,8 @@ void kkm_setup_hypercall(struct kkm_kontext *kkm_kontext,
 {
 	struct kkm_private_area *pa = NULL;
 
+	kkm_kontext->stats.hypercall_count++;
+
 	kkm_run->exit_reason = KKM_EXIT_IO;
 	kkm_run->io.direction = KKM_EXIT_IO_OUT;
 	kkm_run->io.size = KKM_HYPERCALL_IO_SIZE;
@@ -812,6 +1322,13 @@ int kkm_process_common_without_error(struct kkm_kontext *kkm_kontext,
 	uint64_t gva = 0;
 	uint64_t mva = 0;
 
+	/*
+	 * bpf handler fixed up payload state
+	 */
+	if (kkm_bpf_exception(kkm_kontext, ga, kkm_run) == true) {
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+
 	args.rax = ga->regs.rax;
 	args.rbx = ga->regs.rbx;
 	args.rdx = ga->regs.rdx;
@@ -847,6 +1364,25 @@ error:
 	return ret_val;
 }
 
+/*
+ * #NM with XFD_ERR set is payload's first use of an XFD armed feature,
+ * grow payload xsave area and restart faulting instruction.
+ * other #NM are forwarded to monitor
+ */
+int kkm_process_device_not_available(struct kkm_kontext *kkm_kontext,
+				     struct kkm_guest_area *ga,
+				     struct kkm_run *kkm_run)
+{
+	uint64_t features = kkm_kontext->xfd_err & kkm_xfd_features;
+
+	kkm_kontext->xfd_err = 0;
+	if (features != 0 &&
+	    kkm_kontext_xfd_enable(kkm_kontext, features) == 0) {
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+	return kkm_process_common_without_error(kkm_kontext, ga, kkm_run);
+}
+
 /*
  * processing differed to monitor
  * record exception and return to monitor
@@ -860,6 +1396,13 @@ int kkm_process_common_with_error(struct kkm_kontext *kkm_kontext,
 	uint64_t gva = 0;
 	uint64_t mva = 0;
 
+	/*
+	 * bpf handler fixed up payload state
+	 */
+	if (kkm_bpf_exception(kkm_kontext, ga, kkm_run) == true) {
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+
 	args.rax = ga->regs.rax;
 	args.rbx = ga->regs.rbx;
 	args.rdx = ga->regs.rdx;
@@ -950,6 +1493,16 @@ int kkm_process_general_protection(struct kkm_kontext *kkm_kontext,
 		goto error;
 	}
 
+	/*
+	 * bpf handler writes result to hypercall args in guest memory
+	 */
+	if (kkm_bpf_hypercall(kkm_kontext, ga, kkm_run,
+			      KKM_BPF_REASON_HYPERCALL, (uint16_t)ga->regs.rdx,
+			      (uint32_t)ga->regs.rax) == true) {
+		ga->regs.rip += 1;
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+
 	kkm_setup_hypercall(kkm_kontext, ga, kkm_run, ga->regs.rdx,
 			    ga->regs.rax, FAULT_HYPER_CALL);
 	ga->regs.rip += 1;
@@ -961,6 +1514,121 @@ error:
 	return ret_val;
 }
 
+static unsigned int kkm_fault_gup_flags(uint64_t error_code)
+{
+	if ((error_code & X86_PF_WRITE) == X86_PF_WRITE) {
+		return FOLL_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * check if monitor page is accessible without faulting
+ * common case, page is present and gup is not needed
+ */
+static bool kkm_fault_in_nofault(uint64_t monitor_address, uint64_t error_code)
+{
+	uint8_t data = 0;
+
+	if (copy_from_user_nofault(&data, (void *)monitor_address,
+				   sizeof(uint8_t))) {
+		return false;
+	}
+	if (((error_code & X86_PF_WRITE) == X86_PF_WRITE) &&
+	    copy_to_user_nofault((void *)monitor_address, &data,
+				 sizeof(uint8_t))) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * fault in monitor page if it can be done without waiting for I/O
+ * FOLL_NOWAIT uses FAULT_FLAG_RETRY_NOWAIT, I/O is started and
+ * 0 or -EBUSY is returned when page is not ready
+ * other errors are reported by fault processing that follows
+ */
+static long kkm_fault_in_nowait(uint64_t monitor_address, uint64_t error_code)
+{
+	struct page *page = NULL;
+	long npages = 0;
+
+	npages = get_user_pages_unlocked(monitor_address & PAGE_MASK, 1, &page,
+					 kkm_fault_gup_flags(error_code) |
+						 FOLL_NOWAIT);
+	if (npages == 1) {
+		put_page(page);
+	}
+	return npages;
+}
+
+/*
+ * wait for monitor page I/O started by kkm_fault_in_nowait
+ * errors are reported by fault processing that follows
+ */
+static void kkm_fault_in_wait(uint64_t monitor_address, uint64_t error_code)
+{
+	struct page *page = NULL;
+	long npages = 0;
+
+	/* statistics */
+	kkm_statistics_async_page_fault_count_inc();
+
+	npages = get_user_pages_unlocked(monitor_address & PAGE_MASK, 1, &page,
+					 kkm_fault_gup_flags(error_code));
+	if (npages == 1) {
+		put_page(page);
+	}
+}
+
+/*
+ * not present fault in lazily populated slot is reported to km once,
+ * km populates the page and runs again.
+ * page that was populated before (swapped out, reclaimed) is not reported,
+ * it is faulted in normally without km filling it again.
+ * repeat fault on the same page is processed normally.
+ */
+static bool kkm_process_lazy_fault(struct kkm_kontext *kkm_kontext,
+				   struct kkm_run *kkm_run,
+				   uint64_t monitor_fault_address,
+				   bool priv_area, uint64_t error_code)
+{
+	uint64_t gpa = 0;
+	int slot = -1;
+
+	if (priv_area == true || (error_code & X86_PF_PROT) != 0) {
+		return false;
+	}
+
+	gpa = (monitor_fault_address - KKM_KM_USER_MEM_BASE) & PAGE_MASK;
+	slot = kkm_kontainer_lazy_slot(kkm_kontext->kkm, gpa);
+	if (slot < 0) {
+		return false;
+	}
+
+	if (kkm_kontext->lazy_fault_gpa == gpa) {
+		kkm_kontext->lazy_fault_gpa = -1;
+		return false;
+	}
+	if (kkm_mm_user_page_none(kkm_kontext->kkm->mm,
+				  monitor_fault_address) == false) {
+		return false;
+	}
+	kkm_kontext->lazy_fault_gpa = gpa;
+
+	kkm_run->exit_reason = KKM_EXIT_MEMORY_FAULT;
+	kkm_run->memory_fault.flags = KKM_MEMORY_EXIT_FLAG_LAZY;
+	kkm_run->memory_fault.gpa = gpa;
+	kkm_run->memory_fault.size = PAGE_SIZE;
+	kkm_run->memory_fault.slot = slot;
+	kkm_run->memory_fault.padding = 0;
+
+	/* statistics */
+	kkm_statistics_lazy_fault_count_inc();
+
+	return true;
+}
+
 int kkm_process_page_fault(struct kkm_kontext *kkm_kontext,
 			   struct kkm_guest_area *ga, struct kkm_run *kkm_run)
 {
@@ -970,6 +1638,7 @@ int kkm_process_page_fault(struct kkm_kontext *kkm_kontext,
 	bool priv_area = false;
 	struct kkm *kkm = kkm_kontext->kkm;
 	uint64_t start_time = 0, end_time = 0;
+	long npages = 0;
 
 	start_time = ktime_get_ns();
 
@@ -989,6 +1658,33 @@ int kkm_process_page_fault(struct kkm_kontext *kkm_kontext,
 	}
 
 	if ((error_code & X86_PF_USER) == X86_PF_USER) {
+		/*
+		 * first touch of lazily populated page, let km fill it
+		 */
+		if (kkm_process_lazy_fault(kkm_kontext, kkm_run,
+					   monitor_fault_address, priv_area,
+					   error_code) == true) {
+			ret_val = 0;
+			goto error;
+		}
+
+		/*
+		 * monitor page needs I/O, wait for it without pf_lock
+		 * other kontexts keep processing their faults
+		 */
+		if ((async_page_fault == true) &&
+		    (kkm_fault_in_nofault(monitor_fault_address, error_code) ==
+		     false)) {
+			npages = kkm_fault_in_nowait(monitor_fault_address,
+						     error_code);
+			if (npages == 0 || npages == -EBUSY) {
+				mutex_unlock(&kkm->pf_lock);
+				kkm_fault_in_wait(monitor_fault_address,
+						  error_code);
+				mutex_lock(&kkm->pf_lock);
+			}
+		}
+
 		/*
 		 * copy 1 bytes from monitor virtual address
 		 * this will trigger native kernel page fault
@@ -1009,6 +1705,18 @@ int kkm_process_page_fault(struct kkm_kontext *kkm_kontext,
 			}
 		}
 
+		/*
+		 * payload memory beyond first 512GB may be in a pml4 entry
+		 * km populated after guest page tables were synced,
+		 * sync only when entry for faulting address is stale
+		 */
+		if ((priv_area == false) && (kkm_guest_pml4_count > 1) &&
+		    (kkm_mmu_payload_synced((uint64_t)kkm->mm->pgd,
+					    kkm->gp_pgd.va, kkm->low_p4d.va,
+					    ga->sregs.cr2) == false)) {
+			kkm_kontainer_sync_payload(kkm);
+		}
+
 		/*
 		 * this fault is non linear map area
 		 * we need to update page tables correctly
@@ -1018,15 +1726,16 @@ int kkm_process_page_fault(struct kkm_kontext *kkm_kontext,
 						 monitor_fault_address,
 						 (uint64_t)kkm->mm->pgd,
 						 &kkm->kkm_guest_pml4e);
+			/*
+			 * entry could be cached by other cpus
+			 */
+			atomic64_inc(&kkm->tlb_gen);
 		}
 
 		/*
-		 * invalidate this address from TLB
-		 * when full TLB flush is not done on re-entry to guest
+		 * invalidate this address from TLB before re-entry
 		 */
-		if (kkm_cpu_full_tlb_flush == false) {
-			kkm_mmu_flush_tlb_one_page(ga->sregs.cr2);
-		}
+		kkm_tlb_fault_resolved(kkm_kontext, ga->sregs.cr2, error_code);
 
 		ret_val = KKM_KONTEXT_FAULT_PROCESS_DONE;
 
@@ -1055,12 +1764,23 @@ error:
 	end_time = ktime_get_ns();
 
 	/* statistics */
+	kkm_kontext->stats.page_fault_count++;
 	kkm_statistics_page_fault_count_inc();
 	if (ret_val && ret_val != KKM_KONTEXT_FAULT_PROCESS_DONE) {
 		kkm_statistics_failed_page_fault_count_inc();
 	}
 	kkm_statistics_page_fault_time_ns_add(end_time - start_time);
 
+	/*
+	 * payload address km has no memory for, let monitor or
+	 * payload handler see it instead of failing KKM_RUN
+	 */
+	if (ret_val == -EFAULT && (error_code & X86_PF_USER) == X86_PF_USER) {
+		ret_val = kkm_fault_unresolved(kkm_kontext, ga, kkm_run,
+					       kkm_kontext->trap_addr,
+					       error_code);
+	}
+
 	return ret_val;
 }
 
@@ -1073,6 +1793,22 @@ int kkm_process_syscall(struct kkm_kontext *kkm_kontext,
 	uint64_t mva = 0;
 	uint64_t hcargs_indirect_ptr_mva = 0;
 
+	/*
+	 * I/O on registered monitor fd, no exit to monitor
+	 */
+	if (kkm_direct_io_hypercall(kkm_kontext, ga) == true) {
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+
+	/*
+	 * bpf handler sets return value in rax
+	 */
+	if (kkm_bpf_hypercall(kkm_kontext, ga, kkm_run, KKM_BPF_REASON_SYSCALL,
+			      ga->regs.rax, 0) == true) {
+		kkm_kontext->syscall_return = true;
+		return KKM_KONTEXT_FAULT_PROCESS_DONE;
+	}
+
 	ga->regs.rsp -= KKM_ABI_REDZONE;
 	ga->regs.rsp -= sizeof(struct kkm_hc_args);
 	gva = ga->regs.rsp;
@@ -1112,6 +1848,18 @@ int kkm_process_syscall(struct kkm_kontext *kkm_kontext,
 
 	kkm_kontext->syscall_pending = true;
 	kkm_kontext->ret_val_mva = mva;
+
+	/*
+	 * monitor worker completed hypercall, return to payload
+	 */
+	if (kkm_switchless_hypercall(kkm_kontext, ga, gva) == true) {
+		ret_val = kkm_kontext_handle_syscall_response(kkm_kontext, ga);
+		if (ret_val == 0) {
+			ret_val = KKM_KONTEXT_FAULT_PROCESS_DONE;
+		}
+		goto error;
+	}
+
 	ga->regs.rax = gva;
 
 error:
@@ -1124,7 +1872,6 @@ bool kkm_guest_va_to_monitor_va(struct kkm_kontext *kkm_kontext,
 {
 	struct kkm_guest_area *ga =
 		(struct kkm_guest_area *)kkm_kontext->guest_area;
-	struct kkm_mem_slot *mem_slot = NULL;
 	bool ret_val = false;
 
 	*monitor_va = 0;
@@ -1136,7 +1883,7 @@ bool kkm_guest_va_to_monitor_va(struct kkm_kontext *kkm_kontext,
 	 * bottom va text
 	 */
 	if (guest_va >= KKM_GUEST_MEM_START_VA &&
-	    guest_va < KKM_GUEST_MAX_PHYS_MEM) {
+	    guest_va < KKM_GUEST_MEM_BOTTOM_END_VA) {
 		*monitor_va = KKM_KM_USER_MEM_BASE + guest_va;
 		ret_val = true;
 		goto end;
@@ -1154,31 +1901,10 @@ bool kkm_guest_va_to_monitor_va(struct kkm_kontext *kkm_kontext,
 	}
 
 	/*
-	 * vdso + vvar
-	 */
-	mem_slot = &kkm_kontext->kkm->mem_slot[KKM_KM_RSRV_VDSOSLOT];
-	if (mem_slot->used == true && guest_va >= KKM_GUEST_VVAR_VDSO_BASE_VA &&
-	    guest_va <
-		    (KKM_GUEST_VVAR_VDSO_BASE_VA + mem_slot->mr.memory_size)) {
-		*monitor_va = guest_va - KKM_GUEST_VVAR_VDSO_BASE_VA +
-			      mem_slot->mr.userspace_addr;
-		if (priv_area != NULL) {
-			*priv_area = true;
-		}
-		ret_val = true;
-		goto end;
-	}
-
-	/*
-	 * guest mem
+	 * vdso + vvar + guest mem
 	 */
-	mem_slot = &kkm_kontext->kkm->mem_slot[KKM_KM_RSRV_KMGUESTMEM_SLOT];
-	if (mem_slot->used == true &&
-	    guest_va >= KKM_GUEST_KMGUESTMEM_BASE_VA &&
-	    guest_va <
-		    (KKM_GUEST_KMGUESTMEM_BASE_VA + mem_slot->mr.memory_size)) {
-		*monitor_va = guest_va - KKM_GUEST_KMGUESTMEM_BASE_VA +
-			      mem_slot->mr.userspace_addr;
+	if (kkm_kontainer_priv_va_to_monitor_va(kkm_kontext->kkm, guest_va,
+						monitor_va) == true) {
 		if (priv_area != NULL) {
 			*priv_area = true;
 		}
@@ -1199,3 +1925,30 @@ end:
 
 	return ret_val;
 }
+
+/*
+ * guest range has to be one linear range of payload memory
+ * in monitor, private area is not accepted
+ */
+bool kkm_guest_range_to_monitor_va(struct kkm_kontext *kkm_kontext,
+				   uint64_t guest_va, uint64_t size,
+				   uint64_t *monitor_va)
+{
+	uint64_t end_mva = 0;
+	bool priv_area = false;
+
+	if (size == 0) {
+		return false;
+	}
+	if (kkm_guest_va_to_monitor_va(kkm_kontext, guest_va, monitor_va,
+				       &priv_area) == false ||
+	    priv_area == true) {
+		return false;
+	}
+	if (kkm_guest_va_to_monitor_va(kkm_kontext, guest_va + size - 1,
+				       &end_mva, &priv_area) == false ||
+	    priv_area == true) {
+		return false;
+	}
+	return end_mva - *monitor_va == size - 1;
+}
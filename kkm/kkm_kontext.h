@@ -33,12 +33,21 @@
 
 #define KKM_GUEST_COPY_BUFFER (128)
 
+/* nmi and machine check stacks in guest private data */
+#define KKM_GUEST_IST_STACK_SIZE (1024)
+
 #define KKM_KONTEXT_FAULT_PROCESS_DONE (256)
 #define KKM_OUT_OPCODE (0xEF)
 #define KKM_INTR_SYSCALL (511) /* system call instruction is executed */
 
 #define KKM_INVALID_CPU_ID (-1ULL)
 
+/*
+ * sysret faults in kernel mode with non canonical rcx,
+ * allow only addresses well below user address space end
+ */
+#define KKM_SYSRET_RIP_LIMIT ((1ULL << 47) - PAGE_SIZE)
+
 /*
  * keep in sync with km_hcalls.h:km_hc_args
  */
@@ -107,7 +116,7 @@ struct kkm_guest_area {
 			struct kkm_kontext *kkm_kontext;
 			uint64_t guest_area_beg; /* virtual address of this struct */
 			uint64_t native_kernel_stack; /* %rsp before switching stacks */
-			uint64_t guest_kernel_cr3; /* guest kernels pml4 pointer */
+			uint64_t guest_kernel_cr3; /* same as guest_payload_cr3 */
 			uint64_t guest_kernel_cr4; /* guest kernel cr4 */
 			uint64_t guest_payload_cr3; /* guest payload pml4 pointer */
 			uint64_t cpu; /* physical cpu this kontext is running */
@@ -150,11 +159,30 @@ struct kkm_guest_area {
 			 */
 			uint64_t intr_no;
 
+			/*
+			 * return to payload using sysret instead of iret
+			 */
+			uint64_t guest_sysret;
+
+			/*
+			 * native kernel tss ist slots used by kkm idt
+			 */
+			uint64_t native_save_tss_ist_nmi;
+			uint64_t native_save_tss_ist_mce;
+
+			/*
+			 * nmi and machine check arrive with any ring 0 stack,
+			 * guest kernel stack with live frames or payload stack
+			 * in sysret window. they get stacks of their own.
+			 */
+			uint8_t nmi_stack[KKM_GUEST_IST_STACK_SIZE];
+			uint8_t mce_stack[KKM_GUEST_IST_STACK_SIZE];
+
 			/*
 			 * this padding makes sure
 			 * the entry stack is aligned correctly
 			 */
-			uint8_t reserved[2328];
+			uint8_t reserved[256];
 
 			/*
 			 * copy buffer
@@ -177,10 +205,22 @@ struct kkm_guest_area {
 };
 static_assert(sizeof(struct kkm_guest_area) == 8192, "Size is not correct");
 
+int kkm_kontext_cache_init(void);
+void kkm_kontext_cache_cleanup(void);
+struct kkm_kontext *kkm_kontext_alloc(void);
+void kkm_kontext_free(struct kkm_kontext *kkm_kontext);
 int kkm_kontext_init(struct kkm_kontext *kkm_kontext);
 void kkm_kontext_si_init(struct kkm_kontext *kkm_kontext);
+void kkm_kontext_release_resources(struct kkm_kontext *kkm_kontext);
 void kkm_kontext_cleanup(struct kkm_kontext *kkm_kontext);
 int kkm_kontext_reinit(struct kkm_kontext *kkm_kontext);
+bool kkm_kontext_acquire(struct kkm_kontext *kkm_kontext);
+void kkm_kontext_release(struct kkm_kontext *kkm_kontext);
+void kkm_kontext_wait_idle(struct kkm_kontext *kkm_kontext);
+unsigned long kkm_kontext_map_page(struct kkm_kontext *kkm_kontext,
+				   uint32_t index);
+int kkm_kontext_xfd_enable(struct kkm_kontext *kkm_kontext, uint64_t features);
+int kkm_kontext_clone(struct kkm_kontext *dst, struct kkm_kontext *src);
 void kkm_kontext_get_save_info(struct kkm_kontext *kkm_kontext,
 			       struct kkm_save_info *si);
 void kkm_kontext_set_save_info(struct kkm_kontext *kkm_kontext,
@@ -200,6 +240,9 @@ void kkm_setup_hypercall(struct kkm_kontext *kkm_kontext,
 int kkm_process_common_without_error(struct kkm_kontext *kkm_kontext,
 				     struct kkm_guest_area *ga,
 				     struct kkm_run *kkm_run);
+int kkm_process_device_not_available(struct kkm_kontext *kkm_kontext,
+				     struct kkm_guest_area *ga,
+				     struct kkm_run *kkm_run);
 int kkm_process_common_with_error(struct kkm_kontext *kkm_kontext,
 				  struct kkm_guest_area *ga,
 				  struct kkm_run *kkm_run);
@@ -218,5 +261,8 @@ int kkm_process_syscall(struct kkm_kontext *kkm_kontext,
 bool kkm_guest_va_to_monitor_va(struct kkm_kontext *kkm_kontext,
 				uint64_t guest_va, uint64_t *monitor_va,
 				bool *priv_area);
+bool kkm_guest_range_to_monitor_va(struct kkm_kontext *kkm_kontext,
+				   uint64_t guest_va, uint64_t size,
+				   uint64_t *monitor_va);
 
 #endif /* __KKM_KONTEXT_H__ */
@@ -30,11 +30,13 @@
 #include "kkm.h"
 #include "kkm_run.h"
 #include "kkm_kontainer.h"
+#include "kkm_debugfs.h"
 #include "kkm_kontext.h"
 #include "kkm_mm.h"
 #include "kkm_idt.h"
 #include "kkm_fpu.h"
 #include "kkm_misc.h"
+#include "kkm_cpuid.h"
 
 void kkm_destroy_app(struct kkm *kkm);
 void kkm_reference_count_init(struct kkm *kkm);
@@ -43,24 +45,44 @@ void kkm_reference_count_down(struct kkm *kkm);
 int kkm_add_execution_kontext(struct kkm *kkm, unsigned long arg);
 int kkm_set_kontainer_memory(struct kkm *kkm, unsigned long arg);
 int kkm_set_id_map_addr(struct kkm *kkm, unsigned long arg);
+int kkm_clone_kontainer(struct kkm *parent, unsigned long arg);
 int kkm_create_kontainer(unsigned long arg);
 int kkm_check_extension(unsigned long arg);
+static struct kkm *kkm_new_kontainer(int *error);
+static int kkm_install_kontainer_fd(struct kkm *kkm);
 
-uint32_t kkm_version = 12;
+uint32_t kkm_version = 13;
 bool kkm_cpu_supported = false;
 bool kkm_cpu_full_tlb_flush = false;
+bool kkm_cpu_fsgsbase = false;
 
 kkm_xstate_format_t kkm_xs_format = KKM_XSAVES;
 void (*kkm_fpu_save_xstate)(void *) = kkm_fpu_save_xstate_xsaves;
 void (*kkm_fpu_restore_xstate)(void *) = kkm_fpu_restore_xstate_xsaves;
 
+uint64_t kkm_xcr0_features = 0;
+uint64_t kkm_xsave_features = 0;
+uint64_t kkm_xfd_features = 0;
+uint32_t kkm_xsave_size = 0;
+uint32_t kkm_xsave_base_size = 0;
+
+/*
+ * allocate payload xsave area for XFD features(AMX) on first use
+ */
+static bool __read_mostly xfd_first_use_alloc = true;
+module_param(xfd_first_use_alloc, bool, S_IRUGO);
+
 atomic64_t kkm_object_id;
 
 struct kkm_statistics kkm_stat;
 
 static int kkm_statistics_get(char *s, const struct kernel_param *kp)
 {
-	return kkm_statistics_show(s);
+	int len = 0;
+
+	len = kkm_statistics_show(s);
+	len += kkm_tlb_statistics_show(s + len);
+	return len;
 }
 
 static struct kernel_param_ops kkm_statistics_ops = {
@@ -71,6 +93,7 @@ module_param_cb(statistics, &kkm_statistics_ops, &kkm_stat, S_IRUGO);
 static int kkm_clear_statistics(const char *s, const struct kernel_param *kp)
 {
 	kkm_statistics_init();
+	kkm_tlb_statistics_init();
 	return 0;
 }
 
@@ -111,18 +134,15 @@ module_param_cb(use_platform_pv, &kkm_platform_pv_ops, &platform_pv,
 
 struct kkm_platform_calls *kkm_platform = NULL;
 
+/*
+ * last reference is gone, usually from exit_files of monitor
+ * debugfs entries are removed here, waiting for readers,
+ * memory is freed later from workqueue
+ */
 void kkm_destroy_app(struct kkm *kkm)
 {
-	int i = 0;
-
-	for (i = 0; i < KKM_MAX_CONTEXTS; i++) {
-		if (kkm->kontext[i] != NULL) {
-			kfree(kkm->kontext[i]);
-			kkm->kontext[i] = NULL;
-		}
-	}
-	kkm_kontainer_cleanup(kkm);
-	kfree(kkm);
+	kkm_debugfs_kontainer_remove(kkm);
+	kkm_kontainer_destroy(kkm);
 }
 
 void kkm_reference_count_init(struct kkm *kkm)
@@ -147,18 +167,17 @@ static int kkm_execution_kontext_release(struct inode *inode_p,
 {
 	struct kkm_kontext *kkm_kontext = file_p->private_data;
 	struct kkm *kkm = kkm_kontext->kkm;
-	int i = 0;
-	struct kkm_kontext_mmap_area *kkma = NULL;
 
-	kkm_kontext_cleanup(kkm_kontext);
+	kkm_kontext_wait_idle(kkm_kontext);
 
-	for (i = 0; i < KKM_CONTEXT_MAP_PAGE_COUNT; i++) {
-		kkma = &kkm_kontext->mmap_area[i];
-		if (kkma->kvaddr != 0) {
-			free_page(kkma->kvaddr);
-			kkma->kvaddr = 0;
-		}
-	}
+	/*
+	 * kontext memory stays with the slot for next kontext,
+	 * it is freed with kontainer from workqueue.
+	 * debugfs entry is removed before slot can be reused,
+	 * removal waits for readers of the entry.
+	 */
+	kkm_debugfs_kontext_remove(kkm_kontext);
+	kkm_kontext_release_resources(kkm_kontext);
 
 	kkm_kontext->used = false;
 	kkm_kontext->first_thread = false;
@@ -212,6 +231,13 @@ static long kkm_run(struct kkm_kontext *kkm_kontext)
 {
 	int ret_val = 0;
 
+	/*
+	 * any thread of kontainer mm, guest memory is mapped from it
+	 */
+	if (current->mm != kkm_kontext->kkm->mm) {
+		return -EPERM;
+	}
+
 	kkm_set_regs(kkm_kontext);
 	ret_val = kkm_kontext_switch_kernel(kkm_kontext);
 	kkm_get_regs(kkm_kontext);
@@ -253,6 +279,253 @@ static long kkm_set_msrs(void *arg)
 	return ret_val;
 }
 
+/*
+ * fixed size xstate, payload xsave area has to fit in 4084 bytes
+ */
+static long kkm_get_xstate(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	long ret_val = 0;
+	struct kkm_xstate *xs = NULL;
+
+	if (kkm_kontext->payload_xsave_size > KKM_XSTATE_DATA_SIZE) {
+		ret_val = -E2BIG;
+		goto error;
+	}
+
+	xs = kzalloc(sizeof(struct kkm_xstate), GFP_KERNEL);
+	if (xs == NULL) {
+		ret_val = -ENOMEM;
+		goto error;
+	}
+	memcpy(xs->data, kkm_kontext->kkm_payload_xsave,
+	       kkm_kontext->payload_xsave_size);
+	xs->valid = kkm_kontext->valid_payload_xsave_area;
+	xs->format = kkm_xs_format;
+	xs->crc32 = crc32(0, xs, KKM_XSTATE_DATA_SIZE);
+	ret_val = kkm_to_user(arg, xs, sizeof(struct kkm_xstate));
+
+error:
+	kfree(xs);
+	return ret_val;
+}
+
+static long kkm_set_xstate(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	long ret_val = 0;
+	struct kkm_xstate *xs = NULL;
+	uint32_t crc32 = 0;
+
+	if (kkm_kontext->payload_xsave_size > KKM_XSTATE_DATA_SIZE) {
+		ret_val = -E2BIG;
+		goto error;
+	}
+
+	xs = kmalloc(sizeof(struct kkm_xstate), GFP_KERNEL);
+	if (xs == NULL) {
+		ret_val = -ENOMEM;
+		goto error;
+	}
+	ret_val = kkm_from_user(xs, arg, sizeof(struct kkm_xstate));
+	if (ret_val != 0) {
+		goto error;
+	}
+
+	kkm_kontext->valid_payload_xsave_area = false;
+	if (xs->format != kkm_xs_format) {
+		printk(KERN_NOTICE
+		       "kkm_set_xstate: XSTATE saved format mismatch expecting %x found %x",
+		       kkm_xs_format, xs->format);
+		ret_val = -EINVAL;
+		goto error;
+	}
+	crc32 = crc32(0, xs, KKM_XSTATE_DATA_SIZE);
+	if (xs->crc32 != crc32) {
+		printk(KERN_NOTICE
+		       "kkm_set_xstate: crc mismatch expecting %x found %x",
+		       xs->crc32, crc32);
+		ret_val = -EINVAL;
+		goto error;
+	}
+	memcpy(kkm_kontext->kkm_payload_xsave, xs->data,
+	       kkm_kontext->payload_xsave_size);
+	kkm_kontext->valid_payload_xsave_area = xs->valid;
+
+error:
+	kfree(xs);
+	return ret_val;
+}
+
+/*
+ * variable size xstate, data is copied directly to/from payload xsave area
+ */
+static long kkm_get_xstate2(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	long ret_val = 0;
+	struct kkm_xstate2 xs;
+
+	ret_val = kkm_from_user(&xs, arg, sizeof(struct kkm_xstate2));
+	if (ret_val != 0) {
+		goto error;
+	}
+
+	if (xs.size < kkm_kontext->payload_xsave_size) {
+		xs.size = kkm_kontext->payload_xsave_size;
+		ret_val = kkm_to_user(arg, &xs, sizeof(struct kkm_xstate2));
+		if (ret_val == 0) {
+			ret_val = -E2BIG;
+		}
+		goto error;
+	}
+
+	xs.size = kkm_kontext->payload_xsave_size;
+	xs.padding = 0;
+	xs.valid = kkm_kontext->valid_payload_xsave_area;
+	xs.format = kkm_xs_format;
+	xs.crc32 = crc32(0, kkm_kontext->kkm_payload_xsave, xs.size);
+	xs.xfd_features = kkm_kontext->xfd_enabled;
+
+	ret_val = kkm_to_user((void *)xs.data, kkm_kontext->kkm_payload_xsave,
+			      xs.size);
+	if (ret_val != 0) {
+		goto error;
+	}
+	ret_val = kkm_to_user(arg, &xs, sizeof(struct kkm_xstate2));
+
+error:
+	return ret_val;
+}
+
+static long kkm_set_xstate2(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	long ret_val = 0;
+	struct kkm_xstate2 xs;
+	uint32_t crc32 = 0;
+
+	ret_val = kkm_from_user(&xs, arg, sizeof(struct kkm_xstate2));
+	if (ret_val != 0) {
+		goto error;
+	}
+
+	if (xs.format != kkm_xs_format) {
+		printk(KERN_NOTICE
+		       "kkm_set_xstate2: XSTATE saved format mismatch expecting %x found %x",
+		       kkm_xs_format, xs.format);
+		ret_val = -EINVAL;
+		goto error;
+	}
+
+	/*
+	 * saved state of XFD features needs the larger payload area
+	 */
+	if (xs.xfd_features != 0) {
+		ret_val = kkm_kontext_xfd_enable(kkm_kontext, xs.xfd_features);
+		if (ret_val != 0) {
+			goto error;
+		}
+	}
+	if (xs.size > kkm_kontext->payload_xsave_size) {
+		ret_val = -EINVAL;
+		goto error;
+	}
+
+	kkm_kontext->valid_payload_xsave_area = false;
+	ret_val = kkm_from_user(kkm_kontext->kkm_payload_xsave,
+				(void *)xs.data, xs.size);
+	if (ret_val != 0) {
+		goto error;
+	}
+	crc32 = crc32(0, kkm_kontext->kkm_payload_xsave, xs.size);
+	if (xs.crc32 != crc32) {
+		printk(KERN_NOTICE
+		       "kkm_set_xstate2: crc mismatch expecting %x found %x",
+		       xs.crc32, crc32);
+		ret_val = -EINVAL;
+		goto error;
+	}
+	kkm_kontext->valid_payload_xsave_area = xs.valid;
+
+error:
+	return ret_val;
+}
+
+static int kkm_set_switchless(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	struct kkm_switchless sl;
+
+	if (copy_from_user(&sl, arg, sizeof(struct kkm_switchless))) {
+		return -EFAULT;
+	}
+	return kkm_switchless_set(kkm_kontext, &sl);
+}
+
+static int kkm_set_perf(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	struct kkm_perf perf;
+
+	if (copy_from_user(&perf, arg, sizeof(struct kkm_perf))) {
+		return -EFAULT;
+	}
+	return kkm_perf_set(kkm_kontext, &perf);
+}
+
+static int kkm_set_rseq(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	struct kkm_rseq rseq;
+
+	if (copy_from_user(&rseq, arg, sizeof(struct kkm_rseq))) {
+		return -EFAULT;
+	}
+	return kkm_rseq_set(kkm_kontext, &rseq);
+}
+
+static int kkm_set_fault_handler(struct kkm_kontext *kkm_kontext, void *arg)
+{
+	struct kkm_fault_handler fh;
+
+	if (copy_from_user(&fh, arg, sizeof(struct kkm_fault_handler))) {
+		return -EFAULT;
+	}
+	return kkm_fault_set(kkm_kontext, &fh);
+}
+
+static long kkm_get_xcrs(unsigned long arg)
+{
+	struct kkm_xcrs xcrs;
+
+	kkm_cpuid_get_xcrs(&xcrs);
+	return kkm_to_user((void *)arg, &xcrs, sizeof(struct kkm_xcrs));
+}
+
+static long kkm_set_xcrs(unsigned long arg)
+{
+	struct kkm_xcrs xcrs;
+	long ret_val = 0;
+
+	ret_val = kkm_from_user(&xcrs, (void *)arg, sizeof(struct kkm_xcrs));
+	if (ret_val != 0) {
+		return ret_val;
+	}
+	return kkm_cpuid_set_xcrs(&xcrs);
+}
+
+/*
+ * ioctls that only read guest area can run while kontext is owned,
+ * result is a snapshot. xstate reads need ownership, payload xsave
+ * area can be reallocated by its owner.
+ */
+static bool kkm_kontext_ioctl_exclusive(unsigned int ioctl_type)
+{
+	switch (ioctl_type) {
+	case KKM_GET_REGS:
+	case KKM_GET_SREGS:
+	case KKM_GET_XCRS:
+	case KKM_KONTEXT_GET_SAVE_INFO:
+	case KKM_GET_EVENTS:
+		return false;
+	}
+	return true;
+}
+
 /*
  * ioctls on execution context anon fd
  * all the copies go directly to/from guest private area
@@ -267,8 +540,14 @@ static long kkm_execution_kontext_ioctl(struct file *file_p,
 	struct kkm_guest_area *ga =
 		(struct kkm_guest_area *)kkm_kontext->guest_area;
 	struct kkm_save_info si;
-	struct kkm_xstate *xs = NULL;
-	uint32_t crc32 = 0;
+	bool exclusive = kkm_kontext_ioctl_exclusive(ioctl_type);
+
+	/*
+	 * run and state changes one task at a time, others get EBUSY
+	 */
+	if (exclusive == true && kkm_kontext_acquire(kkm_kontext) == false) {
+		return -EBUSY;
+	}
 
 	if (ioctl_type == KKM_RUN) {
 		/* switch to guest payload */
@@ -318,7 +597,11 @@ static long kkm_execution_kontext_ioctl(struct file *file_p,
 				&ga->fpu, kkm_kontext->kkm_payload_xsave);
 			break;
 		case KKM_SET_CPUID:
-			/* return success */
+			/*
+			 * payload executes cpuid natively,
+			 * KKM_GET_SUPPORTED_CPUID is what it sees.
+			 * nothing to apply, return success
+			 */
 			break;
 		case KKM_SET_DEBUG:
 			/* set guest debug state */
@@ -328,10 +611,10 @@ static long kkm_execution_kontext_ioctl(struct file *file_p,
 			kkm_kontext->debug_registers_set = true;
 			break;
 		case KKM_GET_XCRS:
+			ret_val = kkm_get_xcrs(arg);
+			break;
 		case KKM_SET_XCRS:
-			/* for compatibility only
-			 * currently no implementation, return success
-			 */
+			ret_val = kkm_set_xcrs(arg);
 			break;
 		case KKM_KONTEXT_REUSE:
 			ret_val = kkm_kontext_reinit(kkm_kontext);
@@ -349,48 +632,29 @@ static long kkm_execution_kontext_ioctl(struct file *file_p,
 			}
 			break;
 		case KKM_KONTEXT_GET_XSTATE:
-			xs = (struct kkm_xstate *)kkm_kontext->kkm_payload_xsave;
-			xs->valid = kkm_kontext->valid_payload_xsave_area;
-			xs->format = kkm_xs_format;
-			xs->crc32 = crc32(0, xs, KKM_XSTATE_DATA_SIZE);
-			ret_val = kkm_to_user((void *)arg,
-					      kkm_kontext->kkm_payload_xsave,
-					      sizeof(struct kkm_xstate));
-			xs->padding = 0;
-			xs->format = KKM_NONE;
-			xs->crc32 = 0;
+			ret_val = kkm_get_xstate(kkm_kontext, (void *)arg);
 			break;
 		case KKM_KONTEXT_SET_XSTATE:
-			xs = (struct kkm_xstate *)kkm_kontext->kkm_payload_xsave;
-			ret_val = kkm_from_user(kkm_kontext->kkm_payload_xsave,
-						(void *)arg,
-						sizeof(struct kkm_xstate));
-			if (ret_val == 0) {
-				kkm_kontext->valid_payload_xsave_area =
-					xs->valid;
-				if (xs->format != kkm_xs_format) {
-					printk(KERN_NOTICE
-					       "kkm_execution_kontext_ioctl: XSTATE saved format mismatch expecting %x found %x",
-					       xs->format, kkm_xs_format);
-					ret_val = -EINVAL;
-					kkm_kontext->valid_payload_xsave_area =
-						false;
-					break;
-				}
-				crc32 = crc32(0, xs, KKM_XSTATE_DATA_SIZE);
-				if (xs->crc32 != crc32) {
-					printk(KERN_NOTICE
-					       "kkm_execution_kontext_ioctl: crc mismatch expecting %x found %x",
-					       xs->crc32, crc32);
-					ret_val = -EINVAL;
-					kkm_kontext->valid_payload_xsave_area =
-						false;
-					break;
-				}
-				xs->padding = 0;
-				xs->format = KKM_NONE;
-				xs->crc32 = 0;
-			}
+			ret_val = kkm_set_xstate(kkm_kontext, (void *)arg);
+			break;
+		case KKM_KONTEXT_GET_XSTATE2:
+			ret_val = kkm_get_xstate2(kkm_kontext, (void *)arg);
+			break;
+		case KKM_KONTEXT_SET_XSTATE2:
+			ret_val = kkm_set_xstate2(kkm_kontext, (void *)arg);
+			break;
+		case KKM_KONTEXT_SET_SWITCHLESS:
+			ret_val = kkm_set_switchless(kkm_kontext, (void *)arg);
+			break;
+		case KKM_KONTEXT_SET_PERF:
+			ret_val = kkm_set_perf(kkm_kontext, (void *)arg);
+			break;
+		case KKM_KONTEXT_SET_RSEQ:
+			ret_val = kkm_set_rseq(kkm_kontext, (void *)arg);
+			break;
+		case KKM_KONTEXT_SET_FAULT_HANDLER:
+			ret_val = kkm_set_fault_handler(kkm_kontext,
+							(void *)arg);
 			break;
 		case KKM_GET_EVENTS:
 			/* return success */
@@ -403,6 +667,10 @@ static long kkm_execution_kontext_ioctl(struct file *file_p,
 			break;
 		}
 	}
+
+	if (exclusive == true) {
+		kkm_kontext_release(kkm_kontext);
+	}
 	return ret_val;
 }
 
@@ -410,6 +678,7 @@ static vm_fault_t kkm_execution_kontext_fault(struct vm_fault *vmf)
 {
 	struct kkm_kontext *kkm_kontext =
 		(struct kkm_kontext *)vmf->vma->vm_file->private_data;
+	unsigned long kvaddr = 0;
 
 	if (vmf->pgoff >= KKM_CONTEXT_MAP_PAGE_COUNT) {
 		printk(KERN_NOTICE
@@ -419,7 +688,12 @@ static vm_fault_t kkm_execution_kontext_fault(struct vm_fault *vmf)
 		return VM_FAULT_SIGBUS;
 	}
 
-	vmf->page = virt_to_page(kkm_kontext->mmap_area[vmf->pgoff].kvaddr);
+	kvaddr = kkm_kontext_map_page(kkm_kontext, vmf->pgoff);
+	if (kvaddr == 0) {
+		return VM_FAULT_OOM;
+	}
+
+	vmf->page = virt_to_page(kvaddr);
 	get_page(vmf->page);
 	return 0;
 }
@@ -444,15 +718,20 @@ struct file_operations kkm_execution_kontext_fops = {
 
 /*
  * create execution context one per vcpu
+ * returns reserved fd, caller installs kontext file on it
  */
-int kkm_add_execution_kontext(struct kkm *kkm, unsigned long arg)
+static int kkm_new_execution_kontext(struct kkm *kkm, uint32_t vcpu_id,
+				     struct file **file)
 {
 	int ret_val = 0;
 	int i = 0;
+	int slot = 0;
+	int fd = -1;
 	struct kkm_kontext *kkm_kontext = NULL;
 	char buffer[32];
 	struct kkm_kontext_mmap_area *kkma = NULL;
-	uint32_t vcpu_id = arg;
+
+	*file = NULL;
 
 	mutex_lock(&kkm->kontext_lock);
 	if (kkm->mm != current->mm) {
@@ -470,8 +749,7 @@ int kkm_add_execution_kontext(struct kkm *kkm, unsigned long arg)
 
 	for (i = 0; i < KKM_MAX_CONTEXTS; i++) {
 		if (kkm->kontext[i] == NULL) {
-			kkm->kontext[i] =
-				kzalloc(sizeof(struct kkm_kontext), GFP_KERNEL);
+			kkm->kontext[i] = kkm_kontext_alloc();
 			if (kkm->kontext[i] == NULL) {
 				printk(KERN_NOTICE
 				       "kkm_add_execution_kontext: could not "
@@ -486,30 +764,33 @@ int kkm_add_execution_kontext(struct kkm *kkm, unsigned long arg)
 		}
 	}
 
-	kkm_kontext = kkm->kontext[i];
+	slot = i;
+	kkm_kontext = kkm->kontext[slot];
 
 	kkm_kontext->id = atomic64_inc_return(&kkm_object_id);
 	kkm_kontext->index = vcpu_id;
 
 	kkm_kontext->used = true;
 	kkm_kontext->first_thread = (kkm->kontext_count == 0) ? true : false;
-	kkm_kontext->task = current;
+	kkm_kontext->task = NULL;
 	kkm_kontext->kkm = kkm;
+	kkm_kontext->kontext_fd = -1;
 
 	/*
-	 * create anon fd for execution context
+	 * map pages of a released kontext are kept with the slot,
+	 * clear them for new thread
 	 */
-	snprintf(buffer, sizeof(buffer), "kkm-kontext:%d", i);
-	kkm_kontext->kontext_fd =
-		anon_inode_getfd(buffer, &kkm_execution_kontext_fops,
-				 kkm_kontext, O_CLOEXEC | O_RDWR);
-	if (kkm_kontext->kontext_fd >= 0) {
-		ret_val = kkm_kontext->kontext_fd;
-	}
-
 	for (i = 0; i < KKM_CONTEXT_MAP_PAGE_COUNT; i++) {
 		kkma = &kkm_kontext->mmap_area[i];
 		kkma->offset = i;
+		if (kkma->kvaddr != 0) {
+			clear_page((void *)kkma->kvaddr);
+			continue;
+		}
+		kkma->page = NULL;
+		if (i >= KKM_CONTEXT_MAP_EAGER_PAGE_COUNT) {
+			continue;
+		}
 		kkma->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (kkma->page == NULL) {
 			printk(KERN_NOTICE
@@ -522,21 +803,60 @@ int kkm_add_execution_kontext(struct kkm *kkm, unsigned long arg)
 	}
 
 	if (kkm_kontext_init(kkm_kontext) != 0) {
+		ret_val = -ENOMEM;
+		goto error;
+	}
+
+	/*
+	 * create anon file for execution context
+	 * closing it undoes everything below
+	 */
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret_val = fd;
+		goto error;
+	}
+	snprintf(buffer, sizeof(buffer), "kkm-kontext:%d", slot);
+	*file = anon_inode_getfile(buffer, &kkm_execution_kontext_fops,
+				   kkm_kontext, O_RDWR);
+	if (IS_ERR(*file)) {
+		put_unused_fd(fd);
+		ret_val = PTR_ERR(*file);
+		*file = NULL;
 		goto error;
 	}
+	kkm_kontext->kontext_fd = fd;
+	ret_val = fd;
 
 	kkm_reference_count_up(kkm);
 
 	kkm->kontext_count++;
 
+	kkm_debugfs_kontext_add(kkm_kontext);
+
 	/* statistics */
 	kkm_statistics_kontext_count_inc();
 
 error:
+	if (ret_val < 0 && kkm_kontext != NULL) {
+		kkm_kontext->used = false;
+	}
 	mutex_unlock(&kkm->kontext_lock);
 	return ret_val;
 }
 
+int kkm_add_execution_kontext(struct kkm *kkm, unsigned long arg)
+{
+	struct file *file = NULL;
+	int fd = -1;
+
+	fd = kkm_new_execution_kontext(kkm, arg, &file);
+	if (fd >= 0) {
+		fd_install(fd, file);
+	}
+	return fd;
+}
+
 /*
  * add physical memory
  */
@@ -607,8 +927,10 @@ int kkm_set_kontainer_memory(struct kkm *kkm, unsigned long arg)
 		kkm->mem_slot_count++;
 	}
 
-	kkm_mmu_sync((uint64_t)kkm->mm->pgd, kkm->gk_pgd.va, kkm->gp_pgd.va,
+	kkm_mmu_sync((uint64_t)kkm->mm->pgd, kkm->gp_pgd.va,
 		     &kkm->kkm_guest_pml4e, kkm->low_p4d.va, kkm->low_p4d.pa);
+	/* guest pml4 entries may have changed, invalidate guest TLB */
+	atomic64_inc(&kkm->tlb_gen);
 error:
 	mutex_unlock(&kkm->mem_lock);
 	if (ret_val != 0) {
@@ -619,6 +941,117 @@ error:
 	return ret_val;
 }
 
+/*
+ * KKM_CLONE_KONTAINER
+ * called by forked child on parent kontainer fd.
+ * new kontainer for child mm with parent memory layout
+ * and one kontext with state of parent kontext
+ */
+int kkm_clone_kontainer(struct kkm *parent, unsigned long arg)
+{
+	int ret_val = 0;
+	int i = 0;
+	struct kkm_clone_kontainer ck;
+	struct kkm *kkm = NULL;
+	struct kkm_kontext *src = NULL;
+	struct kkm_kontext *dst = NULL;
+	struct file *kontext_file = NULL;
+
+	if (copy_from_user(&ck, (void *)arg,
+			   sizeof(struct kkm_clone_kontainer))) {
+		return -EFAULT;
+	}
+
+	/*
+	 * parent mm cannot clone into itself
+	 */
+	if (parent->mm == current->mm) {
+		return -EINVAL;
+	}
+
+	kkm = kkm_new_kontainer(&ret_val);
+	if (kkm == NULL) {
+		goto error;
+	}
+
+	ret_val = kkm_kontainer_clone_memory(kkm, parent);
+	if (ret_val != 0) {
+		goto error_kontainer;
+	}
+
+	kkm_direct_io_clone(kkm, parent);
+	kkm->bpf_ops = parent->bpf_ops;
+
+	/*
+	 * kontext fd is reserved here and installed once
+	 * nothing else can fail
+	 */
+	ret_val = kkm_new_execution_kontext(kkm, ck.kontext_index,
+					    &kontext_file);
+	if (ret_val < 0) {
+		goto error_kontainer;
+	}
+	ck.kontext_fd = ret_val;
+	dst = kontext_file->private_data;
+
+	/*
+	 * src is copied while it is owned here,
+	 * parent worker running it fails clone with EBUSY
+	 */
+	mutex_lock(&parent->kontext_lock);
+	for (i = 0; i < KKM_MAX_CONTEXTS; i++) {
+		if (parent->kontext[i] != NULL &&
+		    parent->kontext[i]->used == true &&
+		    parent->kontext[i]->index == ck.kontext_index) {
+			src = parent->kontext[i];
+			break;
+		}
+	}
+	if (src == NULL) {
+		ret_val = -EINVAL;
+	} else if (kkm_kontext_acquire(src) == false) {
+		ret_val = -EBUSY;
+	} else {
+		ret_val = kkm_kontext_clone(dst, src);
+		kkm_kontext_release(src);
+	}
+	mutex_unlock(&parent->kontext_lock);
+
+	if (ret_val < 0) {
+		goto error_kontext;
+	}
+
+	if (copy_to_user((void *)arg, &ck,
+			 sizeof(struct kkm_clone_kontainer))) {
+		ret_val = -EFAULT;
+		goto error_kontext;
+	}
+
+	ret_val = kkm_install_kontainer_fd(kkm);
+	if (ret_val < 0) {
+		goto error_kontext;
+	}
+	fd_install(ck.kontext_fd, kontext_file);
+
+	/* statistics */
+	kkm_statistics_kontainer_clone_count_inc();
+
+	return ret_val;
+
+error_kontext:
+	/*
+	 * kontext file holds its own kontainer reference,
+	 * dropped when file is released
+	 */
+	put_unused_fd(ck.kontext_fd);
+	fput(kontext_file);
+error_kontainer:
+	kkm_reference_count_down(kkm);
+error:
+	printk(KERN_NOTICE "kkm_clone_kontainer: failed error(%d)\n", ret_val);
+	return ret_val;
+}
+
 int kkm_set_id_map_addr(struct kkm *kkm, unsigned long arg)
 {
 	uint64_t addr;
@@ -635,6 +1068,53 @@ error:
 	return ret_val;
 }
 
+static int kkm_set_direct_io(struct kkm *kkm, unsigned long arg)
+{
+	struct kkm_direct_io dio;
+
+	if (copy_from_user(&dio, (void *)arg, sizeof(struct kkm_direct_io))) {
+		return -EFAULT;
+	}
+	return kkm_direct_io_set(kkm, &dio);
+}
+
+/*
+ * KKM_RUN_KONTEXT
+ * run idle kontext by index from any thread of kontainer mm,
+ * lets monitor schedule many kontexts on few threads
+ */
+static long kkm_run_kontext(struct kkm *kkm, unsigned long arg)
+{
+	long ret_val = -EINVAL;
+	int i = 0;
+	struct kkm_kontext *kkm_kontext = NULL;
+
+	mutex_lock(&kkm->kontext_lock);
+	for (i = 0; i < KKM_MAX_CONTEXTS; i++) {
+		if (kkm->kontext[i] != NULL && kkm->kontext[i]->used == true &&
+		    kkm->kontext[i]->index == arg) {
+			kkm_kontext = kkm->kontext[i];
+			break;
+		}
+	}
+	if (kkm_kontext != NULL) {
+		ret_val = 0;
+		if (kkm_kontext_acquire(kkm_kontext) == false) {
+			ret_val = -EBUSY;
+		}
+	}
+	mutex_unlock(&kkm->kontext_lock);
+
+	if (ret_val != 0) {
+		return ret_val;
+	}
+
+	ret_val = kkm_run(kkm_kontext);
+	kkm_kontext_release(kkm_kontext);
+
+	return ret_val;
+}
+
 static int kkm_kontainer_release(struct inode *inode_p, struct file *file_p)
 {
 	struct kkm *kkm = file_p->private_data;
@@ -666,6 +1146,26 @@ static long kkm_kontainer_ioctl(struct file *file_p, unsigned int ioctl_type,
 		/* set id map area */
 		ret_val = kkm_set_id_map_addr(kkm, arg);
 		break;
+	case KKM_CLONE_KONTAINER:
+		/* new kontainer for forked child */
+		ret_val = kkm_clone_kontainer(kkm, arg);
+		break;
+	case KKM_SET_DIRECT_IO:
+		/* register guest fd for in kernel I/O */
+		ret_val = kkm_set_direct_io(kkm, arg);
+		break;
+	case KKM_SET_BPF_OPS:
+		/* use registered bpf handlers */
+		if (KKM_BPF_OPS_SUPPORTED == 0 && arg != 0) {
+			ret_val = -EOPNOTSUPP;
+			break;
+		}
+		kkm->bpf_ops = (arg != 0);
+		break;
+	case KKM_RUN_KONTEXT:
+		/* run kontext by index on calling thread */
+		ret_val = kkm_run_kontext(kkm, arg);
+		break;
 	default:
 		printk(KERN_NOTICE
 		       "kkm_kontainer_ioctl: unsupported ioctl_type(%x)\n",
@@ -683,59 +1183,88 @@ static struct file_operations kkm_kontainer_ops = {
 };
 
 /*
- * one call per guest
+ * allocate kontainer for current mm
+ * page tables are allocated and initialized,
+ * prebuilt kontainer from pool if one is available
  */
-int kkm_create_kontainer(unsigned long arg)
+static struct kkm *kkm_new_kontainer(int *error)
 {
 	int ret_val = 0;
 	struct kkm *kkm = NULL;
 
-	// create
-	kkm = kzalloc(sizeof(struct kkm), GFP_KERNEL);
+	kkm = kkm_kontainer_alloc();
 	if (kkm == NULL) {
 		ret_val = -ENOMEM;
 		goto error;
 	}
 
-	/*
-	 * create anon fd and return it back to user
-	 * all further ioctls for this guest are on this fd
-	 * and kontext anon fd's
-	 */
-	kkm->kontainer_fd = anon_inode_getfd(
-		"kkm-kontainer", &kkm_kontainer_ops, kkm, O_CLOEXEC | O_RDWR);
-	if (kkm->kontainer_fd < 0) {
-		ret_val = kkm->kontainer_fd;
-		goto error;
-	}
-
 	kkm->id = atomic64_inc_return(&kkm_object_id);
 	kkm->mm = current->mm;
 
-	ret_val = kkm_kontainer_init(kkm);
-	if (ret_val != 0) {
-		goto error;
-	}
-
 	/*
-	 * setup pml4 for guest kernel and guest payload
+	 * setup pml4 for guest payload, guest kernel code runs on it too
+	 * kernel half is always copied from current mm,
+	 * pool entries never carry stale kernel mappings
 	 */
 	ret_val = kkm_mmu_copy_kernel_pgd((uint64_t)kkm->mm->pgd,
-					  kkm->gk_pgd.va, kkm->gp_pgd.va,
-					  kkm->gk_p4d.va, kkm->gp_p4d.va);
+					  kkm->gp_pgd.va, kkm->gp_p4d.va);
 	if (ret_val != 0) {
 		printk(KERN_NOTICE
-		       "kkm_create_kontainer: Copy kernel pgd entry failed error(%d)\n",
+		       "kkm_new_kontainer: Copy kernel pgd entry failed error(%d)\n",
 		       ret_val);
 		goto error;
 	}
 
 	kkm_reference_count_init(kkm);
 
+	kkm_debugfs_kontainer_add(kkm);
+
+error:
+	if (ret_val != 0 && kkm != NULL) {
+		kkm_kontainer_cleanup(kkm);
+		kfree(kkm);
+		kkm = NULL;
+	}
+	*error = ret_val;
+	return kkm;
+}
+
+/*
+ * create anon fd and return it back to user
+ * all further ioctls for this guest are on this fd
+ * and kontext anon fd's
+ */
+static int kkm_install_kontainer_fd(struct kkm *kkm)
+{
+	kkm->kontainer_fd = anon_inode_getfd(
+		"kkm-kontainer", &kkm_kontainer_ops, kkm, O_CLOEXEC | O_RDWR);
+	if (kkm->kontainer_fd < 0) {
+		return kkm->kontainer_fd;
+	}
+
 	/* statistics */
 	kkm_statistics_kontainer_count_inc();
 
 	return kkm->kontainer_fd;
+}
+
+/*
+ * one call per guest
+ */
+int kkm_create_kontainer(unsigned long arg)
+{
+	int ret_val = 0;
+	struct kkm *kkm = NULL;
+
+	kkm = kkm_new_kontainer(&ret_val);
+	if (kkm == NULL) {
+		goto error;
+	}
+
+	ret_val = kkm_install_kontainer_fd(kkm);
+	if (ret_val < 0) {
+		kkm_reference_count_down(kkm);
+	}
 
 error:
 	return ret_val;
@@ -746,6 +1275,31 @@ int kkm_check_extension(unsigned long arg)
 	switch (arg) {
 	case KKM_CAP_SYNC_REGS:
 		return (KKM_SYNC_X86_SREGS | KKM_SYNC_X86_REGS);
+	case KKM_CAP_CLONE_KONTAINER:
+		return (1);
+	case KKM_CAP_LAZY_MEMORY:
+		return (1);
+	case KKM_CAP_XSTATE2:
+		return (kkm_xsave_size);
+	case KKM_CAP_GUEST_PML4_ENTRIES:
+		return (kkm_guest_pml4_count);
+	case KKM_CAP_DIRECT_IO:
+		return (KKM_DIRECT_IO_MAX_FDS);
+	case KKM_CAP_SWITCHLESS:
+		return (1);
+	case KKM_CAP_RUN_ANY_THREAD:
+		return (1);
+	case KKM_CAP_PERF:
+		return (KKM_PERF_MAX_COUNTERS);
+	case KKM_CAP_BPF_OPS:
+		return (KKM_BPF_OPS_SUPPORTED);
+	case KKM_CAP_SUPPORTED_CPUID:
+		return (KKM_CPUID_MAX_ENTRIES);
+	case KKM_CAP_FSGSBASE:
+		return (kkm_cpu_fsgsbase);
+	case KKM_CAP_RSEQ:
+	case KKM_CAP_FAULT_HANDLER:
+		return (1);
 	}
 	return (0);
 }
@@ -754,6 +1308,7 @@ int kkm_check_extension(unsigned long arg)
  * support cpuid functions needed by km
  * cpuid functions used by monitor are in cpuid_functions array.
  * execute on native cpu and return results to monitor
+ * KKM_GET_SUPPORTED_CPUID returns all leaves
  */
 static int kkm_get_native_cpuid(unsigned long arg)
 {
@@ -841,6 +1396,9 @@ static long kkm_device_ioctl(struct file *file_p, unsigned int ioctl_type,
 	case KKM_GET_SUPPORTED_CONTEXT_INFO:
 		ret_val = kkm_get_native_cpuid(arg);
 		break;
+	case KKM_GET_SUPPORTED_CPUID:
+		ret_val = kkm_cpuid_get_supported(arg);
+		break;
 	case KKM_CPU_SUPPORTED:
 		ret_val = (kkm_cpu_supported == true) ? CPU_SUPPORTED :
 							CPU_NOT_SUPPORTED;
@@ -870,14 +1428,46 @@ static struct miscdevice kkm_device = { .minor = MISC_DYNAMIC_MINOR,
 					.fops = &kkm_chardev_ops,
 					.mode = 0666 };
 
+/*
+ * size xsave areas from features enabled in XCR0 and IA32_XSS
+ */
+static void kkm_xsave_init(void)
+{
+	uint64_t xss = 0;
+	bool compacted = (kkm_xs_format == KKM_XSAVES);
+
+	kkm_xcr0_features = kkm_xgetbv(KKM_XCR0);
+	kkm_xsave_features = kkm_xcr0_features;
+	if (compacted == true) {
+		rdmsrl(MSR_IA32_XSS, xss);
+		kkm_xsave_features |= xss;
+	}
+
+	kkm_xfd_features = 0;
+	if (xfd_first_use_alloc == true) {
+		kkm_xfd_features = kkm_xsave_xfd_features(kkm_xsave_features);
+	}
+
+	kkm_xsave_size = kkm_xsave_area_size(kkm_xsave_features, compacted);
+	kkm_xsave_base_size = kkm_xsave_area_size(
+		kkm_xsave_features & ~kkm_xfd_features, compacted);
+
+	printk(KERN_INFO
+	       "kkm_init: xsave features %llx xfd features %llx size %u base size %u\n",
+	       kkm_xsave_features, kkm_xfd_features, kkm_xsave_size,
+	       kkm_xsave_base_size);
+}
+
 static void kkm_check_cpu_support(void)
 {
 	kkm_cpu_supported = false;
 
-	if ((!IS_ENABLED(CONFIG_PAGE_TABLE_ISOLATION)) &&
-	    (!IS_ENABLED(CONFIG_MITIGATION_PAGE_TABLE_ISOLATION))) {
-		printk(KERN_ERR "kkm_init: X86_FEATURE_PTI not supported.\n");
-		return;
+	/*
+	 * guest page tables are built from mm->pgd alone,
+	 * PTI kernel/user pgd pair is not needed
+	 */
+	if (!cpu_feature_enabled(X86_FEATURE_PTI)) {
+		printk(KERN_INFO "kkm_init: X86_FEATURE_PTI not enabled.\n");
 	}
 
 	if (!cpu_feature_enabled(X86_FEATURE_PCID)) {
@@ -892,6 +1482,16 @@ static void kkm_check_cpu_support(void)
 		       "kkm_init: X86_FEATURE_INVPCID not supported, using full tlb flush.\n");
 	}
 
+	/*
+	 * kernel sets CR4.FSGSBASE along with the feature,
+	 * payload runs with host cr4 and can set its own fs/gs base
+	 */
+	kkm_cpu_fsgsbase = false;
+	if (cpu_feature_enabled(X86_FEATURE_FSGSBASE)) {
+		kkm_cpu_fsgsbase = true;
+		printk(KERN_INFO "kkm_init: using X86_FEATURE_FSGSBASE.\n");
+	}
+
 	if (!cpu_feature_enabled(X86_FEATURE_XSAVES)) {
 		printk(KERN_INFO
 		       "kkm_init: X86_FEATURE_XSAVES not supported checking X86_FEATURE_XSAVE support.\n");
@@ -911,6 +1511,8 @@ static void kkm_check_cpu_support(void)
 		printk(KERN_INFO "kkm_init: using X86_FEATURE_XSAVES.\n");
 	}
 
+	kkm_xsave_init();
+
 	kkm_cpu_supported = true;
 }
 
@@ -927,6 +1529,18 @@ static int __init kkm_init(void)
 
 	kkm_check_cpu_support();
 
+	/*
+	 * per thread allocation caches, sized from xsave features
+	 */
+	if (kkm_cpu_supported == true) {
+		ret_val = kkm_kontext_cache_init();
+		if (ret_val != 0) {
+			printk(KERN_ERR
+			       "kkm_init: Cannot allocate kontext caches.\n");
+			return ret_val;
+		}
+	}
+
 	/*
 	 * register /dev/kkm
 	 */
@@ -963,6 +1577,16 @@ static int __init kkm_init(void)
 	/* initialize statistics */
 	kkm_statistics_init();
 
+	/* start building prebuilt kontainers, only usable cpus get them */
+	if (kkm_cpu_supported == true) {
+		kkm_kontainer_pool_init();
+	}
+
+	kkm_debugfs_init();
+
+	/* bpf handlers are optional */
+	kkm_bpf_init();
+
 	printk(KERN_INFO "kkm_init: Registered kkm.\n");
 
 	return 0;
@@ -976,6 +1600,10 @@ module_init(kkm_init);
  */
 static void __exit kkm_exit(void)
 {
+	kkm_kontainer_destroy_flush();
+	kkm_debugfs_cleanup();
+	kkm_kontainer_pool_cleanup();
+	kkm_kontext_cache_cleanup();
 	kkm_idt_cleanup();
 	kkm_mmu_cleanup();
 	misc_deregister(&kkm_device);
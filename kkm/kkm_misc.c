@@ -243,3 +243,71 @@ void kkm_copy_kkm_fpu_to_xstate(struct kkm_fpu *kvm_fpu, void *fpregs_state)
 	memcpy(xs->i387.xmm_space, kvm_fpu->xmm, sizeof(xs->i387.xmm_space));
 	xs->i387.mxcsr = kvm_fpu->mxcsr;
 }
+
+/*
+ * read extended control register
+ */
+uint64_t kkm_xgetbv(uint32_t index)
+{
+	uint32_t eax = 0, edx = 0;
+
+	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return eax | ((uint64_t)edx << 32);
+}
+
+/*
+ * size of xsave area needed to save features
+ * compacted format(XSAVES) packs enabled components back to back,
+ * standard format(XSAVE) keeps user components at fixed offsets
+ */
+uint32_t kkm_xsave_area_size(uint64_t features, bool compacted)
+{
+	uint32_t size = KKM_XSAVE_LEGACY_SIZE + KKM_XSAVE_HEADER_SIZE;
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	int i = 0;
+
+	for (i = KKM_XSAVE_FIRST_EXTENDED; i < 64; i++) {
+		if ((features & BIT_ULL(i)) == 0) {
+			continue;
+		}
+		cpuid_count(0xd, i, &eax, &ebx, &ecx, &edx);
+		if (compacted == true) {
+			if (ecx & KKM_XSAVE_CPUID_ALIGN64) {
+				size = ALIGN(size, 64);
+			}
+			size += eax;
+		} else {
+			if (ecx & KKM_XSAVE_CPUID_SUPERVISOR) {
+				continue;
+			}
+			size = max(size, ebx + eax);
+		}
+	}
+	return size;
+}
+
+/*
+ * features that can be armed in IA32_XFD
+ */
+uint64_t kkm_xsave_xfd_features(uint64_t features)
+{
+	uint64_t xfd_features = 0;
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	int i = 0;
+
+	cpuid_count(0xd, 1, &eax, &ebx, &ecx, &edx);
+	if ((eax & KKM_XSAVE_CPUID_XFD) == 0) {
+		return 0;
+	}
+
+	for (i = KKM_XSAVE_FIRST_EXTENDED; i < 64; i++) {
+		if ((features & BIT_ULL(i)) == 0) {
+			continue;
+		}
+		cpuid_count(0xd, i, &eax, &ebx, &ecx, &edx);
+		if (ecx & KKM_XSAVE_CPUID_XFD_COMPONENT) {
+			xfd_features |= BIT_ULL(i);
+		}
+	}
+	return xfd_features;
+}
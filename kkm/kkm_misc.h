@@ -33,4 +33,59 @@ void kkm_show_debug_registers(struct kkm_guest_area *ga);
 void kkm_copy_xstate_to_kkm_fpu(void *fpregs_state, struct kkm_fpu *kkm_fpu);
 void kkm_copy_kkm_fpu_to_xstate(struct kkm_fpu *kkm_fpu, void *fpregs_state);
 
+/*
+ * xsave layout, legacy region and xsave header
+ * followed by extended components starting at 2
+ */
+#define KKM_XSAVE_LEGACY_SIZE (512)
+#define KKM_XSAVE_HEADER_SIZE (64)
+#define KKM_XSAVE_FIRST_EXTENDED (2)
+
+/*
+ * CPUID.(EAX=0DH, ECX=1).EAX bit 4 XFD supported
+ * CPUID.(EAX=0DH, ECX=i).ECX
+ *     bit 0 supervisor component
+ *     bit 1 64 byte aligned in compacted format
+ *     bit 2 component can be armed in IA32_XFD
+ */
+#define KKM_XSAVE_CPUID_XFD (1U << 4)
+#define KKM_XSAVE_CPUID_SUPERVISOR (1U << 0)
+#define KKM_XSAVE_CPUID_ALIGN64 (1U << 1)
+#define KKM_XSAVE_CPUID_XFD_COMPONENT (1U << 2)
+
+#define KKM_XCR0 (0)
+
+uint64_t kkm_xgetbv(uint32_t index);
+uint32_t kkm_xsave_area_size(uint64_t features, bool compacted);
+uint64_t kkm_xsave_xfd_features(uint64_t features);
+
+/*
+ * fs/gs base access without msr, only when kkm_cpu_fsgsbase is true
+ */
+static inline uint64_t kkm_rdfsbase(void)
+{
+	uint64_t base = 0;
+
+	asm volatile("rdfsbase %0" : "=r"(base) : : "memory");
+	return base;
+}
+
+static inline void kkm_wrfsbase(uint64_t base)
+{
+	asm volatile("wrfsbase %0" : : "r"(base) : "memory");
+}
+
+static inline uint64_t kkm_rdgsbase(void)
+{
+	uint64_t base = 0;
+
+	asm volatile("rdgsbase %0" : "=r"(base) : : "memory");
+	return base;
+}
+
+static inline void kkm_wrgsbase(uint64_t base)
+{
+	asm volatile("wrgsbase %0" : : "r"(base) : "memory");
+}
+
 #endif /* __KKM_MISC_H__ */
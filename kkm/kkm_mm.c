@@ -89,3 +89,55 @@ void kkm_mm_free_page(void *virtual_address)
 {
 	kkm_mm_free_pages(virtual_address, 1);
 }
+
+/*
+ * check if user page was never populated, monitor pte is none.
+ * swapped out or migrated pages have non none pte and are reported
+ * as populated, huge mappings are populated.
+ */
+bool kkm_mm_user_page_none(struct mm_struct *mm, uint64_t address)
+{
+	bool none = true;
+	pgd_t *pgd = NULL;
+	p4d_t *p4d = NULL;
+	pud_t *pud = NULL;
+	pmd_t *pmd = NULL;
+	pte_t *pte = NULL;
+
+	mmap_read_lock(mm);
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd)) {
+		goto done;
+	}
+	p4d = p4d_offset(pgd, address);
+	if (p4d_none(*p4d)) {
+		goto done;
+	}
+	pud = pud_offset(p4d, address);
+	if (pud_none(*pud)) {
+		goto done;
+	}
+	none = false;
+	if (pud_leaf(*pud)) {
+		goto done;
+	}
+	pmd = pmd_offset(pud, address);
+	if (pmd_none(*pmd)) {
+		none = true;
+		goto done;
+	}
+	if (pmd_leaf(*pmd) || !pmd_present(*pmd)) {
+		goto done;
+	}
+	pte = pte_offset_map(pmd, address);
+	if (pte == NULL) {
+		goto done;
+	}
+	none = pte_none(ptep_get(pte));
+	pte_unmap(pte);
+
+done:
+	mmap_read_unlock(mm);
+	return none;
+}
@@ -15,11 +15,14 @@
 #ifndef __KKM_MM_H__
 #define __KKM_MM_H__
 
+struct mm_struct;
+
 int kkm_mm_allocate_pages(struct page **page, void **virtual_address,
 			  phys_addr_t *physical_address, int count);
 int kkm_mm_allocate_page(struct page **page, void **virtual_address,
 			 phys_addr_t *physical_address);
 void kkm_mm_free_pages(void *virtual_address, int count);
 void kkm_mm_free_page(void *virtual_address);
+bool kkm_mm_user_page_none(struct mm_struct *mm, uint64_t address);
 
 #endif /* __KKM_MM_H__ */
@@ -14,6 +14,7 @@
 
 #include <linux/mm.h>
 #include <linux/log2.h>
+#include <linux/moduleparam.h>
 #include <asm/io.h>
 #include <asm/tlbflush.h>
 
@@ -25,6 +26,13 @@
  */
 struct kkm_mmu_pml4e kkm_mmu_kx;
 
+/*
+ * number of 512GB pml4 entries for guest payload memory
+ * read once at module load, km sizes its layout with KKM_CAP_GUEST_PML4_ENTRIES
+ */
+uint32_t kkm_guest_pml4_count = 1;
+module_param_named(guest_pml4_entries, kkm_guest_pml4_count, uint, S_IRUGO);
+
 /*
  * return current cpu private area first page table index
  * next KKM_PER_CPU_GA_PAGE_COUNT belong to this physical cpu
@@ -92,6 +100,13 @@ static bool kkm_mmu_get_table_va(uint64_t *table_va, int index)
  */
 int kkm_mmu_init(void)
 {
+	if (kkm_guest_pml4_count == 0 ||
+	    kkm_guest_pml4_count > KKM_GUEST_PML4_ENTRIES_MAX) {
+		printk(KERN_NOTICE
+		       "kkm_mmu_init: guest_pml4_entries %u out of range, using 1\n",
+		       kkm_guest_pml4_count);
+		kkm_guest_pml4_count = 1;
+	}
 	return kkm_create_pml4(&kkm_mmu_kx, KKM_PRIVATE_START_VA);
 }
 
@@ -104,32 +119,47 @@ void kkm_mmu_cleanup(void)
 }
 
 /*
- * flush TLB entries for GUEST_KERNEL_PCID and GUEST_PAYLOAD_PCID
+ * flush TLB entries for GUEST_PAYLOAD_PCID
  */
 void kkm_mmu_flush_tlb(void)
 {
-	invpcid_flush_single_context(GUEST_KERNEL_PCID);
 	invpcid_flush_single_context(GUEST_PAYLOAD_PCID);
 }
 
 /*
- * flush one page TLB entry for GUEST_KERNEL_PCID and GUEST_PAYLOAD_PCID
+ * flush one page TLB entry for GUEST_PAYLOAD_PCID
  */
 void kkm_mmu_flush_tlb_one_page(uint64_t addr)
 {
-	invpcid_flush_one(GUEST_KERNEL_PCID, addr);
 	invpcid_flush_one(GUEST_PAYLOAD_PCID, addr);
 }
 
 /*
  * allocate pages and initialize page table hierrarchy
  */
-int kkm_create_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address)
+/*
+ * link pud, pmd and pt pages for address
+ */
+static void kkm_format_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address)
 {
-	int ret_val = 0;
 	int pud_idx;
 	int pmd_idx;
 
+	/* initialize first entry in pud */
+	pud_idx = pud_index(address);
+	kkm_mmu_insert_page(kmu->pud.va, pud_idx, kmu->pmd.pa,
+			    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
+
+	/* initialize first entry in pmd */
+	pmd_idx = pmd_index(address);
+	kkm_mmu_insert_page(kmu->pmd.va, pmd_idx, kmu->pt.pa,
+			    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
+}
+
+int kkm_create_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address)
+{
+	int ret_val = 0;
+
 	memset(kmu, 0, sizeof(struct kkm_mmu_pml4e));
 
 	/* alocate page for pud */
@@ -165,15 +195,7 @@ int kkm_create_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address)
 	kmu->pgd_entry = (kmu->pud.pa & KKM_PAGE_PA_MASK) | _PAGE_USER |
 			 _PAGE_RW | _PAGE_PRESENT;
 
-	/* initialize first entry in pud */
-	pud_idx = pud_index(address);
-	kkm_mmu_insert_page(kmu->pud.va, pud_idx, kmu->pmd.pa,
-			    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
-
-	/* initialize first entry in pmd */
-	pmd_idx = pmd_index(address);
-	kkm_mmu_insert_page(kmu->pmd.va, pmd_idx, kmu->pt.pa,
-			    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
+	kkm_format_pml4(kmu, address);
 
 error:
 	if (ret_val != 0) {
@@ -182,6 +204,17 @@ error:
 	return ret_val;
 }
 
+/*
+ * return pages of kkm_create_pml4 to just created state
+ */
+void kkm_reset_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address)
+{
+	clear_page(kmu->pud.va);
+	clear_page(kmu->pmd.va);
+	clear_page(kmu->pt.va);
+	kkm_format_pml4(kmu, address);
+}
+
 void kkm_cleanup_pml4(struct kkm_mmu_pml4e *kmu)
 {
 	if (kmu->pud.page != NULL) {
@@ -314,12 +347,11 @@ static void kkm_mmu_setup_one_pgd(uint64_t kernel_pgd_base,
 }
 
 /*
- * setup kernel memory range for 
- *     guest kernel
- *     guest payload
+ * setup kernel memory range for guest payload
+ * copied from native kernel pgd(mm->pgd), with or without pti
+ * guest kernel code runs on the same tables
  */
-int kkm_mmu_copy_kernel_pgd(uint64_t current_pgd_base, void *guest_kernel_va,
-			    void *guest_payload_va, void *kernel_p4d_va,
+int kkm_mmu_copy_kernel_pgd(uint64_t current_pgd_base, void *guest_payload_va,
 			    void *payload_p4d_va)
 {
 	if (current_pgd_base == 0) {
@@ -328,143 +360,164 @@ int kkm_mmu_copy_kernel_pgd(uint64_t current_pgd_base, void *guest_kernel_va,
 		return -EINVAL;
 	}
 
-	kkm_mmu_setup_one_pgd(current_pgd_base, guest_kernel_va, kernel_p4d_va);
-
-	/*
-	 * point to user pgd.
-	 * linux kernel allocates kernel and user pml4 tables
-	 * next to each other.
-	 * kernel pml4 is even page
-	 * user pml4 is odd page
-	 */
-	//current_pgd_base += PAGE_SIZE;
-
 	kkm_mmu_setup_one_pgd(current_pgd_base, guest_payload_va,
 			      payload_p4d_va);
 
 	return 0;
 }
 
+/*
+ * set guest pml4 entry to monitor entry, allow execution
+ * km code is in entry 0 and mmap'ed libraries are in top entries
+ * return true if guest entry changed
+ */
+static bool kkm_mmu_sync_entry(uint64_t *table_va, int index,
+			       uint64_t native_entry)
+{
+	uint64_t new_guest_entry = native_entry & ~_PAGE_NX;
+
+	/*
+	 * if entries Physical Address are same, nothing to be done
+	 */
+	if (kkm_mmu_entry_pa(table_va[index]) ==
+	    kkm_mmu_entry_pa(new_guest_entry)) {
+		return false;
+	}
+	table_va[index] = new_guest_entry;
+	return true;
+}
+
 /*
  * setup guest payload area
- * memory from 16TB to 16TB + 512GB is mapped in monitor.
- * copy the above pml4 entry to point to 0TB in guest payload for text
- * copy the above pml4 entry to point to 128TB in guest payload for stack and mmap
+ * memory from 16TB to 16TB + guest_pml4_entries * 512GB is mapped in monitor.
+ * copy the first of above pml4 entries to point to 0TB in guest payload for text
+ * copy all of above pml4 entries to end at 128TB in guest payload for stack and mmap
+ * return number of guest entries changed
  */
-int kkm_mmu_sync(uint64_t current_pgd_base, void *guest_kernel_va,
-		 void *guest_payload_va, struct kkm_mmu_pml4e *guest,
-		 void *low_p4d_va, phys_addr_t low_p4d_pa)
+int kkm_mmu_sync(uint64_t current_pgd_base, void *guest_payload_va,
+		 struct kkm_mmu_pml4e *guest, void *low_p4d_va,
+		 phys_addr_t low_p4d_pa)
 {
+	uint64_t *native_table = NULL;
 	uint64_t native_kernel_entry = -1;
-	uint64_t guest_payload_entry = -1;
-	uint64_t new_guest_entry = -1;
 	uint64_t native_kernel_low_p4d_pa = 0;
-	uint64_t native_kernel_low_p4d_va = 0;
+	int top_entry = 0;
+	int changed = 0;
+	int i = 0;
 
 	if (pgtable_l5_enabled() == true) {
 		/*
 		 * from kernel pgd get p4d pointer(virtual address) for KKM_PGD_LOW_P4D_ENTRY
 		 */
-
 		native_kernel_low_p4d_pa =
 			((uint64_t *)current_pgd_base)[KKM_PGD_LOW_P4D_ENTRY] &
 			KKM_PAGE_PA_MASK;
-		native_kernel_low_p4d_va =
-			(uint64_t)phys_to_virt(native_kernel_low_p4d_pa);
-
-		native_kernel_entry = ((uint64_t *)native_kernel_low_p4d_va)
-			[KKM_PGD_MONITOR_PAYLOAD_ENTRY];
-		guest_payload_entry =
-			((uint64_t *)
-				 low_p4d_va)[KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY];
+		native_table = (uint64_t *)phys_to_virt(native_kernel_low_p4d_pa);
+
+		/*
+		 * insert pgd entry using low_p4d_pa
+		 * in guest_payload pgd
+		 */
+		kkm_mmu_insert_page(guest_payload_va, KKM_PGD_LOW_P4D_ENTRY,
+				    low_p4d_pa,
+				    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
 	} else {
-		native_kernel_entry =
-			((uint64_t *)
-				 current_pgd_base)[KKM_PGD_MONITOR_PAYLOAD_ENTRY];
-		guest_payload_entry = ((uint64_t *)guest_payload_va)
-			[KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY];
+		native_table = (uint64_t *)current_pgd_base;
 	}
 
 	/*
-	 * if entries Physical Address are same, nothing to be done
+	 * entry 0 for code + data
 	 */
-	if (kkm_mmu_entry_pa(native_kernel_entry) ==
-	    kkm_mmu_entry_pa(guest_payload_entry)) {
-		return 0;
+	native_kernel_entry = native_table[KKM_PGD_MONITOR_PAYLOAD_ENTRY];
+	if (pgtable_l5_enabled() == true) {
+		changed += kkm_mmu_sync_entry(
+			low_p4d_va, KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY,
+			native_kernel_entry);
+	} else {
+		changed += kkm_mmu_sync_entry(
+			guest_payload_va, KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY,
+			native_kernel_entry);
 	}
 
 	/*
-	 * change pml4 entry to allow execution
-	 * km code is in entry 0 and mmap'ed libraries are in entry 255
+	 * set entry 1 for guest va(vdso, vvar + code copied from km to payload)
 	 */
-	new_guest_entry = native_kernel_entry & ~_PAGE_NX;
-
 	if (pgtable_l5_enabled() == true) {
-		/*
-		 * insert pgd entry using low_p4d_pa
-		 * in guest_kernel and guest_payload pgd
-		 */
-		kkm_mmu_insert_page(guest_kernel_va, KKM_PGD_LOW_P4D_ENTRY,
-				    low_p4d_pa,
-				    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
-		kkm_mmu_insert_page(guest_payload_va, KKM_PGD_LOW_P4D_ENTRY,
-				    low_p4d_pa,
-				    _PAGE_USER | _PAGE_RW | _PAGE_PRESENT);
+		((uint64_t *)low_p4d_va)[KKM_PGD_GUEST_PRIVATE_ENTRY] =
+			guest->pgd_entry;
+	} else {
+		((uint64_t *)guest_payload_va)[KKM_PGD_GUEST_PRIVATE_ENTRY] =
+			guest->pgd_entry;
+	}
 
-		/*
-		 * keep kernel and user pgd same for payload area
-		 * entry 0 for code + data
-		 */
-		((uint64_t *)low_p4d_va)[KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY] =
-			new_guest_entry;
+	/*
+	 * entries ending at 255 for stack + mmap
+	 * monitor entries are populated as km touches memory,
+	 * this is repeated from page fault path.
+	 */
+	top_entry = KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY + 1 - kkm_guest_pml4_count;
+	for (i = 0; i < kkm_guest_pml4_count; i++) {
+		native_kernel_entry =
+			native_table[KKM_PGD_MONITOR_PAYLOAD_ENTRY + i];
+		if (pgtable_l5_enabled() == true) {
+			changed += kkm_mmu_sync_entry(low_p4d_va, top_entry + i,
+						      native_kernel_entry);
+		} else {
+			changed += kkm_mmu_sync_entry(guest_payload_va,
+						      top_entry + i,
+						      native_kernel_entry);
+		}
+	}
 
-		/*
-		 * set entry 1 for guest va(vdso, vvar + code copied from km to payload)
-		 */
-		((uint64_t *)low_p4d_va)[1] = guest->pgd_entry;
+	return changed;
+}
 
-		/*
-		 * entry 255 for stack + mmap
-		 */
-		((uint64_t *)low_p4d_va)[KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY] =
-			new_guest_entry;
+/*
+ * check if guest payload pml4 entry covering guest_va points to
+ * the same table as its monitor entry.
+ * with 5 level paging payload entries are in low p4d.
+ * fault path calls kkm_mmu_sync only when this returns false.
+ */
+bool kkm_mmu_payload_synced(uint64_t current_pgd_base, void *guest_payload_va,
+			    void *low_p4d_va, uint64_t guest_va)
+{
+	uint64_t *native_table = NULL;
+	uint64_t *guest_table = NULL;
+	uint64_t native_kernel_low_p4d_pa = 0;
+	int guest_entry = guest_va / KKM_GUEST_PML4_ENTRY_SIZE;
+	int native_entry = 0;
+	int top_entry = 0;
+
+	top_entry = KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY + 1 - kkm_guest_pml4_count;
+	if (guest_entry == KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY) {
+		native_entry = KKM_PGD_MONITOR_PAYLOAD_ENTRY;
+	} else if (guest_entry >= top_entry &&
+		   guest_entry <= KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY) {
+		native_entry =
+			KKM_PGD_MONITOR_PAYLOAD_ENTRY + guest_entry - top_entry;
 	} else {
-		/*
-		 * keep kernel and user pgd same for payload area
-		 * entry 0 for code + data
-		 */
-		((uint64_t *)
-			 guest_kernel_va)[KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY] =
-			new_guest_entry;
-		((uint64_t *)
-			 guest_payload_va)[KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY] =
-			new_guest_entry;
-
-		/*
-		 * set entry 1 for guest va(vdso, vvar + code copied from km to payload)
-		 */
-		((uint64_t *)guest_kernel_va)[1] = guest->pgd_entry;
-		((uint64_t *)guest_payload_va)[1] = guest->pgd_entry;
+		/* not a payload entry */
+		return true;
+	}
 
-		/*
-		 * entry 255 for stack + mmap
-		 */
-		((uint64_t *)guest_kernel_va)[KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY] =
-			new_guest_entry;
-		((uint64_t *)guest_payload_va)[KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY] =
-			new_guest_entry;
+	if (pgtable_l5_enabled() == true) {
+		native_kernel_low_p4d_pa =
+			((uint64_t *)current_pgd_base)[KKM_PGD_LOW_P4D_ENTRY] &
+			KKM_PAGE_PA_MASK;
+		native_table = (uint64_t *)phys_to_virt(native_kernel_low_p4d_pa);
+		guest_table = low_p4d_va;
+	} else {
+		native_table = (uint64_t *)current_pgd_base;
+		guest_table = guest_payload_va;
 	}
 
-	/*
-	 * fix memory alias created
-	 * modify km to use one pml4 entry for code + data and second entry for stack + mmap
-	 */
-	return 0;
+	return kkm_mmu_entry_pa(READ_ONCE(guest_table[guest_entry])) ==
+	       kkm_mmu_entry_pa(READ_ONCE(native_table[native_entry]));
 }
 
 /*
  * walk through kernel page table to identify physical address of faulted address
- * add to to guest kernel and payload page tables
+ * add to guest payload page tables
  */
 bool kkm_mmu_update_priv_area(uint64_t guest_fault_address,
 			      uint64_t monitor_fault_address,
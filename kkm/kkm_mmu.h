@@ -49,12 +49,17 @@
 // clang-format on
 
 /*
- * use 2 pcids that are not used by linux kernel
+ * use pcid that is not used by linux kernel
  */
 #define PCID_MASK (0xFFFULL)
-#define GUEST_KERNEL_PCID (0x7FULL)
 #define GUEST_PAYLOAD_PCID (0xFFULL)
 
+/*
+ * cr3 bit 63, when set mov to cr3 does not invalidate
+ * non global TLB entries tagged with the new PCID
+ */
+#define KKM_CR3_NOFLUSH (1ULL << 63)
+
 /* use unused kernel virtual address for kkm fixed mapping */
 #define KKM_PRIVATE_START_VA (0xFFFFFE8000000000ULL)
 
@@ -153,10 +158,11 @@
 
 /*
  * guest physical memory is mapped from 16TB monitor virtual address
- * km uses a maximum of 512GB physical memory per guest
+ * km uses a maximum of kkm_guest_pml4_count * 512GB physical memory per guest
  * payload sees this memory offsetted from
- *     virtual address 0 for code growing up
- *     virtual address for stack growing down
+ *     virtual address 0 for code growing up(first 512GB only,
+ *         next entry is guest private area)
+ *     virtual address for stack growing down(all entries)
  */
 #define KKM_PGD_LOW_P4D_ENTRY (0)
 /* bytes offset into pml4 table for 16TB(monitor guest mapping) */
@@ -170,6 +176,8 @@
 #define KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY (0)
 #define KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY_OFFSET                              \
 	(KKM_PGD_GUEST_PAYLOAD_BOTTOM_ENTRY * 8)
+/* pml4 entry for guest private area(vdso, vvar, km guest memory) */
+#define KKM_PGD_GUEST_PRIVATE_ENTRY (1)
 /* byte offset into pml4 payload virtual address for stack */
 #define KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY (255)
 #define KKM_PGD_GUEST_PAYLOAD_TOP_ENTRY_OFFSET                                 \
@@ -205,6 +213,7 @@ void kkm_mmu_cleanup(void);
 void kkm_mmu_flush_tlb(void);
 void kkm_mmu_flush_tlb_one_page(uint64_t addr);
 int kkm_create_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address);
+void kkm_reset_pml4(struct kkm_mmu_pml4e *kmu, uint64_t address);
 void kkm_cleanup_pml4(struct kkm_mmu_pml4e *kmu);
 
 void kkm_mmu_set_guest_area(int cpu_index, phys_addr_t pa0, phys_addr_t pa1,
@@ -216,12 +225,13 @@ void kkm_mmu_set_kx_global_info(phys_addr_t idt_pa, phys_addr_t text_page0_pa,
 				phys_addr_t text_page1_pa,
 				phys_addr_t kx_global_pa);
 
-int kkm_mmu_copy_kernel_pgd(uint64_t current_pgd_base, void *guest_kernel_va,
-			    void *guest_payload_va, void *kernel_p4d_va,
+int kkm_mmu_copy_kernel_pgd(uint64_t current_pgd_base, void *guest_payload_va,
 			    void *payload_p4d_va);
-int kkm_mmu_sync(uint64_t current_pgd_base, void *guest_kernel_va,
-		 void *guest_payload_va, struct kkm_mmu_pml4e *guest,
-		 void *low_p4d_va, phys_addr_t low_p4d_pa);
+int kkm_mmu_sync(uint64_t current_pgd_base, void *guest_payload_va,
+		 struct kkm_mmu_pml4e *guest, void *low_p4d_va,
+		 phys_addr_t low_p4d_pa);
+bool kkm_mmu_payload_synced(uint64_t current_pgd_base, void *guest_payload_va,
+			    void *low_p4d_va, uint64_t guest_va);
 bool kkm_mmu_update_priv_area(uint64_t guest_fault_address,
 			      uint64_t monitor_fault_address,
 			      uint64_t current_pgd_base,
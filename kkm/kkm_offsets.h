@@ -70,6 +70,8 @@
 
 #define OFF_TI_INTR_NO ((REG_BASE_OFF) + 8 * 124) /* intr_no */
 
+#define OFF_GP_SYSRET ((REG_BASE_OFF) + 8 * 125) /* guest_sysret */
+
 #define OFF_PAY_ENT_STK (4096) /* payload_entry_stack bottom */
 #define OFF_GUEST_STK (7936) /* guest kernel stack bottom */
 
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/perf_event.h>
+#include <linux/sched.h>
+#include <linux/capability.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_perf.h"
+
+static void kkm_perf_release_task(struct kkm_perf_task *pt)
+{
+	int i = 0;
+
+	for (i = 0; i < KKM_PERF_MAX_COUNTERS; i++) {
+		if (pt->event[i] != NULL) {
+			perf_event_release_kernel(pt->event[i]);
+			pt->event[i] = NULL;
+		}
+	}
+	pt->task = NULL;
+	pt->last_use = 0;
+}
+
+static void kkm_perf_release_events(struct kkm_perf_state *ps)
+{
+	int i = 0;
+
+	for (i = 0; i < KKM_PERF_TASK_CACHE; i++) {
+		kkm_perf_release_task(&ps->task[i]);
+	}
+	ps->current_task = NULL;
+	ps->runs = 0;
+}
+
+/*
+ * events are per task, kontext can move between monitor threads.
+ * counters only count between run begin and end, user mode only
+ * unless set by perfmon capable caller.
+ */
+static int kkm_perf_create_events(struct kkm_perf_state *ps,
+				  struct kkm_perf_task *pt)
+{
+	int ret_val = 0;
+	int i = 0;
+	struct perf_event_attr attr;
+	struct perf_event *event = NULL;
+
+	for (i = 0; i < ps->count; i++) {
+		memset(&attr, 0, sizeof(struct perf_event_attr));
+		attr.type = ps->counter[i].type;
+		attr.size = sizeof(struct perf_event_attr);
+		attr.config = ps->counter[i].config;
+		attr.pinned = 1;
+		if (ps->privileged == false) {
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+		}
+
+		event = perf_event_create_kernel_counter(&attr, -1, current,
+							 NULL, NULL);
+		if (IS_ERR(event)) {
+			ret_val = PTR_ERR(event);
+			printk(KERN_NOTICE
+			       "kkm_perf_create_events: counter %d type %u config %llx failed error(%d)\n",
+			       i, attr.type, attr.config, ret_val);
+			kkm_perf_release_task(pt);
+			return ret_val;
+		}
+		pt->event[i] = event;
+	}
+	pt->task = current;
+	return ret_val;
+}
+
+/*
+ * make events of current task current_task.
+ * events are created on first run from a task,
+ * least recently used task events are replaced when cache is full.
+ * events hold a task reference, cached task pointer can't be reused.
+ */
+static int kkm_perf_select_task(struct kkm_perf_state *ps)
+{
+	int ret_val = 0;
+	int i = 0;
+	struct kkm_perf_task *pt = NULL;
+	struct kkm_perf_task *victim = &ps->task[0];
+
+	for (i = 0; i < KKM_PERF_TASK_CACHE; i++) {
+		pt = &ps->task[i];
+		if (pt->task == current) {
+			goto found;
+		}
+		if (pt->last_use < victim->last_use) {
+			victim = pt;
+		}
+	}
+
+	pt = victim;
+	kkm_perf_release_task(pt);
+	ret_val = kkm_perf_create_events(ps, pt);
+	if (ret_val != 0) {
+		ps->current_task = NULL;
+		return ret_val;
+	}
+
+found:
+	pt->last_use = ++ps->runs;
+	ps->current_task = pt;
+	return ret_val;
+}
+
+void kkm_perf_init(struct kkm_kontext *kkm_kontext)
+{
+	struct kkm_perf_state *ps = &kkm_kontext->perf;
+
+	memset(ps, 0, sizeof(struct kkm_perf_state));
+}
+
+void kkm_perf_cleanup(struct kkm_kontext *kkm_kontext)
+{
+	struct kkm_perf_state *ps = &kkm_kontext->perf;
+
+	kkm_perf_release_events(ps);
+	ps->count = 0;
+	ps->started = false;
+	ps->privileged = false;
+}
+
+/*
+ * generic and cache hardware events, raw pmu encodings
+ * only for perfmon capable caller
+ */
+static bool kkm_perf_type_valid(uint32_t type, bool privileged)
+{
+	switch (type) {
+	case PERF_TYPE_HARDWARE:
+	case PERF_TYPE_HW_CACHE:
+		return true;
+	case PERF_TYPE_RAW:
+		return privileged;
+	}
+	return false;
+}
+
+/*
+ * KKM_KONTEXT_SET_PERF
+ * replace counter set, count 0 detaches counters.
+ * values in kontext perf page start from 0
+ */
+int kkm_perf_set(struct kkm_kontext *kkm_kontext, struct kkm_perf *perf)
+{
+	int ret_val = 0;
+	struct kkm_perf_state *ps = &kkm_kontext->perf;
+	struct kkm_perf_values *pv = NULL;
+	bool privileged = perfmon_capable();
+	int i = 0;
+
+	if (perf->count > KKM_PERF_MAX_COUNTERS || perf->flags != 0) {
+		return -EINVAL;
+	}
+	for (i = 0; i < perf->count; i++) {
+		if (kkm_perf_type_valid(perf->counters[i].type, privileged) ==
+		    false) {
+			return -EINVAL;
+		}
+	}
+
+	kkm_perf_cleanup(kkm_kontext);
+	if (perf->count == 0) {
+		return 0;
+	}
+
+	pv = (struct kkm_perf_values *)kkm_kontext_map_page(
+		kkm_kontext, KKM_CONTEXT_MAP_PERF_PAGE);
+	if (pv == NULL) {
+		return -ENOMEM;
+	}
+
+	memcpy(ps->counter, perf->counters,
+	       sizeof(struct kkm_perf_counter) * perf->count);
+	ps->count = perf->count;
+	ps->privileged = privileged;
+
+	ret_val = kkm_perf_select_task(ps);
+	if (ret_val != 0) {
+		ps->count = 0;
+		ps->privileged = false;
+		return ret_val;
+	}
+
+	memset(pv, 0, sizeof(struct kkm_perf_values));
+	pv->count = ps->count;
+	return ret_val;
+}
+
+/*
+ * start of KKM_RUN, snapshot counters
+ */
+int kkm_perf_run_begin(struct kkm_kontext *kkm_kontext)
+{
+	int ret_val = 0;
+	int i = 0;
+	struct kkm_perf_state *ps = &kkm_kontext->perf;
+	struct kkm_perf_task *pt = NULL;
+
+	if (ps->count == 0) {
+		return 0;
+	}
+
+	ret_val = kkm_perf_select_task(ps);
+	if (ret_val != 0) {
+		return ret_val;
+	}
+
+	pt = ps->current_task;
+	for (i = 0; i < ps->count; i++) {
+		ps->start[i] = 0;
+		perf_event_read_local(pt->event[i], &ps->start[i], NULL, NULL);
+	}
+	ps->started = true;
+	return ret_val;
+}
+
+/*
+ * end of KKM_RUN, add user mode counts since begin to perf page
+ */
+void kkm_perf_run_end(struct kkm_kontext *kkm_kontext)
+{
+	int i = 0;
+	uint64_t value = 0;
+	struct kkm_perf_state *ps = &kkm_kontext->perf;
+	struct kkm_perf_task *pt = ps->current_task;
+	struct kkm_perf_values *pv = NULL;
+
+	if (ps->started == false) {
+		return;
+	}
+	ps->started = false;
+
+	pv = (struct kkm_perf_values *)kkm_kontext
+		     ->mmap_area[KKM_CONTEXT_MAP_PERF_PAGE]
+		     .kvaddr;
+	for (i = 0; i < ps->count; i++) {
+		if (perf_event_read_local(pt->event[i], &value, NULL, NULL) !=
+		    0) {
+			continue;
+		}
+		pv->value[i] += value - ps->start[i];
+	}
+	pv->runs++;
+}
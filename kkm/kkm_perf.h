@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_PERF_H__
+#define __KKM_PERF_H__
+
+struct kkm_kontext;
+struct kkm_perf;
+struct perf_event;
+struct task_struct;
+
+/*
+ * monitor threads running a kontext with events kept for each
+ */
+#define KKM_PERF_TASK_CACHE (4)
+
+struct kkm_perf_task {
+	struct task_struct *task; /* task events are counting on, NULL if free */
+	struct perf_event *event[KKM_PERF_MAX_COUNTERS];
+	uint64_t last_use; /* run sequence of last use, 0 if free */
+};
+
+/*
+ * payload counters of a kontext, KKM_KONTEXT_SET_PERF
+ */
+struct kkm_perf_state {
+	uint32_t count; /* 0 when no counters are attached */
+	struct kkm_perf_counter counter[KKM_PERF_MAX_COUNTERS];
+	struct kkm_perf_task task[KKM_PERF_TASK_CACHE];
+	struct kkm_perf_task *current_task; /* events of running task */
+	uint64_t runs; /* run sequence */
+	uint64_t start[KKM_PERF_MAX_COUNTERS]; /* value at run begin */
+	bool started; /* start is valid */
+	bool privileged; /* set by perfmon capable caller, kernel counted */
+};
+
+void kkm_perf_init(struct kkm_kontext *kkm_kontext);
+void kkm_perf_cleanup(struct kkm_kontext *kkm_kontext);
+int kkm_perf_set(struct kkm_kontext *kkm_kontext, struct kkm_perf *perf);
+int kkm_perf_run_begin(struct kkm_kontext *kkm_kontext);
+void kkm_perf_run_end(struct kkm_kontext *kkm_kontext);
+
+#endif /* __KKM_PERF_H__ */
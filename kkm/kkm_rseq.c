@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/smp.h>
+#include <linux/uaccess.h>
+#include <uapi/linux/rseq.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_statistics.h"
+#include "kkm_rseq.h"
+
+static uint32_t __user *kkm_rseq_cpu_id_start(struct kkm_rseq_state *rs)
+{
+	return (uint32_t __user *)(rs->mva +
+				   offsetof(struct rseq, cpu_id_start));
+}
+
+static uint32_t __user *kkm_rseq_cpu_id(struct kkm_rseq_state *rs)
+{
+	return (uint32_t __user *)(rs->mva + offsetof(struct rseq, cpu_id));
+}
+
+static uint64_t __user *kkm_rseq_cs(struct kkm_rseq_state *rs)
+{
+	return (uint64_t __user *)(rs->mva + offsetof(struct rseq, rseq_cs));
+}
+
+static int kkm_rseq_read_guest(struct kkm_kontext *kkm_kontext, uint64_t gva,
+			       void *buf, uint64_t size)
+{
+	uint64_t mva = 0;
+
+	if (kkm_guest_range_to_monitor_va(kkm_kontext, gva, size, &mva) ==
+	    false) {
+		return -EFAULT;
+	}
+	if (copy_from_user(buf, (void __user *)mva, size)) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+void kkm_rseq_init(struct kkm_kontext *kkm_kontext)
+{
+	struct kkm_rseq_state *rs = &kkm_kontext->rseq;
+
+	rs->gva = 0;
+	rs->mva = 0;
+	rs->sig = 0;
+	rs->cpu = -1;
+}
+
+int kkm_rseq_set(struct kkm_kontext *kkm_kontext, struct kkm_rseq *rseq)
+{
+	struct kkm_rseq_state *rs = &kkm_kontext->rseq;
+	uint64_t mva = 0;
+
+	if (rseq->flags & KKM_RSEQ_FLAG_UNREGISTER) {
+		if (rs->gva == 0 || rs->gva != rseq->rseq ||
+		    rs->sig != rseq->sig) {
+			return -EINVAL;
+		}
+		/* best effort, area may be gone already */
+		if (put_user(RSEQ_CPU_ID_UNINITIALIZED, kkm_rseq_cpu_id(rs))) {
+			printk(KERN_NOTICE
+			       "kkm_rseq_set: Thread %llx rseq %llx not writable on unregister\n",
+			       kkm_kontext->id, rs->gva);
+		}
+		kkm_rseq_init(kkm_kontext);
+		return 0;
+	}
+
+	if (rseq->flags != 0) {
+		return -EINVAL;
+	}
+	if (rs->gva != 0) {
+		return -EBUSY;
+	}
+	if (rseq->len < KKM_RSEQ_MIN_LEN ||
+	    IS_ALIGNED(rseq->rseq, KKM_RSEQ_ALIGN) == false) {
+		return -EINVAL;
+	}
+	if (kkm_guest_range_to_monitor_va(kkm_kontext, rseq->rseq, rseq->len,
+					  &mva) == false) {
+		return -EFAULT;
+	}
+
+	rs->gva = rseq->rseq;
+	rs->mva = mva;
+	rs->sig = rseq->sig;
+	rs->cpu = -1;
+	return 0;
+}
+
+/*
+ * payload was off cpu since it was last in guest(exit, forwarded
+ * interrupt or migration). abort critical section it was in,
+ * same checks as kernel rseq.
+ */
+static int kkm_rseq_abort(struct kkm_kontext *kkm_kontext,
+			  struct kkm_guest_area *ga)
+{
+	struct kkm_rseq_state *rs = &kkm_kontext->rseq;
+	struct rseq_cs cs;
+	uint64_t cs_gva = 0;
+	uint32_t sig = 0;
+
+	if (get_user(cs_gva, kkm_rseq_cs(rs))) {
+		return -EFAULT;
+	}
+	if (cs_gva == 0) {
+		return 0;
+	}
+
+	if (kkm_rseq_read_guest(kkm_kontext, cs_gva, &cs,
+				sizeof(struct rseq_cs)) != 0) {
+		return -EFAULT;
+	}
+	if (cs.version != 0 ||
+	    cs.start_ip + cs.post_commit_offset < cs.start_ip ||
+	    cs.abort_ip - cs.start_ip < cs.post_commit_offset) {
+		return -EINVAL;
+	}
+
+	/*
+	 * outside of critical section, descriptor is stale
+	 */
+	if (ga->regs.rip - cs.start_ip >= cs.post_commit_offset) {
+		if (put_user(0, kkm_rseq_cs(rs))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	if (kkm_rseq_read_guest(kkm_kontext, cs.abort_ip - sizeof(uint32_t),
+				&sig, sizeof(uint32_t)) != 0) {
+		return -EFAULT;
+	}
+	if (sig != rs->sig) {
+		return -EINVAL;
+	}
+	if (put_user(0, kkm_rseq_cs(rs))) {
+		return -EFAULT;
+	}
+
+	ga->regs.rip = cs.abort_ip;
+	kkm_statistics_rseq_abort_count_inc();
+	return 0;
+}
+
+/*
+ * called before every guest entry, preemption enabled.
+ * monitor memory may fault in here.
+ */
+int kkm_rseq_guest_entry(struct kkm_kontext *kkm_kontext,
+			 struct kkm_guest_area *ga)
+{
+	struct kkm_rseq_state *rs = &kkm_kontext->rseq;
+	int cpu = -1;
+	int ret_val = 0;
+
+	if (rs->gva == 0) {
+		return 0;
+	}
+
+	ret_val = kkm_rseq_abort(kkm_kontext, ga);
+	if (ret_val != 0) {
+		goto error;
+	}
+
+	cpu = raw_smp_processor_id();
+	if (cpu == rs->cpu) {
+		return 0;
+	}
+	if (put_user(cpu, kkm_rseq_cpu_id_start(rs)) ||
+	    put_user(cpu, kkm_rseq_cpu_id(rs))) {
+		ret_val = -EFAULT;
+		goto error;
+	}
+	rs->cpu = cpu;
+
+error:
+	if (ret_val != 0) {
+		printk(KERN_NOTICE
+		       "kkm_rseq_guest_entry: Thread %llx rseq %llx rip %llx error %d\n",
+		       kkm_kontext->id, rs->gva, ga->regs.rip, ret_val);
+	}
+	return ret_val;
+}
+
+/*
+ * cpu_id published before interrupts were disabled is still right
+ */
+bool kkm_rseq_cpu_valid(struct kkm_kontext *kkm_kontext, int cpu)
+{
+	struct kkm_rseq_state *rs = &kkm_kontext->rseq;
+
+	return rs->gva == 0 || rs->cpu == cpu;
+}
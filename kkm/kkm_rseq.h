@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_RSEQ_H__
+#define __KKM_RSEQ_H__
+
+/*
+ * original struct rseq size and alignment
+ */
+#define KKM_RSEQ_MIN_LEN (32)
+#define KKM_RSEQ_ALIGN (32)
+
+struct kkm_kontext;
+struct kkm_guest_area;
+struct kkm_rseq;
+
+/*
+ * rseq registration of a kontext, KKM_KONTEXT_SET_RSEQ
+ */
+struct kkm_rseq_state {
+	uint64_t gva; /* guest address of struct rseq, 0 when not registered */
+	uint64_t mva; /* monitor address of struct rseq */
+	uint32_t sig; /* signature preceding abort_ip */
+	int cpu; /* cpu_id last published, -1 none */
+};
+
+void kkm_rseq_init(struct kkm_kontext *kkm_kontext);
+int kkm_rseq_set(struct kkm_kontext *kkm_kontext, struct kkm_rseq *rseq);
+int kkm_rseq_guest_entry(struct kkm_kontext *kkm_kontext,
+			 struct kkm_guest_area *ga);
+bool kkm_rseq_cpu_valid(struct kkm_kontext *kkm_kontext, int cpu);
+
+#endif /* __KKM_RSEQ_H__ */
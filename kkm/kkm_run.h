@@ -38,6 +38,7 @@ enum kkm_exit_status {
 	KKM_EXIT_EPR = 23,
 	KKM_EXIT_SYSTEM_EVENT = 24,
 	KKM_EXIT_IOAPIC_EOI = 26,
+	KKM_EXIT_MEMORY_FAULT = 39,
 };
 
 struct kkm_debug_exit_arch {
@@ -134,6 +135,15 @@ struct kkm_run {
 		struct {
 			uint8_t vector;
 		} eoi;
+		// KKM_EXIT_MEMORY_FAULT
+		struct {
+#define KKM_MEMORY_EXIT_FLAG_LAZY (1ULL << 0)
+			uint64_t flags;
+			uint64_t gpa;
+			uint64_t size;
+			uint32_t slot;
+			uint32_t padding;
+		} memory_fault;
 		int8_t reserved1[256];
 	};
 
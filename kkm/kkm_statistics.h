@@ -25,6 +25,21 @@ struct kkm_statistics {
 	atomic64_t failed_page_fault_count;
 	atomic64_t page_fault_time_ns;
 	atomic64_t system_call_count;
+	atomic64_t sysret_entry_count;
+	atomic64_t kontainer_pool_hit_count;
+	atomic64_t kontainer_pool_miss_count;
+	atomic64_t kontainer_clone_count;
+	atomic64_t lazy_fault_count;
+	atomic64_t async_page_fault_count;
+	atomic64_t direct_io_count;
+	atomic64_t direct_io_fallback_count;
+	atomic64_t switchless_count;
+	atomic64_t switchless_fallback_count;
+	atomic64_t kontainer_destroy_count;
+	atomic64_t kontainer_recycle_count;
+	atomic64_t rseq_abort_count;
+	atomic64_t reflected_page_fault_count;
+	atomic64_t exception_page_fault_count;
 };
 
 extern struct kkm_statistics kkm_stat;
@@ -40,6 +55,21 @@ static inline void kkm_statistics_init(void)
 	atomic64_set(&kkm_stat.failed_page_fault_count, 0);
 	atomic64_set(&kkm_stat.page_fault_time_ns, 0);
 	atomic64_set(&kkm_stat.system_call_count, 0);
+	atomic64_set(&kkm_stat.sysret_entry_count, 0);
+	atomic64_set(&kkm_stat.kontainer_pool_hit_count, 0);
+	atomic64_set(&kkm_stat.kontainer_pool_miss_count, 0);
+	atomic64_set(&kkm_stat.kontainer_clone_count, 0);
+	atomic64_set(&kkm_stat.lazy_fault_count, 0);
+	atomic64_set(&kkm_stat.async_page_fault_count, 0);
+	atomic64_set(&kkm_stat.direct_io_count, 0);
+	atomic64_set(&kkm_stat.direct_io_fallback_count, 0);
+	atomic64_set(&kkm_stat.switchless_count, 0);
+	atomic64_set(&kkm_stat.switchless_fallback_count, 0);
+	atomic64_set(&kkm_stat.kontainer_destroy_count, 0);
+	atomic64_set(&kkm_stat.kontainer_recycle_count, 0);
+	atomic64_set(&kkm_stat.rseq_abort_count, 0);
+	atomic64_set(&kkm_stat.reflected_page_fault_count, 0);
+	atomic64_set(&kkm_stat.exception_page_fault_count, 0);
 }
 
 static inline int kkm_statistics_show(char *s)
@@ -53,7 +83,22 @@ static inline int kkm_statistics_show(char *s)
 		       "page faults\t: %lld\n"
 		       "failed page faults\t: %lld\n"
 		       "page fault time ns\t: %lld\n"
-		       "system calls\t: %lld\n",
+		       "system calls\t: %lld\n"
+		       "sysret entries\t: %lld\n"
+		       "kontainer pool hits\t: %lld\n"
+		       "kontainer pool misses\t: %lld\n"
+		       "kontainer clones\t: %lld\n"
+		       "lazy memory faults\t: %lld\n"
+		       "async page faults\t: %lld\n"
+		       "direct io hypercalls\t: %lld\n"
+		       "direct io fallbacks\t: %lld\n"
+		       "switchless hypercalls\t: %lld\n"
+		       "switchless fallbacks\t: %lld\n"
+		       "kontainers destroyed\t: %lld\n"
+		       "kontainers recycled\t: %lld\n"
+		       "rseq aborts\t: %lld\n"
+		       "page faults reflected to payload\t: %lld\n"
+		       "page faults reported as exceptions\t: %lld\n",
 		       atomic64_read(&kkm_stat.kontainer_count),
 		       atomic64_read(&kkm_stat.kontext_count),
 		       atomic64_read(&kkm_stat.intr_count),
@@ -62,7 +107,22 @@ static inline int kkm_statistics_show(char *s)
 		       atomic64_read(&kkm_stat.page_fault_count),
 		       atomic64_read(&kkm_stat.failed_page_fault_count),
 		       atomic64_read(&kkm_stat.page_fault_time_ns),
-		       atomic64_read(&kkm_stat.system_call_count));
+		       atomic64_read(&kkm_stat.system_call_count),
+		       atomic64_read(&kkm_stat.sysret_entry_count),
+		       atomic64_read(&kkm_stat.kontainer_pool_hit_count),
+		       atomic64_read(&kkm_stat.kontainer_pool_miss_count),
+		       atomic64_read(&kkm_stat.kontainer_clone_count),
+		       atomic64_read(&kkm_stat.lazy_fault_count),
+		       atomic64_read(&kkm_stat.async_page_fault_count),
+		       atomic64_read(&kkm_stat.direct_io_count),
+		       atomic64_read(&kkm_stat.direct_io_fallback_count),
+		       atomic64_read(&kkm_stat.switchless_count),
+		       atomic64_read(&kkm_stat.switchless_fallback_count),
+		       atomic64_read(&kkm_stat.kontainer_destroy_count),
+		       atomic64_read(&kkm_stat.kontainer_recycle_count),
+		       atomic64_read(&kkm_stat.rseq_abort_count),
+		       atomic64_read(&kkm_stat.reflected_page_fault_count),
+		       atomic64_read(&kkm_stat.exception_page_fault_count));
 }
 
 static inline void kkm_statistics_kontainer_count_inc(void)
@@ -110,4 +170,79 @@ static inline void kkm_statistics_system_call_count_inc(void)
 	atomic64_inc(&kkm_stat.system_call_count);
 }
 
+static inline void kkm_statistics_sysret_entry_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.sysret_entry_count);
+}
+
+static inline void kkm_statistics_kontainer_pool_hit_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.kontainer_pool_hit_count);
+}
+
+static inline void kkm_statistics_kontainer_pool_miss_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.kontainer_pool_miss_count);
+}
+
+static inline void kkm_statistics_kontainer_clone_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.kontainer_clone_count);
+}
+
+static inline void kkm_statistics_lazy_fault_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.lazy_fault_count);
+}
+
+static inline void kkm_statistics_async_page_fault_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.async_page_fault_count);
+}
+
+static inline void kkm_statistics_direct_io_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.direct_io_count);
+}
+
+static inline void kkm_statistics_direct_io_fallback_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.direct_io_fallback_count);
+}
+
+static inline void kkm_statistics_switchless_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.switchless_count);
+}
+
+static inline void kkm_statistics_switchless_fallback_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.switchless_fallback_count);
+}
+
+static inline void kkm_statistics_kontainer_destroy_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.kontainer_destroy_count);
+}
+
+static inline void kkm_statistics_kontainer_recycle_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.kontainer_recycle_count);
+}
+
+static inline void kkm_statistics_rseq_abort_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.rseq_abort_count);
+}
+
+static inline void kkm_statistics_reflected_page_fault_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.reflected_page_fault_count);
+}
+
+static inline void kkm_statistics_exception_page_fault_count_inc(void)
+{
+	atomic64_inc(&kkm_stat.exception_page_fault_count);
+}
+
 #endif /* __KKM_STATISTICS_H__ */
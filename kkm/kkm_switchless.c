@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_switchless.h"
+#include "kkm_statistics.h"
+
+/*
+ * hypercalls can be handed to a polling monitor worker
+ * through kontext switchless map page
+ */
+static bool __read_mostly switchless = true;
+module_param(switchless, bool, S_IRUGO | S_IWUSR);
+
+static uint __read_mostly switchless_spin_max_ns = KKM_SWITCHLESS_SPIN_MAX_NS;
+module_param(switchless_spin_max_ns, uint, S_IRUGO | S_IWUSR);
+
+void kkm_switchless_init(struct kkm_kontext *kkm_kontext)
+{
+	kkm_kontext->switchless.spin_ns = 0;
+	memset(kkm_kontext->switchless.hypercalls, 0,
+	       sizeof(kkm_kontext->switchless.hypercalls));
+}
+
+/*
+ * KKM_KONTEXT_SET_SWITCHLESS
+ * spin_ns 0 disables, slot page is allocated here so kkm
+ * never has to allocate it in hypercall path
+ */
+int kkm_switchless_set(struct kkm_kontext *kkm_kontext,
+		       struct kkm_switchless *sl)
+{
+	if (sl->flags != 0) {
+		return -EINVAL;
+	}
+
+	if (sl->spin_ns == 0) {
+		kkm_switchless_init(kkm_kontext);
+		return 0;
+	}
+
+	if (kkm_kontext_map_page(kkm_kontext,
+				 KKM_CONTEXT_MAP_SWITCHLESS_PAGE) == 0) {
+		return -ENOMEM;
+	}
+
+	memcpy(kkm_kontext->switchless.hypercalls, sl->hypercalls,
+	       sizeof(kkm_kontext->switchless.hypercalls));
+	kkm_kontext->switchless.spin_ns = sl->spin_ns;
+	return 0;
+}
+
+/*
+ * hand hypercall to monitor worker and poll for completion
+ * args_gva is guest address of kkm_hc_args already setup for monitor.
+ * returns true when worker completed the hypercall,
+ * false to exit to monitor.
+ *
+ * slot states
+ *     IDLE -> POSTED by kkm
+ *     POSTED -> BUSY by worker when it starts hypercall
+ *     BUSY -> DONE by worker when ret_val is in kkm_hc_args
+ *     DONE -> IDLE by kkm
+ *     POSTED -> IDLE by kkm on timeout, monitor runs hypercall
+ * exit with slot BUSY or DONE means worker owns the hypercall,
+ * monitor waits for DONE, sets IDLE and doesn't run it again.
+ */
+bool kkm_switchless_hypercall(struct kkm_kontext *kkm_kontext,
+			      struct kkm_guest_area *ga, uint64_t args_gva)
+{
+	struct kkm_switchless_slot *slot = NULL;
+	uint64_t spin_ns = 0;
+	uint64_t start_time = 0;
+	uint64_t hc = ga->regs.rax;
+	uint32_t state = 0;
+
+	spin_ns = min_t(uint64_t, kkm_kontext->switchless.spin_ns,
+			switchless_spin_max_ns);
+	if (switchless == false || spin_ns == 0) {
+		return false;
+	}
+	if (hc >= KKM_SWITCHLESS_HYPERCALL_MAX ||
+	    (kkm_kontext->switchless.hypercalls[hc / 64] & (1ULL << (hc % 64))) ==
+		    0) {
+		return false;
+	}
+
+	slot = (struct kkm_switchless_slot *)kkm_kontext
+		       ->mmap_area[KKM_CONTEXT_MAP_SWITCHLESS_PAGE]
+		       .kvaddr;
+	if (slot == NULL || READ_ONCE(slot->worker_active) == 0 ||
+	    READ_ONCE(slot->state) != KKM_SWITCHLESS_IDLE) {
+		return false;
+	}
+
+	WRITE_ONCE(slot->hypercall, hc);
+	WRITE_ONCE(slot->args, args_gva);
+	smp_store_release(&slot->state, KKM_SWITCHLESS_POSTED);
+
+	start_time = ktime_get_ns();
+	for (;;) {
+		state = smp_load_acquire(&slot->state);
+		if (state == KKM_SWITCHLESS_DONE) {
+			goto done;
+		}
+		if (ktime_get_ns() - start_time >= spin_ns || need_resched() ||
+		    signal_pending(current)) {
+			break;
+		}
+		cpu_relax();
+	}
+
+	/*
+	 * take hypercall back if worker didn't pick it up
+	 */
+	state = cmpxchg(&slot->state, KKM_SWITCHLESS_POSTED,
+			KKM_SWITCHLESS_IDLE);
+	if (state == KKM_SWITCHLESS_DONE) {
+		goto done;
+	}
+
+	/* statistics */
+	kkm_statistics_switchless_fallback_count_inc();
+	return false;
+
+done:
+	smp_store_release(&slot->state, KKM_SWITCHLESS_IDLE);
+
+	/* statistics */
+	kkm_statistics_switchless_count_inc();
+	return true;
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_SWITCHLESS_H__
+#define __KKM_SWITCHLESS_H__
+
+/*
+ * default for switchless_spin_max_ns module parameter
+ * upper limit for time a kontext waits for monitor worker
+ */
+#define KKM_SWITCHLESS_SPIN_MAX_NS (50000)
+
+struct kkm_kontext;
+struct kkm_guest_area;
+struct kkm_switchless;
+
+/*
+ * switchless hypercall setup of a kontext, KKM_KONTEXT_SET_SWITCHLESS
+ */
+struct kkm_switchless_state {
+	uint64_t spin_ns; /* 0 when switchless hypercalls are disabled */
+	uint64_t hypercalls[KKM_SWITCHLESS_HYPERCALL_WORDS];
+};
+
+void kkm_switchless_init(struct kkm_kontext *kkm_kontext);
+int kkm_switchless_set(struct kkm_kontext *kkm_kontext,
+		       struct kkm_switchless *sl);
+bool kkm_switchless_hypercall(struct kkm_kontext *kkm_kontext,
+			      struct kkm_guest_area *ga, uint64_t args_gva);
+
+#endif /* __KKM_SWITCHLESS_H__ */
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <asm/tlbflush.h>
+#include <asm/traps.h>
+
+#include "kkm.h"
+#include "kkm_kontext.h"
+#include "kkm_idt.h"
+#include "kkm_tlb.h"
+
+static bool __read_mostly lazy_flush_tlb = true;
+module_param(lazy_flush_tlb, bool, S_IRUGO | S_IWUSR);
+
+static uint __read_mostly tlb_range_flush_max = KKM_TLB_RANGE_FLUSH_MAX;
+module_param(tlb_range_flush_max, uint, S_IRUGO | S_IWUSR);
+
+/*
+ * state of guest PCIDs on this physical cpu
+ * recorded when guest TLB entries were last known to be valid
+ */
+struct kkm_guest_tlb_state {
+	uint64_t kontext_id; /* last kontext run on this cpu */
+	uint64_t mm_tlb_gen; /* monitor mm tlb generation */
+	uint64_t kkm_tlb_gen; /* kontainer page table generation */
+};
+DEFINE_PER_CPU(struct kkm_guest_tlb_state, guest_tlb_state);
+
+DEFINE_PER_CPU(struct kkm_tlb_stats, kkm_tlb_stats);
+
+/*
+ * guest TLB entries tagged with guest PCIDs can be reused when
+ * this kontext was the last one on this cpu(kx guest area mapping is
+ * per cpu) and neither monitor nor kkm page tables changed since.
+ * called with interrupts disabled.
+ */
+static bool kkm_tlb_guest_valid(struct kkm_kontext *kkm_kontext, int cpu)
+{
+	struct kkm_guest_tlb_state *ts = &per_cpu(guest_tlb_state, cpu);
+	struct kkm *kkm = kkm_kontext->kkm;
+
+	if (ts->kontext_id != kkm_kontext->id) {
+		return false;
+	}
+	if (ts->mm_tlb_gen != atomic64_read(&kkm->mm->context.tlb_gen)) {
+		return false;
+	}
+	if (ts->kkm_tlb_gen != atomic64_read(&kkm->tlb_gen)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * record state of guest PCIDs after they are flushed
+ */
+static void kkm_tlb_guest_save(struct kkm_kontext *kkm_kontext, int cpu)
+{
+	struct kkm_guest_tlb_state *ts = &per_cpu(guest_tlb_state, cpu);
+	struct kkm *kkm = kkm_kontext->kkm;
+
+	ts->kontext_id = kkm_kontext->id;
+	ts->mm_tlb_gen = atomic64_read(&kkm->mm->context.tlb_gen);
+	ts->kkm_tlb_gen = atomic64_read(&kkm->tlb_gen);
+}
+
+/*
+ * invalidate queued pages on this cpu
+ */
+static void kkm_tlb_flush_pending(struct kkm_tlb_run *run,
+				  struct kkm_tlb_stats *stats)
+{
+	uint64_t i = 0;
+
+	for (i = 0; i < run->pending_count; i++) {
+		kkm_mmu_flush_tlb_one_page(run->pending_addr[i]);
+	}
+	stats->page_flush += run->pending_count;
+}
+
+/*
+ * decide guest TLB handling for this entry
+ * sets cr3 no flush bit in guest area
+ * called with interrupts disabled, before ga->cpu is updated
+ */
+void kkm_tlb_guest_entry(struct kkm_kontext *kkm_kontext, int cpu)
+{
+	struct kkm *kkm = kkm_kontext->kkm;
+	struct kkm_guest_area *ga =
+		(struct kkm_guest_area *)kkm_kontext->guest_area;
+	struct kkm_tlb_stats *stats = &per_cpu(kkm_tlb_stats, cpu);
+	struct kkm_tlb_run *run = &kkm_kontext->tlb_run;
+
+	ga->guest_payload_cr3 &= ~KKM_CR3_NOFLUSH;
+
+	if (kkm_cpu_full_tlb_flush == false) {
+		if ((lazy_flush_tlb == false) || (cpu != ga->cpu) ||
+		    (kkm->id != kkm_idt_get_id(cpu)) ||
+		    (run->full_flush_pending == true) ||
+		    (kkm_tlb_guest_valid(kkm_kontext, cpu) == false)) {
+			/*
+			 * invalidate older TLB entries
+			 */
+			kkm_mmu_flush_tlb();
+			kkm_tlb_guest_save(kkm_kontext, cpu);
+			stats->full_flush++;
+		} else if (run->pending_count != 0) {
+			kkm_tlb_flush_pending(run, stats);
+		}
+		run->pending_count = 0;
+		run->full_flush_pending = false;
+
+		/*
+		 * guest PCID entries are valid at this point,
+		 * dont let cr3 load on entry invalidate them
+		 */
+		ga->guest_payload_cr3 |= KKM_CR3_NOFLUSH;
+		return;
+	}
+
+	/*
+	 * non PCID hosts: cr3 loads flush all guest entries,
+	 * none of them are global
+	 */
+	stats->implicit_cr3_flush++;
+}
+
+/*
+ * guest translation for addr changed
+ * queue it for invalidation on next guest entry,
+ * fold the queue into one full flush when it gets too long
+ */
+void kkm_tlb_invalidate_page(struct kkm_kontext *kkm_kontext, uint64_t addr)
+{
+	struct kkm_tlb_run *run = &kkm_kontext->tlb_run;
+	uint64_t pending_max = min_t(uint64_t, tlb_range_flush_max,
+				     KKM_TLB_PENDING_MAX);
+
+	/*
+	 * cr3 load on guest entry invalidates non global entries
+	 */
+	if (kkm_cpu_full_tlb_flush == true) {
+		return;
+	}
+
+	if (run->full_flush_pending == true) {
+		return;
+	}
+
+	if (run->pending_count >= pending_max) {
+		run->full_flush_pending = true;
+		run->pending_count = 0;
+		this_cpu_inc(kkm_tlb_stats.deferred_flush);
+		return;
+	}
+
+	run->pending_addr[run->pending_count] = addr;
+	run->pending_count++;
+}
+
+/*
+ * guest page fault at addr is resolved
+ * hardware doesn't cache not present translations,
+ * only protection faults can leave a stale entry behind
+ */
+void kkm_tlb_fault_resolved(struct kkm_kontext *kkm_kontext, uint64_t addr,
+			    uint64_t error_code)
+{
+	if ((error_code & X86_PF_PROT) == 0) {
+		this_cpu_inc(kkm_tlb_stats.skipped_flush);
+		return;
+	}
+	kkm_tlb_invalidate_page(kkm_kontext, addr);
+}
+
+void kkm_tlb_statistics_init(void)
+{
+	int cpu = -1;
+
+	for_each_possible_cpu (cpu) {
+		memset(&per_cpu(kkm_tlb_stats, cpu), 0,
+		       sizeof(struct kkm_tlb_stats));
+	}
+}
+
+int kkm_tlb_statistics_show(char *s)
+{
+	int cpu = -1;
+	struct kkm_tlb_stats *stats = NULL;
+	struct kkm_tlb_stats total = { 0 };
+
+	for_each_possible_cpu (cpu) {
+		stats = &per_cpu(kkm_tlb_stats, cpu);
+		total.full_flush += stats->full_flush;
+		total.page_flush += stats->page_flush;
+		total.implicit_cr3_flush += stats->implicit_cr3_flush;
+		total.deferred_flush += stats->deferred_flush;
+		total.skipped_flush += stats->skipped_flush;
+	}
+
+	return sprintf(s,
+		       "tlb full flushes\t: %llu\n"
+		       "tlb page flushes\t: %llu\n"
+		       "tlb implicit cr3 flushes\t: %llu\n"
+		       "tlb deferred flushes\t: %llu\n"
+		       "tlb skipped page flushes\t: %llu\n",
+		       total.full_flush, total.page_flush,
+		       total.implicit_cr3_flush, total.deferred_flush,
+		       total.skipped_flush);
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Kontain Kernel Module
+ *
+ * This module enables Kontain unikernel in absence of
+ * hardware support for virtualization
+ *
+ * Copyright (C) 2020-2021 Kontain Inc.
+ *
+ * Authors:
+ *  Srinivasa Vetsa <svetsa@kontain.app>
+ *
+ */
+
+#ifndef __KKM_TLB_H__
+#define __KKM_TLB_H__
+
+/*
+ * default for tlb_range_flush_max module parameter
+ * queued pages invalidated one at a time on guest entry,
+ * more than this switches to one full guest PCID flush
+ */
+#define KKM_TLB_RANGE_FLUSH_MAX (16)
+
+/*
+ * upper limit for tlb_range_flush_max
+ */
+#define KKM_TLB_PENDING_MAX (32)
+
+struct kkm_kontext;
+
+/*
+ * guest TLB invalidations of a kontext waiting for next guest entry
+ */
+struct kkm_tlb_run {
+	uint64_t pending_count; /* queued page invalidations */
+	uint64_t pending_addr[KKM_TLB_PENDING_MAX];
+	bool full_flush_pending; /* flush guest PCIDs before next entry */
+};
+
+/*
+ * per cpu guest TLB management counters
+ */
+struct kkm_tlb_stats {
+	uint64_t full_flush; /* INVPCID single context for guest PCIDs */
+	uint64_t page_flush; /* INVPCID single address for guest PCIDs */
+	uint64_t implicit_cr3_flush; /* guest entry cr3 load flushed TLB */
+	uint64_t deferred_flush; /* page invalidations folded into full flush */
+	uint64_t skipped_flush; /* not present to present, nothing cached */
+};
+
+void kkm_tlb_guest_entry(struct kkm_kontext *kkm_kontext, int cpu);
+void kkm_tlb_invalidate_page(struct kkm_kontext *kkm_kontext, uint64_t addr);
+void kkm_tlb_fault_resolved(struct kkm_kontext *kkm_kontext, uint64_t addr,
+			    uint64_t error_code);
+
+void kkm_tlb_statistics_init(void);
+int kkm_tlb_statistics_show(char *s);
+
+#endif /* __KKM_TLB_H__ */
@@ -12,6 +12,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
@@ -24,11 +25,99 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
 
 #include "kkm_ioctl.h"
+#include "kkm_run.h"
+#include "kkm_externs.h"
 
 #define MAX_DEVICE_NAME_LEN (32)
 
+/*
+ * payload memory for guest code run by tests
+ * guest va maps to KKM_KM_USER_MEM_BASE + va in monitor
+ */
+#define GUEST_MEM_SLOT (1)
+#define GUEST_MEM_VA (KKM_GUEST_MEM_START_VA)
+#define GUEST_MEM_SIZE (16 * 0x1000ULL)
+#define GUEST_STACK_TOP (GUEST_MEM_VA + GUEST_MEM_SIZE)
+
+#define HYPERCALL_IO_PORT_BASE (0x8000)
+#define TEST_HYPERCALL_PORT (0x10)
+
+#define BENCH_DEFAULT_EXITS (1000000)
+
+/*
+ * lazily populated payload memory, populated by test on memory fault exit
+ */
+#define LAZY_MEM_SLOT (2)
+#define LAZY_MEM_VA (GUEST_MEM_VA + 0x100000)
+#define LAZY_MEM_SIZE (4 * 0x1000ULL)
+#define LAZY_PATTERN (0x6b6b6b6b6b6b6b6bULL)
+
+/*
+ * payload memory in second pml4 entry, guest sees it in top portion
+ * of guest address space
+ */
+#define HIGH_MEM_SLOT (3)
+#define HIGH_MEM_GPA (KKM_GUEST_PML4_ENTRY_SIZE)
+#define HIGH_PATTERN (0x5a5a5a5a5a5a5a5aULL)
+
+/*
+ * never accessible payload address
+ */
+#define FAULT_MEM_VA (GUEST_MEM_VA + 0x200000)
+/*
+ * fault handler alternate stack in payload memory
+ */
+#define FAULT_ALT_STACK_VA (GUEST_MEM_VA + 0x8000)
+#define FAULT_ALT_STACK_SIZE (0x1000)
+#define X86_TRAP_PF (14)
+#define X86_PF_USER (1 << 2)
+
+/*
+ * rseq area in payload memory, code is at offset 0
+ */
+#define RSEQ_OFFSET (0x2000)
+#define RSEQ_TEST_SIG (0x53053053)
+
+/*
+ * guest read(2) buffer in payload memory
+ */
+#define DIRECT_IO_OFFSET (0x3000)
+#define DIRECT_IO_GUEST_FD (7)
+/*
+ * gs.base points here, syscall exit stores hypercall args gva
+ */
+#define DIRECT_IO_HC_PTR_OFFSET (0x3800)
+#define DIRECT_IO_LAZY_VA (LAZY_MEM_VA + 0x1000)
+#define DIRECT_IO_LAZY_RET (0x5a)
+
+#define PERF_TEST_RUNS (16)
+
+#define TEST_KONTEXT_INDEX (0)
+#define RUN_KONTEXT_RUNS (100000)
+
+uint32_t kkm_guest_pml4_count = 1;
+
+static int test_failures;
+
+#define CHECK(cond, ...)                                                     \
+	do {                                                                 \
+		if (!(cond)) {                                               \
+			printf("FAIL %s:%d: ", __func__, __LINE__);          \
+			printf(__VA_ARGS__);                                 \
+			printf("\n");                                        \
+			test_failures++;                                     \
+		}                                                            \
+	} while (0)
+
 typedef struct {
 	char device_name[MAX_DEVICE_NAME_LEN];
 	int root_device_fd;
@@ -38,6 +127,8 @@ typedef struct {
 	int kontain_device_fd;
 	int context_map_size;
 	int context_device_fd;
+	struct kkm_run *run;
+	uint8_t *guest_mem;
 } kkm_t;
 
 kkm_t kkm;
@@ -191,14 +282,1039 @@ error:
 	return;
 }
 
-int main()
+/*
+ * map payload memory and kontext run area, register payload memory
+ */
+int setup_guest(kkm_t *kkm)
+{
+	struct kkm_memory_region mm;
+	void *addr = NULL;
+
+	addr = mmap((void *)(KKM_KM_USER_MEM_BASE + GUEST_MEM_VA),
+		    GUEST_MEM_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE |
+			    MAP_POPULATE,
+		    -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap guest memory:");
+		return -1;
+	}
+	kkm->guest_mem = addr;
+
+	mm.slot = GUEST_MEM_SLOT;
+	mm.flags = 0;
+	mm.guest_phys_addr = GUEST_MEM_VA;
+	mm.memory_size = GUEST_MEM_SIZE;
+	mm.userspace_addr = KKM_KM_USER_MEM_BASE + GUEST_MEM_VA;
+	if (ioctl(kkm->kontain_device_fd, KKM_MEMORY, &mm) < 0) {
+		perror("ioctl KKM_MEMORY:");
+		return -1;
+	}
+
+	addr = mmap(NULL, kkm->context_map_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, kkm->context_device_fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap kontext:");
+		return -1;
+	}
+	kkm->run = addr;
+	return 0;
+}
+
+/*
+ * copy code to start of payload memory, payload starts there
+ * with stack at end of payload memory
+ */
+int load_guest(kkm_t *kkm, const uint8_t *code, size_t len)
+{
+	struct kkm_regs regs;
+
+	memcpy(kkm->guest_mem, code, len);
+
+	memset(&regs, 0, sizeof(struct kkm_regs));
+	regs.rip = GUEST_MEM_VA;
+	regs.rsp = GUEST_STACK_TOP;
+	regs.rflags = 0x2;
+	regs.rdx = TEST_HYPERCALL_PORT;
+	if (ioctl(kkm->context_device_fd, KKM_SET_REGS, &regs) < 0) {
+		perror("ioctl KKM_SET_REGS:");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * out %eax, (%dx)
+ * jmp to out
+ * every iteration is one hypercall exit
+ */
+static const uint8_t hypercall_loop_code[] = { 0xef, 0xeb, 0xfd };
+
+/*
+ * mov (%rbx), %rax
+ * out %eax, (%dx)
+ * jmp to mov
+ * every iteration loads from rbx and exits with loaded value in rax
+ */
+static const uint8_t load_loop_code[] = { 0x48, 0x8b, 0x03, 0xef, 0xeb, 0xfa };
+
+/*
+ * syscall
+ * mov $TEST_HYPERCALL_PORT, %edx
+ * out %eax, (%dx)
+ * jmp to syscall
+ * exits with syscall return value in rax
+ */
+static const uint8_t syscall_code[] = { 0x0f, 0x05, 0xba, TEST_HYPERCALL_PORT,
+					0x00, 0x00, 0x00, 0xef,
+					0xeb, 0xf6 };
+
+static int run_guest(kkm_t *kkm)
+{
+	if (ioctl(kkm->context_device_fd, KKM_RUN, NULL) < 0) {
+		perror("ioctl KKM_RUN:");
+		return -1;
+	}
+	return 0;
+}
+
+static int set_guest_rbx(kkm_t *kkm, uint64_t rbx)
+{
+	struct kkm_regs regs;
+
+	if (ioctl(kkm->context_device_fd, KKM_GET_REGS, &regs) < 0) {
+		perror("ioctl KKM_GET_REGS:");
+		return -1;
+	}
+	regs.rbx = rbx;
+	if (ioctl(kkm->context_device_fd, KKM_SET_REGS, &regs) < 0) {
+		perror("ioctl KKM_SET_REGS:");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t get_guest_rax(kkm_t *kkm)
+{
+	struct kkm_regs regs;
+
+	memset(&regs, 0, sizeof(struct kkm_regs));
+	ioctl(kkm->context_device_fd, KKM_GET_REGS, &regs);
+	return regs.rax;
+}
+
+/*
+ * first touch of lazy page exits with KKM_EXIT_MEMORY_FAULT,
+ * page populated by km and then evicted is faulted back in
+ * without another memory fault exit
+ */
+int test_lazy_fault(kkm_t *kkm)
+{
+	struct kkm_memory_region mm;
+	uint64_t *page = NULL;
+	unsigned char resident = 0;
+
+	page = mmap((void *)(KKM_KM_USER_MEM_BASE + LAZY_MEM_VA),
+		    LAZY_MEM_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (page == MAP_FAILED) {
+		perror("mmap lazy memory:");
+		return -1;
+	}
+
+	mm.slot = LAZY_MEM_SLOT;
+	mm.flags = KKM_MEM_LAZY_POPULATE;
+	mm.guest_phys_addr = LAZY_MEM_VA;
+	mm.memory_size = LAZY_MEM_SIZE;
+	mm.userspace_addr = KKM_KM_USER_MEM_BASE + LAZY_MEM_VA;
+	if (ioctl(kkm->kontain_device_fd, KKM_MEMORY, &mm) < 0) {
+		perror("ioctl KKM_MEMORY lazy:");
+		return -1;
+	}
+
+	if (load_guest(kkm, load_loop_code, sizeof(load_loop_code)) != 0 ||
+	    set_guest_rbx(kkm, LAZY_MEM_VA) != 0) {
+		return -1;
+	}
+
+	/* never populated page is reported */
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_MEMORY_FAULT,
+	      "exit reason %u expected memory fault", kkm->run->exit_reason);
+	CHECK(kkm->run->memory_fault.flags == KKM_MEMORY_EXIT_FLAG_LAZY,
+	      "flags %lx", kkm->run->memory_fault.flags);
+	CHECK(kkm->run->memory_fault.gpa == LAZY_MEM_VA, "gpa %lx",
+	      kkm->run->memory_fault.gpa);
+	CHECK(kkm->run->memory_fault.slot == LAZY_MEM_SLOT, "slot %u",
+	      kkm->run->memory_fault.slot);
+
+	/* km fill */
+	*page = LAZY_PATTERN;
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(get_guest_rax(kkm) == LAZY_PATTERN, "rax %lx",
+	      get_guest_rax(kkm));
+
+	/* evict populated page, it is not reported again */
+	if (madvise(page, 0x1000, MADV_PAGEOUT) != 0) {
+		perror("madvise MADV_PAGEOUT:");
+	}
+	mincore(page, 0x1000, &resident);
+	printf("lazy page %s\n",
+	       (resident & 1) ? "still resident (no swap?)" : "evicted");
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u after eviction expected io",
+	      kkm->run->exit_reason);
+	CHECK(get_guest_rax(kkm) == LAZY_PATTERN, "rax %lx after eviction",
+	      get_guest_rax(kkm));
+	return 0;
+}
+
+/*
+ * 5 level paging gives addresses above 128TB for hints above 47 bits
+ */
+static int paging_levels(void)
 {
-	init(&kkm);
+	void *addr = NULL;
+	int levels = 4;
+
+	addr = mmap((void *)(1ULL << 48), 0x1000, PROT_READ,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		return levels;
+	}
+	if ((uint64_t)addr >= (1ULL << 47)) {
+		levels = 5;
+	}
+	munmap(addr, 0x1000);
+	return levels;
+}
+
+/*
+ * monitor pml4 entry for high memory is populated after guest page tables
+ * were synced, guest access picks it up from page fault path.
+ * needs guest_pml4_entries module parameter > 1,
+ * run on 4 and 5 level paging hosts.
+ */
+int test_payload_pml4_sync(kkm_t *kkm)
+{
+	struct kkm_memory_region mm;
+	uint64_t pattern = HIGH_PATTERN;
+	void *addr = NULL;
+	int count = 0;
+	int fd = -1;
+
+	count = ioctl(kkm->root_device_fd, KKM_CHECK_EXTENSION,
+		      KKM_CAP_GUEST_PML4_ENTRIES);
+	if (count < 2) {
+		printf("payload pml4 sync : guest_pml4_entries %d, skipped\n",
+		       count);
+		return 0;
+	}
+	kkm_guest_pml4_count = count;
+	printf("payload pml4 sync : %d level paging\n", paging_levels());
+
+	/* page contents come from page cache, monitor entry stays empty */
+	fd = memfd_create("test_kkm", 0);
+	if (fd < 0 || ftruncate(fd, 0x1000) != 0 ||
+	    pwrite(fd, &pattern, sizeof(uint64_t), 0) != sizeof(uint64_t)) {
+		perror("memfd:");
+		return -1;
+	}
+	addr = mmap((void *)(KKM_KM_USER_MEM_BASE + HIGH_MEM_GPA), 0x1000,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+		    fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		perror("mmap high memory:");
+		return -1;
+	}
+
+	mm.slot = HIGH_MEM_SLOT;
+	mm.flags = 0;
+	mm.guest_phys_addr = HIGH_MEM_GPA;
+	mm.memory_size = 0x1000;
+	mm.userspace_addr = KKM_KM_USER_MEM_BASE + HIGH_MEM_GPA;
+	if (ioctl(kkm->kontain_device_fd, KKM_MEMORY, &mm) < 0) {
+		perror("ioctl KKM_MEMORY high:");
+		return -1;
+	}
+
+	if (load_guest(kkm, load_loop_code, sizeof(load_loop_code)) != 0 ||
+	    set_guest_rbx(kkm, HIGH_MEM_GPA + KKM_GUEST_VA_OFFSET) != 0) {
+		return -1;
+	}
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(get_guest_rax(kkm) == HIGH_PATTERN, "rax %lx",
+	      get_guest_rax(kkm));
+
+	/* entry stays synced for next access */
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(get_guest_rax(kkm) == HIGH_PATTERN, "rax %lx",
+	      get_guest_rax(kkm));
+	return 0;
+}
+
+static int get_guest_regs(kkm_t *kkm, struct kkm_regs *regs)
+{
+	if (ioctl(kkm->context_device_fd, KKM_GET_REGS, regs) < 0) {
+		perror("ioctl KKM_GET_REGS:");
+		return -1;
+	}
+	return 0;
+}
+
+static int set_guest_regs(kkm_t *kkm, struct kkm_regs *regs)
+{
+	if (ioctl(kkm->context_device_fd, KKM_SET_REGS, regs) < 0) {
+		perror("ioctl KKM_SET_REGS:");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * unresolved payload fault fails KKM_RUN with EFAULT,
+ * KKM_FAULT_FLAG_EXIT turns it into KKM_EXIT_EXCEPTION,
+ * reflect frame that doesn't fit in alternate stack exits too
+ */
+int test_fault_handler(kkm_t *kkm)
+{
+	struct kkm_fault_handler fh;
+	struct kkm_sregs sregs;
+	struct kkm_regs regs;
+	void *addr = NULL;
+
+	/* reserved, never accessible monitor memory */
+	addr = mmap((void *)(KKM_KM_USER_MEM_BASE + FAULT_MEM_VA), 0x1000,
+		    PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap fault memory:");
+		return -1;
+	}
+
+	memset(&fh, 0, sizeof(struct kkm_fault_handler));
+	fh.flags = 1U << 7;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_FAULT_HANDLER,
+		    &fh) < 0 && errno == EINVAL,
+	      "unknown flag accepted");
+	fh.flags = KKM_FAULT_FLAG_REFLECT;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_FAULT_HANDLER,
+		    &fh) < 0 && errno == EINVAL,
+	      "reflect without handler accepted");
+	fh.flags = KKM_FAULT_FLAG_EXIT;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_FAULT_HANDLER,
+		    &fh) == 0,
+	      "set exit failed errno %d", errno);
+
+	if (load_guest(kkm, load_loop_code, sizeof(load_loop_code)) != 0 ||
+	    set_guest_rbx(kkm, FAULT_MEM_VA) != 0 || run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_EXCEPTION,
+	      "exit reason %u expected exception", kkm->run->exit_reason);
+	CHECK(kkm->run->ex.exception == X86_TRAP_PF, "exception %u",
+	      kkm->run->ex.exception);
+	CHECK((kkm->run->ex.error_code & X86_PF_USER) != 0, "error code %x",
+	      kkm->run->ex.error_code);
+	memset(&sregs, 0, sizeof(struct kkm_sregs));
+	ioctl(kkm->context_device_fd, KKM_GET_SREGS, &sregs);
+	CHECK(sregs.cr2 == FAULT_MEM_VA, "cr2 %lx", sregs.cr2);
+
+	/* rsp near bottom of alternate stack, frame doesn't fit, exits */
+	fh.flags = KKM_FAULT_FLAG_REFLECT;
+	fh.handler = GUEST_MEM_VA;
+	fh.stack = FAULT_ALT_STACK_VA;
+	fh.stack_size = FAULT_ALT_STACK_SIZE;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_FAULT_HANDLER,
+		    &fh) == 0,
+	      "set reflect failed errno %d", errno);
+	if (load_guest(kkm, load_loop_code, sizeof(load_loop_code)) != 0 ||
+	    set_guest_rbx(kkm, FAULT_MEM_VA) != 0) {
+		return -1;
+	}
+	if (ioctl(kkm->context_device_fd, KKM_GET_REGS, &regs) < 0) {
+		perror("ioctl KKM_GET_REGS:");
+		return -1;
+	}
+	regs.rsp = FAULT_ALT_STACK_VA + 0x40;
+	if (ioctl(kkm->context_device_fd, KKM_SET_REGS, &regs) < 0) {
+		perror("ioctl KKM_SET_REGS:");
+		return -1;
+	}
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_EXCEPTION,
+	      "exit reason %u expected exception", kkm->run->exit_reason);
+	if (ioctl(kkm->context_device_fd, KKM_GET_REGS, &regs) < 0) {
+		perror("ioctl KKM_GET_REGS:");
+		return -1;
+	}
+	CHECK(regs.rsp == FAULT_ALT_STACK_VA + 0x40, "rsp %lx", regs.rsp);
+
+	/* not opted in */
+	fh.flags = 0;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_FAULT_HANDLER,
+		    &fh) == 0,
+	      "clear failed errno %d", errno);
+	if (load_guest(kkm, load_loop_code, sizeof(load_loop_code)) != 0 ||
+	    set_guest_rbx(kkm, FAULT_MEM_VA) != 0) {
+		return -1;
+	}
+	CHECK(ioctl(kkm->context_device_fd, KKM_RUN, NULL) < 0 &&
+		      errno == EFAULT,
+	      "unresolved fault without handler didn't fail with EFAULT");
+	return 0;
+}
+
+/*
+ * cpu_id of registered rseq area is set before guest entry
+ */
+int test_rseq(kkm_t *kkm)
+{
+	struct kkm_rseq rseq;
+	uint32_t *area = (uint32_t *)(kkm->guest_mem + RSEQ_OFFSET);
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	memset(area, 0xff, 32);
+	memset(&rseq, 0, sizeof(struct kkm_rseq));
+	rseq.rseq = GUEST_MEM_VA + RSEQ_OFFSET + 8;
+	rseq.len = 32;
+	rseq.sig = RSEQ_TEST_SIG;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq) < 0 &&
+		      errno == EINVAL,
+	      "misaligned rseq accepted");
+
+	rseq.rseq = GUEST_MEM_VA + RSEQ_OFFSET;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq) == 0,
+	      "register failed errno %d", errno);
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq) < 0 &&
+		      errno == EBUSY,
+	      "second register didn't fail with EBUSY");
+
+	if (load_guest(kkm, hypercall_loop_code,
+		       sizeof(hypercall_loop_code)) != 0 ||
+	    run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(area[1] < cpus, "cpu_id %u", area[1]);
+	CHECK(area[0] == area[1], "cpu_id_start %u cpu_id %u", area[0],
+	      area[1]);
+
+	rseq.flags = KKM_RSEQ_FLAG_UNREGISTER;
+	rseq.sig = ~RSEQ_TEST_SIG;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq) < 0 &&
+		      errno == EINVAL,
+	      "unregister with wrong signature accepted");
+	rseq.sig = RSEQ_TEST_SIG;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq) == 0,
+	      "unregister failed errno %d", errno);
+	CHECK(area[1] == (uint32_t)-1, "cpu_id %u after unregister",
+	      area[1]);
+	return 0;
+}
+
+/*
+ * counts of payload instructions accumulate in perf page
+ */
+int test_perf(kkm_t *kkm)
+{
+	struct kkm_perf perf;
+	struct kkm_perf_values *pv =
+		(struct kkm_perf_values *)((uint8_t *)kkm->run +
+					   KKM_CONTEXT_MAP_PERF_PAGE * 0x1000);
+	int i = 0;
+
+	memset(&perf, 0, sizeof(struct kkm_perf));
+	perf.count = KKM_PERF_MAX_COUNTERS + 1;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_PERF, &perf) < 0 &&
+		      errno == EINVAL,
+	      "too many counters accepted");
+	perf.count = 1;
+	perf.flags = 1;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_PERF, &perf) < 0 &&
+		      errno == EINVAL,
+	      "flags accepted");
+	perf.flags = 0;
+	perf.counters[0].type = PERF_TYPE_TRACEPOINT;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_PERF, &perf) < 0 &&
+		      errno == EINVAL,
+	      "tracepoint counter accepted");
+
+	perf.counters[0].type = PERF_TYPE_HARDWARE;
+	perf.counters[0].config = PERF_COUNT_HW_INSTRUCTIONS;
+	if (ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_PERF, &perf) < 0) {
+		printf("perf : instructions counter not available errno %d, skipped\n",
+		       errno);
+		return 0;
+	}
+
+	if (load_guest(kkm, hypercall_loop_code,
+		       sizeof(hypercall_loop_code)) != 0) {
+		return -1;
+	}
+	for (i = 0; i < PERF_TEST_RUNS; i++) {
+		if (run_guest(kkm) != 0) {
+			return -1;
+		}
+	}
+	CHECK(pv->count == 1, "count %lu", pv->count);
+	CHECK(pv->runs == PERF_TEST_RUNS, "runs %lu", pv->runs);
+	CHECK(pv->value[0] >= PERF_TEST_RUNS - 1, "instructions %lu",
+	      pv->value[0]);
+
+	perf.count = 0;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_PERF, &perf) == 0,
+	      "detach failed errno %d", errno);
+	return 0;
+}
+
+/*
+ * without monitor worker hypercalls still exit to monitor
+ */
+int test_switchless(kkm_t *kkm)
+{
+	struct kkm_switchless sl;
+	struct kkm_switchless_slot *slot =
+		(struct kkm_switchless_slot *)((uint8_t *)kkm->run +
+					       KKM_CONTEXT_MAP_SWITCHLESS_PAGE *
+						       0x1000);
+
+	memset(&sl, 0, sizeof(struct kkm_switchless));
+	sl.flags = 1;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_SWITCHLESS, &sl) <
+			      0 &&
+		      errno == EINVAL,
+	      "flags accepted");
+
+	sl.flags = 0;
+	sl.spin_ns = 1000;
+	memset(sl.hypercalls, 0xff, sizeof(sl.hypercalls));
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_SWITCHLESS, &sl) ==
+		      0,
+	      "enable failed errno %d", errno);
+
+	if (load_guest(kkm, hypercall_loop_code,
+		       sizeof(hypercall_loop_code)) != 0 ||
+	    run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(kkm->run->io.port ==
+		      (HYPERCALL_IO_PORT_BASE | TEST_HYPERCALL_PORT),
+	      "port %x", kkm->run->io.port);
+	CHECK(slot->state == KKM_SWITCHLESS_IDLE, "slot state %u",
+	      slot->state);
+
+	sl.spin_ns = 0;
+	CHECK(ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_SWITCHLESS, &sl) ==
+		      0,
+	      "disable failed errno %d", errno);
+	return 0;
+}
+
+/*
+ * read(2) on registered guest fd is done from pipe without exit to monitor,
+ * read(2) into lazy slot takes syscall exit and is completed by km
+ */
+int test_direct_io(kkm_t *kkm)
+{
+	static const char message[] = "kkm direct io";
+	struct kkm_direct_io dio;
+	struct kkm_regs regs;
+	struct kkm_sregs sregs;
+	struct kkm_hc_args *hc = NULL;
+	unsigned char resident = 0;
+	int pipe_fd[2];
+
+	if (pipe(pipe_fd) != 0) {
+		perror("pipe:");
+		return -1;
+	}
+
+	memset(&dio, 0, sizeof(struct kkm_direct_io));
+	dio.guest_fd = -1;
+	dio.host_fd = pipe_fd[0];
+	dio.ops = KKM_DIRECT_IO_READ;
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_SET_DIRECT_IO, &dio) < 0 &&
+		      errno == EINVAL,
+	      "negative guest fd accepted");
+	dio.guest_fd = DIRECT_IO_GUEST_FD;
+	dio.ops = 1U << 5;
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_SET_DIRECT_IO, &dio) < 0 &&
+		      errno == EINVAL,
+	      "unknown ops accepted");
+	dio.ops = KKM_DIRECT_IO_READ;
+	dio.host_fd = -1;
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_SET_DIRECT_IO, &dio) < 0 &&
+		      errno == EINVAL,
+	      "negative host fd accepted");
+	dio.host_fd = pipe_fd[0];
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_SET_DIRECT_IO, &dio) == 0,
+	      "register failed errno %d", errno);
+
+	if (write(pipe_fd[1], message, sizeof(message)) != sizeof(message) ||
+	    load_guest(kkm, syscall_code, sizeof(syscall_code)) != 0 ||
+	    get_guest_regs(kkm, &regs) != 0) {
+		return -1;
+	}
+	memset(kkm->guest_mem + DIRECT_IO_OFFSET, 0, sizeof(message));
+	regs.rax = SYS_read;
+	regs.rdi = DIRECT_IO_GUEST_FD;
+	regs.rsi = GUEST_MEM_VA + DIRECT_IO_OFFSET;
+	regs.rdx = 2 * sizeof(message);
+	if (set_guest_regs(kkm, &regs) != 0 || run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(get_guest_rax(kkm) == sizeof(message), "read returned %ld",
+	      (long)get_guest_rax(kkm));
+	CHECK(memcmp(kkm->guest_mem + DIRECT_IO_OFFSET, message,
+		     sizeof(message)) == 0,
+	      "read data mismatch");
+
+	/* buffer in never touched lazy page, pipe data is left for km */
+	if (ioctl(kkm->context_device_fd, KKM_GET_SREGS, &sregs) < 0) {
+		perror("ioctl KKM_GET_SREGS:");
+		return -1;
+	}
+	sregs.gs.base = GUEST_MEM_VA + DIRECT_IO_HC_PTR_OFFSET;
+	if (ioctl(kkm->context_device_fd, KKM_SET_SREGS, &sregs) < 0) {
+		perror("ioctl KKM_SET_SREGS:");
+		return -1;
+	}
+	if (write(pipe_fd[1], message, sizeof(message)) != sizeof(message) ||
+	    load_guest(kkm, syscall_code, sizeof(syscall_code)) != 0 ||
+	    get_guest_regs(kkm, &regs) != 0) {
+		return -1;
+	}
+	regs.rax = SYS_read;
+	regs.rdi = DIRECT_IO_GUEST_FD;
+	regs.rsi = DIRECT_IO_LAZY_VA;
+	regs.rdx = sizeof(message);
+	if (set_guest_regs(kkm, &regs) != 0 || run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(kkm->run->io.port == (HYPERCALL_IO_PORT_BASE | SYS_read),
+	      "port %x expected read hypercall", kkm->run->io.port);
+	mincore((void *)(KKM_KM_USER_MEM_BASE + DIRECT_IO_LAZY_VA), 0x1000,
+		&resident);
+	CHECK((resident & 1) == 0, "lazy page populated by direct io");
+
+	/* km completes read */
+	hc = (struct kkm_hc_args *)(KKM_KM_USER_MEM_BASE +
+				    *(uint64_t *)(kkm->guest_mem +
+						  DIRECT_IO_HC_PTR_OFFSET));
+	CHECK(hc->argument2 == DIRECT_IO_LAZY_VA, "hypercall buffer %lx",
+	      hc->argument2);
+	hc->ret_val = DIRECT_IO_LAZY_RET;
+	if (run_guest(kkm) != 0) {
+		return -1;
+	}
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+	CHECK(get_guest_rax(kkm) == DIRECT_IO_LAZY_RET, "read returned %ld",
+	      (long)get_guest_rax(kkm));
+
+	dio.ops = 0;
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_SET_DIRECT_IO, &dio) == 0,
+	      "remove failed errno %d", errno);
+	close(pipe_fd[0]);
+	close(pipe_fd[1]);
+	return 0;
+}
+
+struct run_kontext_arg {
+	kkm_t *kkm;
+	volatile bool done;
+	int failures;
+};
+
+static void *run_kontext_thread(void *arg)
+{
+	struct run_kontext_arg *rk = arg;
+	int i = 0;
+
+	for (i = 0; i < RUN_KONTEXT_RUNS; i++) {
+		if (ioctl(rk->kkm->kontain_device_fd, KKM_RUN_KONTEXT,
+			  TEST_KONTEXT_INDEX) < 0) {
+			/* main thread owns kontext for KKM_GET_FPU */
+			if (errno == EBUSY) {
+				continue;
+			}
+			rk->failures++;
+		} else if (rk->kkm->run->exit_reason != KKM_EXIT_IO) {
+			rk->failures++;
+		}
+	}
+	rk->done = true;
+	return NULL;
+}
+
+/*
+ * kontext is run by index from any thread, while it runs
+ * GET_REGS works and ioctls needing ownership fail with EBUSY
+ */
+int test_run_kontext(kkm_t *kkm)
+{
+	struct run_kontext_arg rk;
+	struct kkm_regs regs;
+	struct kkm_fpu fpu;
+	pthread_t thread;
+	long busy = 0;
+	long regs_failed = 0;
+
+	if (load_guest(kkm, hypercall_loop_code,
+		       sizeof(hypercall_loop_code)) != 0) {
+		return -1;
+	}
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_RUN_KONTEXT,
+		    TEST_KONTEXT_INDEX + 100) < 0 &&
+		      errno == EINVAL,
+	      "unknown kontext index accepted");
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_RUN_KONTEXT,
+		    TEST_KONTEXT_INDEX) == 0,
+	      "run failed errno %d", errno);
+	CHECK(kkm->run->exit_reason == KKM_EXIT_IO,
+	      "exit reason %u expected io", kkm->run->exit_reason);
+
+	memset(&rk, 0, sizeof(struct run_kontext_arg));
+	rk.kkm = kkm;
+	if (pthread_create(&thread, NULL, run_kontext_thread, &rk) != 0) {
+		perror("pthread_create:");
+		return -1;
+	}
+	while (rk.done == false) {
+		if (ioctl(kkm->context_device_fd, KKM_GET_REGS, &regs) < 0) {
+			regs_failed++;
+		}
+		if (ioctl(kkm->context_device_fd, KKM_GET_FPU, &fpu) < 0 &&
+		    errno == EBUSY) {
+			busy++;
+		}
+	}
+	pthread_join(thread, NULL);
+
+	printf("run kontext : %ld EBUSY while running\n", busy);
+	CHECK(rk.failures == 0, "%d runs failed", rk.failures);
+	CHECK(regs_failed == 0, "KKM_GET_REGS failed %ld times", regs_failed);
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		CHECK(busy > 0, "KKM_GET_FPU never saw kontext running");
+	}
+	return 0;
+}
+
+/*
+ * forked child gets kontainer with parent memory and
+ * kontext with parent kontext state and registrations
+ */
+int test_clone_kontainer(kkm_t *kkm)
+{
+	struct kkm_clone_kontainer ck;
+	struct kkm_rseq rseq;
+	kkm_t child;
+	void *addr = NULL;
+	pid_t pid = 0;
+	int status = 0;
+
+	memset(&ck, 0, sizeof(struct kkm_clone_kontainer));
+	ck.kontext_index = TEST_KONTEXT_INDEX;
+	CHECK(ioctl(kkm->kontain_device_fd, KKM_CLONE_KONTAINER, &ck) < 0 &&
+		      errno == EINVAL,
+	      "clone into parent mm accepted");
+
+	memset(&rseq, 0, sizeof(struct kkm_rseq));
+	rseq.rseq = GUEST_MEM_VA + RSEQ_OFFSET;
+	rseq.len = 32;
+	rseq.sig = RSEQ_TEST_SIG;
+	if (load_guest(kkm, hypercall_loop_code,
+		       sizeof(hypercall_loop_code)) != 0 ||
+	    ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq) < 0) {
+		return -1;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork:");
+		return -1;
+	}
+	if (pid == 0) {
+		ck.kontext_index = TEST_KONTEXT_INDEX + 100;
+		CHECK(ioctl(kkm->kontain_device_fd, KKM_CLONE_KONTAINER, &ck) <
+				      0 &&
+			      errno == EINVAL,
+		      "clone of unknown kontext index accepted");
+
+		ck.kontext_index = TEST_KONTEXT_INDEX;
+		child = *kkm;
+		child.kontain_device_fd =
+			ioctl(kkm->kontain_device_fd, KKM_CLONE_KONTAINER, &ck);
+		if (child.kontain_device_fd < 0) {
+			perror("ioctl KKM_CLONE_KONTAINER:");
+			_exit(1);
+		}
+		CHECK(ck.kontext_fd >= 0, "kontext fd %d", ck.kontext_fd);
+		child.context_device_fd = ck.kontext_fd;
+		addr = mmap(NULL, kkm->context_map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, child.context_device_fd, 0);
+		if (addr == MAP_FAILED) {
+			perror("mmap child kontext:");
+			_exit(1);
+		}
+		child.run = addr;
+
+		if (run_guest(&child) != 0) {
+			_exit(1);
+		}
+		CHECK(child.run->exit_reason == KKM_EXIT_IO,
+		      "child exit reason %u expected io",
+		      child.run->exit_reason);
+		CHECK(ioctl(child.context_device_fd, KKM_KONTEXT_SET_RSEQ,
+			    &rseq) < 0 &&
+			      errno == EBUSY,
+		      "rseq registration not inherited");
+		fflush(stdout);
+		_exit(test_failures == 0 ? 0 : 1);
+	}
+
+	waitpid(pid, &status, 0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "child status %x", status);
+
+	rseq.flags = KKM_RSEQ_FLAG_UNREGISTER;
+	ioctl(kkm->context_device_fd, KKM_KONTEXT_SET_RSEQ, &rseq);
+	return 0;
+}
+
+/*
+ * payload runs with host XCR0, nothing else can be set
+ * subsets are rejected from driver version 13
+ */
+int test_xcrs(kkm_t *kkm)
+{
+	struct kkm_xcrs xcrs;
+
+	CHECK(kkm->driver_version >= 13, "driver version %d",
+	      kkm->driver_version);
+	memset(&xcrs, 0, sizeof(struct kkm_xcrs));
+	if (ioctl(kkm->context_device_fd, KKM_GET_XCRS, &xcrs) < 0) {
+		perror("ioctl KKM_GET_XCRS:");
+		return -1;
+	}
+	CHECK(xcrs.nr_xcrs == 1 && xcrs.xcrs[0].xcr == 0, "nr_xcrs %u xcr %u",
+	      xcrs.nr_xcrs, xcrs.xcrs[0].xcr);
+	CHECK(ioctl(kkm->context_device_fd, KKM_SET_XCRS, &xcrs) == 0,
+	      "host XCR0 rejected errno %d", errno);
+
+	/* subset without SSE state */
+	xcrs.xcrs[0].value &= ~(1ULL << 1);
+	CHECK(ioctl(kkm->context_device_fd, KKM_SET_XCRS, &xcrs) < 0 &&
+		      errno == EINVAL,
+	      "XCR0 %lx accepted", xcrs.xcrs[0].value);
+	return 0;
+}
+
+static int perf_open_dtlb(uint64_t op, bool *user_only)
+{
+	struct perf_event_attr attr;
+	int fd = -1;
+
+	memset(&attr, 0, sizeof(struct perf_event_attr));
+	attr.size = sizeof(struct perf_event_attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0) {
+		/* perf_event_paranoid > 1, count payload only */
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		*user_only = true;
+	}
+	return fd;
+}
+
+static uint64_t perf_read(int fd)
+{
+	uint64_t count = 0;
+
+	if (fd < 0 || read(fd, &count, sizeof(uint64_t)) != sizeof(uint64_t)) {
+		return 0;
+	}
+	return count;
+}
+
+static void read_module_param(const char *name, char *buf, size_t len)
+{
+	char path[128];
+	FILE *fp = NULL;
+
+	snprintf(path, sizeof(path), "/sys/module/kkm/parameters/%s", name);
+	strncpy(buf, "?", len);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return;
+	}
+	if (fgets(buf, len, fp) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+	}
+	fclose(fp);
+}
+
+/*
+ * dTLB misses and time per hypercall exit
+ * compare runs with /sys/module/kkm/parameters/lazy_flush_tlb
+ * set to N(guest PCIDs flushed on every entry) and Y
+ */
+int bench_hypercall_exits(kkm_t *kkm, long exits)
+{
+	int load_fd = -1, store_fd = -1;
+	bool user_only = false;
+	struct timespec start, end;
+	uint64_t load_misses = 0, store_misses = 0;
+	double ns = 0;
+	char lazy[16];
+	long i = 0;
+
+	if (load_guest(kkm, hypercall_loop_code,
+		       sizeof(hypercall_loop_code)) != 0) {
+		return 1;
+	}
+
+	load_fd = perf_open_dtlb(PERF_COUNT_HW_CACHE_OP_READ, &user_only);
+	store_fd = perf_open_dtlb(PERF_COUNT_HW_CACHE_OP_WRITE, &user_only);
+	if (load_fd < 0) {
+		perror("perf_event_open dTLB-load-misses:");
+	}
+
+	/* first entry builds guest page tables, keep it out */
+	if (ioctl(kkm->context_device_fd, KKM_RUN, NULL) < 0) {
+		perror("ioctl KKM_RUN:");
+		return 1;
+	}
+
+	ioctl(load_fd, PERF_EVENT_IOC_ENABLE, 0);
+	ioctl(store_fd, PERF_EVENT_IOC_ENABLE, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < exits; i++) {
+		if (ioctl(kkm->context_device_fd, KKM_RUN, NULL) < 0) {
+			perror("ioctl KKM_RUN:");
+			return 1;
+		}
+		if (kkm->run->exit_reason != KKM_EXIT_IO) {
+			printf("bench: unexpected exit reason %u\n",
+			       kkm->run->exit_reason);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ioctl(load_fd, PERF_EVENT_IOC_DISABLE, 0);
+	ioctl(store_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	load_misses = perf_read(load_fd);
+	store_misses = perf_read(store_fd);
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	read_module_param("lazy_flush_tlb", lazy, sizeof(lazy));
+
+	printf("bench hypercall exits : %ld lazy_flush_tlb %s%s\n", exits,
+	       lazy, user_only ? " (user mode misses only)" : "");
+	printf("ns/exit : %.1f\n", ns / exits);
+	printf("dTLB-load-misses/exit : %.3f\n",
+	       (load_fd < 0) ? -1.0 : (double)load_misses / exits);
+	printf("dTLB-store-misses/exit : %.3f\n",
+	       (store_fd < 0) ? -1.0 : (double)store_misses / exits);
+
+	if (load_fd >= 0) {
+		close(load_fd);
+	}
+	if (store_fd >= 0) {
+		close(store_fd);
+	}
+	return 0;
+}
+
+/*
+ * test_kkm		device smoke test
+ * test_kkm test		behavior checks
+ * test_kkm bench [exits]	hypercall exit benchmark
+ */
+int main(int argc, char *argv[])
+{
+	int ret_val = 0;
+	long exits = BENCH_DEFAULT_EXITS;
+
+	if (init(&kkm) != 0) {
+		return 1;
+	}
 	create_kontainer(&kkm);
 	get_mapsize(&kkm);
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		if (argc > 2) {
+			exits = strtol(argv[2], NULL, 0);
+		}
+		create_context(&kkm);
+		if (setup_guest(&kkm) != 0) {
+			cleanup(&kkm);
+			return 1;
+		}
+		ret_val = bench_hypercall_exits(&kkm, exits);
+		cleanup(&kkm);
+		return ret_val;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "test") == 0) {
+		create_context(&kkm);
+		if (setup_guest(&kkm) != 0 || test_lazy_fault(&kkm) != 0 ||
+		    test_payload_pml4_sync(&kkm) != 0 ||
+		    test_fault_handler(&kkm) != 0 ||
+		    test_clone_kontainer(&kkm) != 0 ||
+		    test_direct_io(&kkm) != 0 ||
+		    test_switchless(&kkm) != 0 ||
+		    test_run_kontext(&kkm) != 0 ||
+		    test_perf(&kkm) != 0 ||
+		    test_xcrs(&kkm) != 0 ||
+		    test_rseq(&kkm) != 0) {
+			test_failures++;
+		}
+		printf("tests %s, %d failures\n",
+		       (test_failures == 0) ? "passed" : "failed",
+		       test_failures);
+		cleanup(&kkm);
+		return (test_failures == 0) ? 0 : 1;
+	}
+
 	get_cpuid(&kkm);
 	add_memory(&kkm);
 	create_context(&kkm);
 	cleanup(&kkm);
-	return 0;
+	return ret_val;
 }